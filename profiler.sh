@@ -12,6 +12,7 @@ usage() {
     echo "  list              list profiling events supported by the target JVM"
     echo "  collect           collect profile for the specified period of time"
     echo "                    and then stop (default action)"
+    echo "  snapshot          dump profile collected so far without stopping"
     echo "Options:"
     echo "  -e event          profiling event: cpu|alloc|lock|cache-misses etc."
     echo "  -d duration       run profiling for <duration> seconds"
@@ -22,23 +23,39 @@ usage() {
     echo "  -s                simple class names instead of FQN"
     echo "  -g                print method signatures"
     echo "  -a                annotate Java method names"
-    echo "  -o fmt            output format: flat|traces|collapsed|flamegraph|tree|jfr"
+    echo "  -l                append line numbers to Java method names"
+    echo "  -o fmt            output format: flat|traces|collapsed|binary|pprof|flamegraph|tree|heatmap|jfr"
     echo "  -I include        output only stack traces containing the specified pattern"
     echo "  -X exclude        exclude stack traces with the specified pattern"
+    echo "  --prefilter       apply -I/-X to Java methods when recording samples"
+    echo "  --leaks           with -e nativemem: show only allocations that are not freed"
     echo "  -v, --version     display version string"
     echo ""
     echo "  --title string    FlameGraph title"
     echo "  --minwidth pct    skip frames smaller than pct%"
     echo "  --reverse         generate stack-reversed FlameGraph / Call tree"
+    echo "  --diff file       color FlameGraph by the difference with baseline collapsed stacks"
+    echo ""
+    echo "  --window duration split profile into time windows of the given length"
+    echo "  --history N       keep N last time windows (default: 60)"
+    echo "  --slice N         dump only the N-th last time window (0 = current)"
     echo ""
     echo "  --alloc bytes     allocation profiling interval in bytes"
     echo "  --lock duration   lock profiling threshold in nanoseconds"
+    echo "  --lockowner N     sample owner stacks of contended monitors N times per second"
+    echo "  --tracemem bytes  limit memory for stack traces, fold rare traces into [other]"
+    echo "  --hugepages mode  back stack trace storage with huge pages: thp|explicit"
+    echo "  --numa            NUMA-aware stack trace storage"
+    echo "  --crashfile path  mirror stack traces to a file that survives a crash of the JVM"
+    echo "  --crashsize bytes size of the crash file (default: 64m)"
     echo "  --total           accumulate the total value (time, bytes, etc.)"
+    echo "  --gzip            compress collapsed output (default for .gz files)"
     echo "  --all-user        only include user-mode events"
-    echo "  --cstack mode     how to traverse C stack: fp|lbr|no"
+    echo "  --cstack mode     how to traverse C stack: fp|dwarf|lbr|no"
     echo "  --begin function  begin profiling when function is executed"
     echo "  --end function    end profiling when function is executed"
     echo "  --ttsp            time-to-safepoint profiling"
+    echo "  --reset           with snapshot: start collecting a new profile after dumping"
     echo ""
     echo "<pid> is a numeric process ID of the target JVM"
     echo "      or 'jps' keyword to find running JVM automatically"
@@ -126,7 +143,7 @@ while [ $# -gt 0 ]; do
         -h|"-?")
             usage
             ;;
-        start|resume|stop|check|status|list|collect)
+        start|resume|stop|check|status|list|collect|snapshot)
             ACTION="$1"
             ;;
         -v|--version)
@@ -165,6 +182,9 @@ while [ $# -gt 0 ]; do
         -a)
             FORMAT="$FORMAT,ann"
             ;;
+        -l)
+            FORMAT="$FORMAT,lines"
+            ;;
         -o)
             OUTPUT="$2"
             shift
@@ -177,6 +197,12 @@ while [ $# -gt 0 ]; do
             FORMAT="$FORMAT,exclude=$2"
             shift
             ;;
+        --prefilter)
+            PARAMS="$PARAMS,prefilter"
+            ;;
+        --leaks)
+            PARAMS="$PARAMS,leaks"
+            ;;
         --filter)
             FILTER="$(echo "$2" | sed 's/,/;/g')"
             FORMAT="$FORMAT,filter=$FILTER"
@@ -195,16 +221,47 @@ while [ $# -gt 0 ]; do
         --reverse)
             FORMAT="$FORMAT,reverse"
             ;;
-        --samples|--total)
+        --diff)
+            # Baseline is read by the target process, so make the path absolute
+            case "$2" in
+                /*) FORMAT="$FORMAT,diff=$2" ;;
+                *)  FORMAT="$FORMAT,diff=$PWD/$2" ;;
+            esac
+            shift
+            ;;
+        --window|--history)
+            PARAMS="$PARAMS,${1#--}=$2"
+            shift
+            ;;
+        --slice)
+            FORMAT="$FORMAT,slice=$2"
+            shift
+            ;;
+        --samples|--total|--gzip)
             FORMAT="$FORMAT,${1#--}"
             ;;
-        --alloc|--lock)
+        --alloc|--lock|--lockowner|--tracemem|--crashsize)
             PARAMS="$PARAMS,${1#--}=$2"
             shift
             ;;
         --all-user)
             PARAMS="$PARAMS,alluser"
             ;;
+        --hugepages)
+            PARAMS="$PARAMS,hugepages=$2"
+            shift
+            ;;
+        --numa)
+            PARAMS="$PARAMS,numa"
+            ;;
+        --crashfile)
+            # The file is created by the target process, so make the path absolute
+            case "$2" in
+                /*) PARAMS="$PARAMS,crashfile=$2" ;;
+                *)  PARAMS="$PARAMS,crashfile=$PWD/$2" ;;
+            esac
+            shift
+            ;;
         --cstack|--call-graph)
             PARAMS="$PARAMS,cstack=$2"
             shift
@@ -213,6 +270,9 @@ while [ $# -gt 0 ]; do
             PARAMS="$PARAMS,${1#--}=$2"
             shift
             ;;
+        --reset)
+            FORMAT="$FORMAT,reset"
+            ;;
         --ttsp)
             PARAMS="$PARAMS,begin=SafepointSynchronize::begin,end=RuntimeService::record_safepoint_synchronized"
             ;;
@@ -283,8 +343,8 @@ case $ACTION in
     start|resume|check)
         jattach "$ACTION,file=$FILE,$OUTPUT$FORMAT$PARAMS"
         ;;
-    stop)
-        jattach "stop,file=$FILE,$OUTPUT$FORMAT"
+    stop|snapshot)
+        jattach "$ACTION,file=$FILE,$OUTPUT$FORMAT"
         ;;
     status)
         jattach "status,file=$FILE"
@@ -41,6 +41,8 @@ const int SYSCALL_SIZE = 2;
 const int PLT_HEADER_SIZE = 16;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 8;  // PERF_REG_X86_IP
+const int PERF_REG_SP = 7;  // PERF_REG_X86_SP
+const int PERF_REG_FP = 6;  // PERF_REG_X86_BP
 
 #define spinPause()       asm volatile("pause")
 #define rmb()             asm volatile("lfence" : : : "memory")
@@ -56,6 +58,8 @@ const int SYSCALL_SIZE = sizeof(instruction_t);
 const int PLT_HEADER_SIZE = 20;
 const int PLT_ENTRY_SIZE = 12;
 const int PERF_REG_PC = 15;  // PERF_REG_ARM_PC
+const int PERF_REG_SP = 13;  // PERF_REG_ARM_SP
+const int PERF_REG_FP = 11;  // PERF_REG_ARM_FP
 
 #define spinPause()       asm volatile("yield")
 #define rmb()             asm volatile("dmb ish" : : : "memory")
@@ -70,6 +74,8 @@ const int SYSCALL_SIZE = sizeof(instruction_t);
 const int PLT_HEADER_SIZE = 32;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 32;  // PERF_REG_ARM64_PC
+const int PERF_REG_SP = 31;  // PERF_REG_ARM64_SP
+const int PERF_REG_FP = 29;  // PERF_REG_ARM64_X29
 
 #define spinPause()       asm volatile("yield")
 #define rmb()             asm volatile("dmb ish" : : : "memory")
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "arguments.h"
+#include "os.h"
 
 
 // Predefined value that denotes successful operation
@@ -50,14 +51,21 @@ const size_t EXTRA_BUF_SIZE = 512;
 //     stop            - stop profiling
 //     check           - check if the specified profiling event is available
 //     status          - print profiling status (inactive / running for X seconds)
+//     snapshot        - dump profile collected so far without stopping profiler
+//     reset           - with snapshot: discard dumped samples and continue with an empty profile
 //     list            - show the list of available profiling events
 //     version[=full]  - display the agent version
 //     event=EVENT     - which event to trace (cpu, wall, cache-misses, etc.)
 //     alloc[=BYTES]   - profile allocations with BYTES interval
 //     lock[=DURATION] - profile contended locks longer than DURATION ns
+//     lockowner[=N]   - with lock: sample the owner thread and stack of up to N monitors per second (default: 2)
 //     collapsed       - dump collapsed stacks (the format used by FlameGraph script)
+//     gzip            - compress collapsed output; implied by .gz file name
+//     binary          - dump call stacks in the mmappable binary format (see binaryProfile.h)
+//     pprof           - dump gzipped profile in pprof (protobuf) format
 //     flamegraph      - produce Flame Graph in HTML format
 //     tree            - produce call tree in HTML format
+//     heatmap         - dump collapsed stacks with a separate counter for each time window
 //     jfr             - dump events in Java Flight Recorder format
 //     traces[=N]      - dump top N call traces
 //     flat[=N]        - dump top N methods (aka flat profile)
@@ -65,26 +73,38 @@ const size_t EXTRA_BUF_SIZE = 512;
 //     total           - count the total value (time, bytes, etc.) instead of samples"
 //     interval=N      - sampling interval in ns (default: 10'000'000, i.e. 10 ms)
 //     jstackdepth=N   - maximum Java stack depth (default: 2048)
+//     tracemem=BYTES  - limit memory for call traces; rare traces are truncated or folded into [other]
+//     hugepages[=MODE]- back call trace storage with huge pages: 'thp' (transparent, default) or 'explicit'
+//     numa            - allocate call traces on the local NUMA node, interleave hash tables
+//     crashfile=PATH  - mirror call traces to a file that survives the process being killed
+//     crashsize=BYTES - size of the crash file (default: 64m)
 //     safemode=BITS   - disable stack recovery techniques (default: 0, i.e. everything enabled)
 //     file=FILENAME   - output file name for dumping
 //     log=FILENAME    - log warnings and errors to the given dedicated stream
 //     filter=FILTER   - thread filter
 //     threads         - profile different threads separately
 //     cstack=MODE     - how to collect C stack frames in addition to Java stack
-//                       MODE is 'fp' (Frame Pointer), 'lbr' (Last Branch Record) or 'no'
+//                       MODE is 'fp' (Frame Pointer), 'dwarf', 'lbr' (Last Branch Record) or 'no'
 //     allkernel       - include only kernel-mode events
 //     alluser         - include only user-mode events
 //     simple          - simple class names instead of FQN
 //     dot             - dotted class names
 //     sig             - print method signatures
 //     ann             - annotate Java method names
+//     lines           - append line numbers to Java method names
 //     include=PATTERN - include stack traces containing PATTERN
 //     exclude=PATTERN - exclude stack traces containing PATTERN
+//     prefilter       - apply include/exclude to Java methods already when recording samples
+//     leaks           - with event=nativemem: dump only allocations that have not been freed
 //     begin=FUNCTION  - begin profiling when FUNCTION is executed
 //     end=FUNCTION    - end profiling when FUNCTION is executed
+//     window=DURATION - additionally count samples in time windows of the given length
+//     history=N       - how many last time windows to keep (default: 60)
+//     slice=N         - dump only the N-th last time window instead of the entire profile
 //     title=TITLE     - FlameGraph title
 //     minwidth=PCT    - FlameGraph minimum frame width in percent
 //     reverse         - generate stack-reversed FlameGraph / Call tree
+//     diff=FILE       - color FlameGraph by the difference with baseline collapsed stacks
 //
 // It is possible to specify multiple dump options at the same time
 
@@ -124,6 +144,9 @@ Error Arguments::parse(const char* args) {
             CASE("status")
                 _action = ACTION_STATUS;
 
+            CASE("snapshot")
+                _action = ACTION_SNAPSHOT;
+
             CASE("list")
                 _action = ACTION_LIST;
 
@@ -134,12 +157,24 @@ Error Arguments::parse(const char* args) {
             CASE("collapsed")
                 _output = OUTPUT_COLLAPSED;
 
+            CASE("gzip")
+                _gzip = true;
+
+            CASE("binary")
+                _output = OUTPUT_BINARY;
+
+            CASE("pprof")
+                _output = OUTPUT_PPROF;
+
             CASE("flamegraph")
                 _output = OUTPUT_FLAMEGRAPH;
 
             CASE("tree")
                 _output = OUTPUT_TREE;
 
+            CASE("heatmap")
+                _output = OUTPUT_HEATMAP;
+
             CASE("jfr")
                 _output = OUTPUT_JFR;
                 _jfr_options = value == NULL ? 0 :
@@ -154,6 +189,9 @@ Error Arguments::parse(const char* args) {
                 _output = OUTPUT_TEXT;
                 _dump_flat = value == NULL ? INT_MAX : atoi(value);
 
+            CASE("reset")
+                _reset = true;
+
             CASE("samples")
                 _counter = COUNTER_SAMPLES;
 
@@ -186,6 +224,11 @@ Error Arguments::parse(const char* args) {
                     msg = "lock must be >= 0";
                 }
 
+            CASE("lockowner")
+                if ((_lockowner = value == NULL ? DEFAULT_LOCKOWNER : atoi(value)) <= 0) {
+                    msg = "Invalid lockowner";
+                }
+
             CASE("interval")
                 if (value == NULL || (_interval = parseUnits(value)) <= 0) {
                     msg = "Invalid interval";
@@ -196,6 +239,34 @@ Error Arguments::parse(const char* args) {
                     msg = "jstackdepth must be > 0";
                 }
 
+            CASE("tracemem")
+                if (value == NULL || (_tracemem = parseUnits(value)) < 0) {
+                    msg = "Invalid tracemem";
+                }
+
+            CASE("hugepages")
+                if (value == NULL || strcmp(value, "thp") == 0) {
+                    _memory_policy |= MEMORY_HUGE_PAGES;
+                } else if (strcmp(value, "explicit") == 0) {
+                    _memory_policy |= MEMORY_HUGETLB;
+                } else {
+                    msg = "hugepages must be thp or explicit";
+                }
+
+            CASE("numa")
+                _memory_policy |= MEMORY_NUMA;
+
+            CASE("crashfile")
+                if (value == NULL || value[0] == 0) {
+                    msg = "crashfile must not be empty";
+                }
+                _crashfile = value;
+
+            CASE("crashsize")
+                if (value == NULL || (_crashsize = parseUnits(value)) <= 0) {
+                    msg = "Invalid crashsize";
+                }
+
             CASE("safemode")
                 _safe_mode = value == NULL ? INT_MAX : (int)strtol(value, NULL, 0);
 
@@ -218,6 +289,12 @@ Error Arguments::parse(const char* args) {
             CASE("exclude")
                 if (value != NULL) appendToEmbeddedList(_exclude, value);
 
+            CASE("prefilter")
+                _prefilter = true;
+
+            CASE("leaks")
+                _leaks = true;
+
             CASE("threads")
                 _threads = true;
 
@@ -231,6 +308,8 @@ Error Arguments::parse(const char* args) {
                 if (value != NULL) {
                     if (value[0] == 'n') {
                         _cstack = CSTACK_NO;
+                    } else if (value[0] == 'd') {
+                        _cstack = CSTACK_DWARF;
                     } else if (value[0] == 'l') {
                         _cstack = CSTACK_LBR;
                     } else {
@@ -251,12 +330,31 @@ Error Arguments::parse(const char* args) {
             CASE("ann")
                 _style |= STYLE_ANNOTATE;
 
+            CASE("lines")
+                _style |= STYLE_LINES;
+
             CASE("begin")
                 _begin = value;
 
             CASE("end")
                 _end = value;
 
+            // Time series
+            CASE("window")
+                if (value == NULL || (_window = parseUnits(value)) <= 0) {
+                    msg = "Invalid window";
+                }
+
+            CASE("history")
+                if (value == NULL || (_history = atoi(value)) <= 0) {
+                    msg = "history must be > 0";
+                }
+
+            CASE("slice")
+                if (value == NULL || (_slice = atoi(value)) < 0) {
+                    msg = "slice must be >= 0";
+                }
+
             // FlameGraph options
             CASE("title")
                 _title = value;
@@ -266,6 +364,12 @@ Error Arguments::parse(const char* args) {
 
             CASE("reverse")
                 _reverse = true;
+
+            CASE("diff")
+                if (value == NULL || value[0] == 0) {
+                    msg = "diff must not be empty";
+                }
+                _diff = value;
         }
     }
 
@@ -282,6 +386,13 @@ Error Arguments::parse(const char* args) {
         _file = expandFilePattern(_buf + len + 1, EXTRA_BUF_SIZE - 1, _file);
     }
 
+    if (_file != NULL) {
+        size_t file_len = strlen(_file);
+        if (file_len > 3 && strcmp(_file + file_len - 3, ".gz") == 0) {
+            _gzip = true;
+        }
+    }
+
     if (_file != NULL && _output == OUTPUT_NONE) {
         _output = detectOutputFormat(_file);
         if (_output == OUTPUT_SVG) {
@@ -291,6 +402,20 @@ Error Arguments::parse(const char* args) {
         _dump_flat = 200;
     }
 
+    if (_action == ACTION_SNAPSHOT && _output == OUTPUT_NONE) {
+        _output = OUTPUT_TEXT;
+        _dump_traces = 100;
+        _dump_flat = 200;
+    }
+
+    if (_gzip && _output != OUTPUT_NONE && (_output != OUTPUT_COLLAPSED || _file == NULL)) {
+        return Error("gzip is supported only for collapsed output to a file");
+    }
+
+    if ((_output == OUTPUT_BINARY || _output == OUTPUT_PPROF) && _file == NULL) {
+        return Error("Binary output requires a file");
+    }
+
     if (_output != OUTPUT_NONE && (_action == ACTION_NONE || _action == ACTION_STOP)) {
         _action = ACTION_DUMP;
     }
@@ -354,6 +479,13 @@ Output Arguments::detectOutputFormat(const char* file) {
             return OUTPUT_JFR;
         } else if (strcmp(ext, ".collapsed") == 0 || strcmp(ext, ".folded") == 0) {
             return OUTPUT_COLLAPSED;
+        } else if (strcmp(ext, ".pb") == 0 || strcmp(ext, ".pprof") == 0) {
+            return OUTPUT_PPROF;
+        } else if (strcmp(ext, ".aprof") == 0) {
+            return OUTPUT_BINARY;
+        } else if (strcmp(ext, ".gz") == 0) {
+            // Only collapsed output can be compressed
+            return OUTPUT_COLLAPSED;
         } else if (strcmp(ext, ".svg") == 0) {
             return OUTPUT_SVG;
         }
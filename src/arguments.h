@@ -22,12 +22,18 @@
 
 const long DEFAULT_INTERVAL = 10000000;  // 10 ms
 const int DEFAULT_JSTACKDEPTH = 2048;
+const int DEFAULT_HISTORY = 60;
+const int DEFAULT_LOCKOWNER = 2;  // samples per second
 
 const char* const EVENT_CPU    = "cpu";
 const char* const EVENT_ALLOC  = "alloc";
 const char* const EVENT_LOCK   = "lock";
 const char* const EVENT_WALL   = "wall";
 const char* const EVENT_ITIMER = "itimer";
+const char* const EVENT_OFFCPU = "offcpu";
+const char* const EVENT_MEMLOADS = "mem-loads";
+const char* const EVENT_NATIVEMEM = "nativemem";
+const char* const EVENT_NATIVELOCK = "nativelock";
 
 enum Action {
     ACTION_NONE,
@@ -39,7 +45,8 @@ enum Action {
     ACTION_LIST,
     ACTION_VERSION,
     ACTION_FULL_VERSION,
-    ACTION_DUMP
+    ACTION_DUMP,
+    ACTION_SNAPSHOT
 };
 
 enum Counter {
@@ -57,13 +64,15 @@ enum Style {
     STYLE_SIMPLE     = 1,
     STYLE_DOTTED     = 2,
     STYLE_SIGNATURES = 4,
-    STYLE_ANNOTATE   = 8
+    STYLE_ANNOTATE   = 8,
+    STYLE_LINES      = 16
 };
 
 enum CStack {
     CSTACK_DEFAULT,
     CSTACK_NO,
     CSTACK_FP,
+    CSTACK_DWARF,
     CSTACK_LBR
 };
 
@@ -72,8 +81,11 @@ enum Output {
     OUTPUT_TEXT,
     OUTPUT_SVG,  // obsolete
     OUTPUT_COLLAPSED,
+    OUTPUT_BINARY,
+    OUTPUT_PPROF,
     OUTPUT_FLAMEGRAPH,
     OUTPUT_TREE,
+    OUTPUT_HEATMAP,
     OUTPUT_JFR
 };
 
@@ -129,13 +141,20 @@ class Arguments {
     long _interval;
     long _alloc;
     long _lock;
+    int _lockowner;
     int  _jstackdepth;
+    long _tracemem;
+    int _memory_policy;
+    const char* _crashfile;
+    long _crashsize;
     int _safe_mode;
     const char* _file;
     const char* _log;
     const char* _filter;
     int _include;
     int _exclude;
+    bool _prefilter;
+    bool _leaks;
     bool _threads;
     int _style;
     CStack _cstack;
@@ -143,12 +162,19 @@ class Arguments {
     int _jfr_options;
     int _dump_traces;
     int _dump_flat;
+    bool _gzip;
     const char* _begin;
     const char* _end;
+    bool _reset;
+    // Time series
+    long _window;
+    int _history;
+    int _slice;
     // FlameGraph parameters
     const char* _title;
     double _minwidth;
     bool _reverse;
+    const char* _diff;
 
     Arguments() :
         _buf(NULL),
@@ -160,13 +186,20 @@ class Arguments {
         _interval(0),
         _alloc(0),
         _lock(0),
+        _lockowner(0),
         _jstackdepth(DEFAULT_JSTACKDEPTH),
+        _tracemem(0),
+        _memory_policy(0),
+        _crashfile(NULL),
+        _crashsize(0),
         _safe_mode(0),
         _file(NULL),
         _log(NULL),
         _filter(NULL),
         _include(0),
         _exclude(0),
+        _prefilter(false),
+        _leaks(false),
         _threads(false),
         _style(0),
         _cstack(CSTACK_DEFAULT),
@@ -174,11 +207,17 @@ class Arguments {
         _jfr_options(0),
         _dump_traces(0),
         _dump_flat(0),
+        _gzip(false),
         _begin(NULL),
         _end(NULL),
+        _reset(false),
+        _window(0),
+        _history(DEFAULT_HISTORY),
+        _slice(-1),
         _title(NULL),
         _minwidth(0),
-        _reverse(false) {
+        _reverse(false),
+        _diff(NULL) {
     }
 
     ~Arguments();
@@ -188,7 +227,7 @@ class Arguments {
     Error parse(const char* args);
 
     bool hasOutputFile() const {
-        return _file != NULL && (_action == ACTION_DUMP ? _output != OUTPUT_JFR : _action >= ACTION_STATUS);
+        return _file != NULL && (_action >= ACTION_DUMP ? _output != OUTPUT_JFR : _action >= ACTION_STATUS);
     }
 
     bool hasOption(JfrOption option) const {
@@ -196,6 +235,7 @@ class Arguments {
     }
 
     friend class FrameName;
+    friend class MethodFilter;
     friend class Recording;
 };
 
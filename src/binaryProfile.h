@@ -0,0 +1,76 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BINARYPROFILE_H
+#define _BINARYPROFILE_H
+
+#include "arch.h"
+
+
+// Binary profile is meant to be mmapped and aggregated without parsing.
+// Integers are in the native byte order (little-endian on all supported platforms).
+// Sections are 8-byte aligned and located by the absolute file offsets in the header:
+//
+//   BinaryProfileHeader
+//   u32 string_offsets[string_count + 1] - offsets of NUL-terminated strings within string data;
+//                                          the last one is the size of string data
+//   char string_data[]
+//   BinaryFrame frames[frame_count]
+//   BinaryStack stacks[stack_count]      - stack 0 is the empty root; parent index is always
+//                                          less than the index of the stack itself
+
+const char BINARY_PROFILE_MAGIC[8] = {'A', 'P', 'R', 'O', 'F', 0, 0, 0};
+const u32 BINARY_PROFILE_VERSION = 1;
+
+enum BinaryFrameType {
+    BINARY_FRAME_JAVA,
+    BINARY_FRAME_NATIVE,
+    BINARY_FRAME_CLASS,      // allocated class or class of the lock object
+    BINARY_FRAME_THREAD,
+    BINARY_FRAME_SYNTHETIC   // errors and other pseudo-frames
+};
+
+struct BinaryProfileHeader {
+    char magic[8];
+    u32 version;
+    u32 header_size;
+    u32 string_count;
+    u32 frame_count;
+    u32 stack_count;
+    u32 title;               // string index
+    u64 string_offsets;
+    u64 string_data;
+    u64 frames;
+    u64 stacks;
+    u64 total_samples;
+    u64 total_counter;
+};
+
+struct BinaryFrame {
+    u32 name;                // string index
+    u32 type;                // BinaryFrameType
+};
+
+// A call stack is its parent stack plus one more frame on top of it.
+// Samples are self counts: only the stacks that were actually sampled have them.
+struct BinaryStack {
+    u32 parent;
+    u32 frame;
+    u64 samples;
+    u64 counter;
+};
+
+#endif // _BINARYPROFILE_H
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <stdint.h>
 #include <string.h>
 #include "callTraceStorage.h"
 #include "os.h"
@@ -22,6 +23,15 @@
 static const u32 INITIAL_CAPACITY = 65536;
 static const u32 CALL_TRACE_CHUNK = 8 * 1024 * 1024;
 static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
+static const u32 OTHER_TRACE_ID = 0x7ffffffe;
+// How many outermost frames are kept when a trace is truncated under memory pressure
+static const int TRUNCATED_DEPTH = 32;
+// How many times a trace must be sampled under memory pressure before it is stored
+static const u8 ADMISSION_HITS = 4;
+// Sketch counters are halved after this many misses, so that old hits fade away
+static const u64 ADMISSION_WINDOW = ADMISSION_SKETCH_SIZE * 8;
+// A trace with this many samples is counted in per-CPU shards
+static const u64 HOT_TRACE_SAMPLES = 256;
 
 
 class LongHashTable {
@@ -29,21 +39,25 @@ class LongHashTable {
     LongHashTable* _prev;
     void* _padding0;
     u32 _capacity;
-    u32 _padding1[15];
+    int _policy;
+    u32 _padding1[14];
     volatile u32 _size;
     u32 _padding2[15];
 
-    static size_t getSize(u32 capacity) {
+  public:
+    static size_t getSize(u32 capacity, int policy) {
         size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity;
-        return (size + OS::page_mask) & ~OS::page_mask;
+        size_t mask = policy & MEMORY_HUGETLB ? HUGE_PAGE_SIZE - 1 : OS::page_mask;
+        return (size + mask) & ~mask;
     }
 
-  public:
-    static LongHashTable* allocate(LongHashTable* prev, u32 capacity) {
-        LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity));
+    // The table is probed at random from all CPUs, so with MEMORY_NUMA it is interleaved across nodes
+    static LongHashTable* allocate(LongHashTable* prev, u32 capacity, int policy) {
+        LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity, policy), policy);
         if (table != NULL) {
             table->_prev = prev;
             table->_capacity = capacity;
+            table->_policy = policy;
             table->_size = 0;
         }
         return table;
@@ -51,7 +65,7 @@ class LongHashTable {
 
     LongHashTable* destroy() {
         LongHashTable* prev = _prev;
-        OS::safeFree(this, getSize(_capacity));
+        OS::safeFree(this, getSize(_capacity, _policy));
         return prev;
     }
 
@@ -63,6 +77,10 @@ class LongHashTable {
         return _capacity;
     }
 
+    int policy() {
+        return _policy;
+    }
+
     u32 size() {
         return _size;
     }
@@ -87,16 +105,35 @@ class LongHashTable {
 
 
 CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, (jmethodID)"[storage_overflow]"}};
+CallTrace CallTraceStorage::_other_trace = {1, {BCI_ERROR, (jmethodID)"other"}};
+
+// Replaces leaf frames of a truncated trace
+static const ASGCT_CallFrame TRUNCATED_FRAME = {BCI_ERROR, (jmethodID)"truncated"};
 
 CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK) {
-    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY, 0);
     _overflow = 0;
+    _other.trace = &_other_trace;
+    _other.samples = 0;
+    _other.counter = 0;
+    _memory_limit = 0;
+    _peer = NULL;
+    _memory_policy = 0;
+    _table_memory = LongHashTable::getSize(INITIAL_CAPACITY, 0);
+    memset(_shards, 0, sizeof(_shards));
+    memset((void*)_misses, 0, sizeof(_misses));
+    _miss_count = 0;
 }
 
 CallTraceStorage::~CallTraceStorage() {
     // Do not free memory, as it may be accessed concurrently during VM shutdown
 }
 
+void CallTraceStorage::setMemoryPolicy(int policy) {
+    _memory_policy = policy;
+    _allocator.setMemoryPolicy(policy);
+}
+
 void CallTraceStorage::clear() {
     while (_current_table->prev() != NULL) {
         _current_table = _current_table->destroy();
@@ -104,8 +141,16 @@ void CallTraceStorage::clear() {
     _current_table->clear();
     _allocator.clear();
     _overflow = 0;
+    _other.samples = 0;
+    _other.counter = 0;
+    _table_memory = LongHashTable::getSize(_current_table->capacity(), _current_table->policy());
+    memset(_shards, 0, sizeof(_shards));
+    memset((void*)_misses, 0, sizeof(_misses));
+    _miss_count = 0;
 }
 
+// A slot is claimed by its key before the trace is stored, so a dump that runs
+// concurrently with put() may see a key with no trace yet; such slots are skipped
 void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
@@ -113,7 +158,7 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
         u32 capacity = table->capacity();
 
         for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+            if (keys[slot] != 0 && values[slot].trace != NULL) {
                 map[capacity - (INITIAL_CAPACITY - 1) + slot] = values[slot].trace;
             }
         }
@@ -122,34 +167,49 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
     if (_overflow > 0) {
         map[OVERFLOW_TRACE_ID] = &_overflow_trace;
     }
+    if (_other.samples > 0) {
+        map[OTHER_TRACE_ID] = &_other_trace;
+    }
 }
 
 void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
+    mergeShards();
+
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
 
         for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+            if (keys[slot] != 0 && values[slot].trace != NULL) {
                 samples.push_back(&values[slot]);
             }
         }
     }
+
+    if (_other.samples > 0) {
+        samples.push_back(&_other);
+    }
 }
 
 void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
+    mergeShards();
+
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
 
         for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+            if (keys[slot] != 0 && values[slot].trace != NULL) {
                 map[keys[slot]] += values[slot];
             }
         }
     }
+
+    if (_other.samples > 0) {
+        map[OTHER_TRACE_ID] += _other;
+    }
 }
 
 // Adaptation of MurmurHash64A by Austin Appleby
@@ -186,7 +246,8 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
 
 CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
     const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
-    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+    const size_t total_size = header_size + num_frames * sizeof(ASGCT_CallFrame);
+    CallTrace* buf = (CallTrace*)_allocator.alloc(total_size);
     if (buf != NULL) {
         buf->num_frames = num_frames;
         // Do not use memcpy inside signal handler
@@ -217,8 +278,60 @@ CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
 }
 
 u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+    if (_memory_limit > 0 && totalMemoryUsed() >= _memory_limit / 4 * 3) {
+        return putLimited(num_frames, frames, counter);
+    }
+    return putTrace(calcHash(num_frames, frames), num_frames, frames, counter, true);
+}
+
+// Modifies frames in place when truncating
+u32 CallTraceStorage::putLimited(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+    bool allow_new = totalMemoryUsed() < _memory_limit;
+
     u64 hash = calcHash(num_frames, frames);
+    u32 call_trace_id = putTrace(hash, num_frames, frames, counter, false);
+    if (call_trace_id != 0) {
+        return call_trace_id;
+    }
+
+    if (num_frames > TRUNCATED_DEPTH) {
+        // Fold into the parent trace; frames are ordered from the leaf to the root
+        frames += num_frames - TRUNCATED_DEPTH - 1;
+        num_frames = TRUNCATED_DEPTH + 1;
+        frames[0] = TRUNCATED_FRAME;
+        hash = calcHash(num_frames, frames);
+        call_trace_id = putTrace(hash, num_frames, frames, counter, false);
+    }
 
+    if (call_trace_id == 0 && allow_new && admit(hash)) {
+        call_trace_id = putTrace(hash, num_frames, frames, counter, true);
+    }
+
+    if (call_trace_id == 0) {
+        addSample(&_other, counter);
+        return OTHER_TRACE_ID;
+    }
+    return call_trace_id;
+}
+
+// Count-min sketch with two rows sharing one array. Lost updates from concurrent
+// signal handlers are harmless: they only delay admission of a trace.
+bool CallTraceStorage::admit(u64 hash) {
+    if (atomicInc(_miss_count) % ADMISSION_WINDOW == 0) {
+        for (int i = 0; i < ADMISSION_SKETCH_SIZE; i++) {
+            _misses[i] >>= 1;
+        }
+    }
+
+    volatile u8& a = _misses[hash & (ADMISSION_SKETCH_SIZE - 1)];
+    volatile u8& b = _misses[(hash >> 32) & (ADMISSION_SKETCH_SIZE - 1)];
+    if (a < ADMISSION_HITS) a = a + 1;
+    if (b < ADMISSION_HITS) b = b + 1;
+    return a >= ADMISSION_HITS && b >= ADMISSION_HITS;
+}
+
+// Returns 0 if the trace is not stored yet and allow_new is false
+u32 CallTraceStorage::putTrace(u64 hash, int num_frames, ASGCT_CallFrame* frames, u64 counter, bool allow_new) {
     LongHashTable* table = _current_table;
     u64* keys = table->keys();
     u32 capacity = table->capacity();
@@ -227,23 +340,37 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
 
     while (keys[slot] != hash) {
         if (keys[slot] == 0) {
+            // Migrate from a previous table to save space
+            CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
+            if (trace == NULL && !allow_new) {
+                return 0;
+            }
+
             if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
                 continue;
             }
 
             // Increment the table size, and if the load factor exceeds 0.75, reserve a new table
             if (table->incSize() == capacity * 3 / 4) {
-                LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
-                if (new_table != NULL) {
-                    __sync_bool_compare_and_swap(&_current_table, table, new_table);
+                size_t new_size = LongHashTable::getSize(capacity * 2, _memory_policy);
+                if (_memory_limit == 0 || totalMemoryUsed() + new_size <= _memory_limit) {
+                    LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2, _memory_policy);
+                    if (new_table != NULL) {
+                        atomicInc(_table_memory, new_size);
+                        __sync_bool_compare_and_swap(&_current_table, table, new_table);
+                    }
                 }
             }
 
-            // Migrate from a previous table to save space
-            CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
             if (trace == NULL) {
                 trace = storeCallTrace(num_frames, frames);
+                if (trace == NULL) {
+                    // Out of memory: the slot is already taken, so account samples to [other]
+                    trace = &_other_trace;
+                }
             }
+            // Frames must be visible to a concurrent dump before the trace pointer is
+            __sync_synchronize();
             table->values()[slot].trace = trace;
             break;
         }
@@ -257,9 +384,46 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
         slot = (slot + step) & (capacity - 1);
     }
 
-    CallTraceSample& s = table->values()[slot];
-    atomicInc(s.samples);
-    atomicInc(s.counter, counter);
-
+    addSample(&table->values()[slot], counter);
     return capacity - (INITIAL_CAPACITY - 1) + slot;
 }
+
+void CallTraceStorage::addSample(CallTraceSample* sample, u64 counter) {
+    if (sample->samples < HOT_TRACE_SAMPLES || !addShardSample(sample, counter)) {
+        atomicInc(sample->samples);
+        atomicInc(sample->counter, counter);
+    }
+}
+
+bool CallTraceStorage::addShardSample(CallTraceSample* sample, u64 counter) {
+    CounterShard& shard = _shards[(u32)OS::cpuId() % COUNTER_SHARDS];
+    CounterShardEntry& entry = shard.entries[(uintptr_t)sample / sizeof(CallTraceSample) % COUNTER_SHARD_ENTRIES];
+
+    // Entries are taken once and never evicted until clear()
+    CallTraceSample* target = entry.target;
+    if (target == NULL) {
+        target = __sync_val_compare_and_swap(&entry.target, (CallTraceSample*)NULL, sample);
+        if (target == NULL) target = sample;
+    }
+    if (target != sample) {
+        return false;
+    }
+
+    // Still atomic: a signal handler may interrupt another one on the same CPU
+    atomicInc(entry.samples);
+    atomicInc(entry.counter, counter);
+    return true;
+}
+
+// Moves shard counters to their targets without losing concurrent increments
+void CallTraceStorage::mergeShards() {
+    for (int i = 0; i < COUNTER_SHARDS; i++) {
+        for (int j = 0; j < COUNTER_SHARD_ENTRIES; j++) {
+            CounterShardEntry& entry = _shards[i].entries[j];
+            if (entry.target != NULL) {
+                atomicInc(entry.target->samples, __sync_fetch_and_and(&entry.samples, 0));
+                atomicInc(entry.target->counter, __sync_fetch_and_and(&entry.counter, 0));
+            }
+        }
+    }
+}
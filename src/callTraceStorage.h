@@ -48,22 +48,91 @@ struct CallTraceSample {
     }
 };
 
+// Samples of a hot trace counted privately by one CPU; merged into the target sample on collection
+struct CounterShardEntry {
+    CallTraceSample* volatile target;
+    volatile u64 samples;
+    volatile u64 counter;
+};
+
+// Counters of misses of traces that are not stored yet, while memory is short
+const int ADMISSION_SKETCH_SIZE = 4096;
+
+const int COUNTER_SHARDS = 64;
+const int COUNTER_SHARD_ENTRIES = 8;
+
+// Aligned, so that entries of different shards never share a cache line
+struct CounterShard {
+    CounterShardEntry entries[COUNTER_SHARD_ENTRIES];
+} __attribute__((aligned(64)));
+
+// Compile-time check: the array size is negative if a shard does not fill whole cache lines
+typedef char CounterShardSizeCheck[sizeof(CounterShard) % 64 == 0 ? 1 : -1];
+
+// With a memory limit, the storage degrades gracefully instead of failing.
+// Traces seen before keep being counted precisely, so the heavy hitters are preserved.
+// Once 3/4 of the limit is used, new traces are truncated to their outermost frames,
+// which makes them short and likely to coincide with other truncated traces.
+// The remaining memory goes to frequent traces rather than to whichever come first:
+// a new trace is stored only after it has been sampled a few times recently, as counted
+// by a small sketch that is periodically halved; until then, its samples go to [other].
+// When the limit is reached, samples of traces that are not yet stored go to [other].
+//
+// A trace hit from all CPUs would make its counters bounce between caches.
+// Once a trace becomes hot, each CPU counts its samples in a private shard instead,
+// as long as the shard has a free entry for it. Shards are merged when samples are collected.
 class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
+    static CallTrace _other_trace;
 
     LinearAllocator _allocator;
     LongHashTable* _current_table;
     u64 _overflow;
+    CallTraceSample _other;
+    u64 _memory_limit;
+    volatile u64 _table_memory;
+    CallTraceStorage* _peer;
+    int _memory_policy;
+    CounterShard _shards[COUNTER_SHARDS];
+    volatile u8 _misses[ADMISSION_SKETCH_SIZE];
+    volatile u64 _miss_count;
 
-    u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
     CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames);
     CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    u32 putTrace(u64 hash, int num_frames, ASGCT_CallFrame* frames, u64 counter, bool allow_new);
+    u32 putLimited(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    bool admit(u64 hash);
+    void addSample(CallTraceSample* sample, u64 counter);
+    bool addShardSample(CallTraceSample* sample, u64 counter);
+    void mergeShards();
+
+    u64 memoryUsed() {
+        return _table_memory + _allocator.reserved();
+    }
+
+    u64 totalMemoryUsed() {
+        return _peer != NULL ? memoryUsed() + _peer->memoryUsed() : memoryUsed();
+    }
 
   public:
     CallTraceStorage();
     ~CallTraceStorage();
 
+    // Identifies a call trace by its frames
+    static u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
+
+    // Limit of memory held by trace chunks and hash tables; 0 means unlimited.
+    // Memory of the peer storage, e.g. the other profile generation, counts towards the same limit.
+    void setMemoryLimit(u64 bytes, CallTraceStorage* peer) {
+        _memory_limit = bytes;
+        _peer = peer;
+    }
+
+    // MemoryPolicy for trace chunks and hash tables allocated from now on.
+    // Must not be called while samples are being recorded.
+    void setMemoryPolicy(int policy);
+
     void clear();
     void collectTraces(std::map<u32, CallTrace*>& map);
     void collectSamples(std::vector<CallTraceSample*>& samples);
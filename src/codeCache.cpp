@@ -16,7 +16,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "codeCache.h"
+#include "dwarf.h"
+#include "os.h"
 
 
 void CodeCache::expand() {
@@ -83,6 +86,9 @@ NativeCodeCache::NativeCodeCache(const char* name, const void* min_address, cons
     _name = strdup(name);
     _min_address = min_address;
     _max_address = max_address;
+    _dwarf_table = NULL;
+    _dwarf_table_length = 0;
+    memset(_imports, 0, sizeof(_imports));
 }
 
 NativeCodeCache::~NativeCodeCache() {
@@ -90,6 +96,7 @@ NativeCodeCache::~NativeCodeCache() {
         free(_blobs[i]._method);
     }
     free(_name);
+    free(_dwarf_table);
 }
 
 void NativeCodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
@@ -156,3 +163,47 @@ const void* NativeCodeCache::findSymbolByPrefix(const char* prefix, int prefix_l
     }
     return NULL;
 }
+
+void NativeCodeCache::setDwarfTable(FrameDesc* table, int length) {
+    _dwarf_table = table;
+    _dwarf_table_length = length;
+}
+
+FrameDesc* NativeCodeCache::findFrameDesc(const void* pc) {
+    u32 target_loc = (const char*)pc - (const char*)_min_address;
+    int low = 0;
+    int high = _dwarf_table_length - 1;
+
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (_dwarf_table[mid].loc < target_loc) {
+            low = mid + 1;
+        } else if (_dwarf_table[mid].loc > target_loc) {
+            high = mid - 1;
+        } else {
+            return &_dwarf_table[mid];
+        }
+    }
+
+    return low > 0 ? &_dwarf_table[low - 1] : NULL;
+}
+
+void NativeCodeCache::addImport(ImportId id, void** entry) {
+    for (int i = 0; i < MAX_IMPORT_ENTRIES; i++) {
+        if (_imports[id][i] == NULL || _imports[id][i] == entry) {
+            _imports[id][i] = entry;
+            return;
+        }
+    }
+}
+
+void NativeCodeCache::patchImport(ImportId id, void* address) {
+    for (int i = 0; i < MAX_IMPORT_ENTRIES && _imports[id][i] != NULL; i++) {
+        void** entry = _imports[id][i];
+        // GOT becomes read-only after relocation when the library is linked with -z relro
+        uintptr_t page = (uintptr_t)entry & ~(uintptr_t)OS::page_mask;
+        if (mprotect((void*)page, OS::page_size, PROT_READ | PROT_WRITE) == 0) {
+            __atomic_store_n(entry, address, __ATOMIC_RELEASE);
+        }
+    }
+}
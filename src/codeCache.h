@@ -25,6 +25,25 @@
 
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
 
+// Library functions whose GOT entries can be redirected to profiler hooks
+enum ImportId {
+    IMPORT_MALLOC,
+    IMPORT_CALLOC,
+    IMPORT_REALLOC,
+    IMPORT_FREE,
+    IMPORT_MMAP,
+    IMPORT_MUNMAP,
+    IMPORT_PTHREAD_MUTEX_LOCK,
+    IMPORT_PTHREAD_RWLOCK_RDLOCK,
+    IMPORT_PTHREAD_RWLOCK_WRLOCK,
+    NUM_IMPORTS
+};
+
+// A function may be imported both through PLT (JUMP_SLOT) and by address (GLOB_DAT)
+const int MAX_IMPORT_ENTRIES = 2;
+
+
+struct FrameDesc;
 
 class CodeBlob {
   public:
@@ -89,6 +108,9 @@ class CodeCache {
 class NativeCodeCache : public CodeCache {
   private:
     char* _name;
+    FrameDesc* _dwarf_table;
+    int _dwarf_table_length;
+    void** _imports[NUM_IMPORTS][MAX_IMPORT_ENTRIES];
 
   public:
     NativeCodeCache(const char* name,
@@ -115,6 +137,17 @@ class NativeCodeCache : public CodeCache {
     const void* findSymbol(const char* name);
     const void* findSymbolByPrefix(const char* prefix);
     const void* findSymbolByPrefix(const char* prefix, int prefix_len);
+
+    void setDwarfTable(FrameDesc* table, int length);
+    FrameDesc* findFrameDesc(const void* pc);
+
+    void addImport(ImportId id, void** entry);
+    bool hasImport(ImportId id) {
+        return _imports[id][0] != NULL;
+    }
+
+    // Redirects calls of the imported function made from this library
+    void patchImport(ImportId id, void* address);
 };
 
 #endif // _CODECACHE_H
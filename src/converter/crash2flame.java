@@ -0,0 +1,233 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.PrintStream;
+import java.io.RandomAccessFile;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.charset.StandardCharsets;
+import java.util.Arrays;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.Map;
+
+/**
+ * Reconstructs a profile from the crash file written by async-profiler
+ * with crashfile option, even if the profiled process was killed.
+ * The file format is described in crashFile.h.
+ */
+public class crash2flame {
+
+    private static final byte[] MAGIC = {'A', 'P', 'C', 'R', 'A', 'S', 'H', 0};
+    private static final int VERSION = 1;
+
+    private static final int RECORD_TRACE = 1;
+    private static final int RECORD_NAME = 2;
+
+    private static final int STYLE_LINES = 16;
+
+    private static final int SLOT_SIZE = 32;
+    private static final int FRAME_SIZE = 16;
+
+    private final MappedByteBuffer buf;
+    private final Map<Long, String> names = new HashMap<>();
+    private int style;
+    private long tableOffset;
+    private int tableCapacity;
+    private long recordsOffset;
+    private long recordsEnd;
+
+    public String title;
+    public long lostSamples;
+
+    public crash2flame(String fileName) throws IOException {
+        try (RandomAccessFile raf = new RandomAccessFile(fileName, "r")) {
+            if (raf.length() > Integer.MAX_VALUE) {
+                throw new IOException("Crash files larger than 2 GB are not supported");
+            }
+            buf = raf.getChannel().map(FileChannel.MapMode.READ_ONLY, 0, raf.length());
+        }
+        buf.order(ByteOrder.LITTLE_ENDIAN);
+        readHeader();
+        readNames();
+    }
+
+    private void readHeader() throws IOException {
+        byte[] magic = getBytes(0, MAGIC.length);
+        if (!Arrays.equals(magic, MAGIC)) {
+            throw new IOException("Not a crash file");
+        }
+        if (buf.getInt(8) != VERSION) {
+            throw new IOException("Unsupported crash file version " + buf.getInt(8));
+        }
+
+        tableOffset = buf.getLong(24);
+        tableCapacity = buf.getInt(32);
+        style = buf.getInt(36);
+        recordsOffset = buf.getLong(40);
+        long recordsCapacity = buf.getLong(48);
+        lostSamples = buf.getLong(64);
+
+        // Offsets are 64-bit in the file; make sure they fit in the mapped buffer before using them as int
+        offset(tableOffset, (long) tableCapacity * SLOT_SIZE);
+        offset(recordsOffset, recordsCapacity);
+        recordsEnd = recordsOffset + Math.min(buf.getLong(56), recordsCapacity);
+
+        byte[] titleBytes = getBytes(80, 64);
+        int len = 0;
+        while (len < titleBytes.length && titleBytes[len] != 0) {
+            len++;
+        }
+        title = new String(titleBytes, 0, len, StandardCharsets.UTF_8);
+    }
+
+    // Returns pos as a buffer index, if len bytes starting from pos are within the file
+    private int offset(long pos, long len) throws IOException {
+        if (pos < 0 || len < 0 || pos + len > buf.limit()) {
+            throw new IOException("Corrupted crash file: offset " + pos + " is out of range");
+        }
+        return (int) pos;
+    }
+
+    private byte[] getBytes(int pos, int len) {
+        byte[] bytes = new byte[len];
+        ByteBuffer dup = buf.duplicate();
+        dup.position(pos);
+        dup.get(bytes);
+        return bytes;
+    }
+
+    private void readNames() throws IOException {
+        for (long pos = recordsOffset + 8; pos + 8 <= recordsEnd; ) {
+            int record = offset(pos, 8);
+            int type = buf.getInt(record);
+            long size = buf.getInt(record + 4) & 0xffffffffL;
+            if (size == 0) {
+                // The process died while this record was being reserved
+                break;
+            }
+            if (type == RECORD_NAME) {
+                offset(pos, size);
+                long key = buf.getLong(record + 8);
+                int start = record + 16;
+                int end = start;
+                while (end < record + size && buf.get(end) != 0) {
+                    end++;
+                }
+                names.put(key, new String(getBytes(start, end - start), StandardCharsets.UTF_8));
+            }
+            pos += size;
+        }
+    }
+
+    // Mirrors FrameName::frameKey
+    private long frameKey(long methodId, int bci) {
+        if (bci < 0) {
+            return methodId ^ (long) (bci & 0xff) << 56;
+        } else if ((style & STYLE_LINES) != 0) {
+            return methodId ^ (long) (bci & 0xffff) << 48;
+        }
+        return methodId;
+    }
+
+    private String frameName(long methodId, int bci) {
+        String name = names.get(frameKey(methodId, bci));
+        return name != null ? name : "[unknown 0x" + Long.toHexString(methodId) + ']';
+    }
+
+    public void convert(FlameGraph fg, boolean total) throws IOException {
+        for (int i = 0; i < tableCapacity; i++) {
+            int slot = (int) (tableOffset + (long) i * SLOT_SIZE);
+            long samples = buf.getLong(slot + 8);
+            long counter = buf.getLong(slot + 16);
+            long trace = buf.getLong(slot + 24);
+            if (samples == 0) {
+                continue;
+            }
+
+            if (trace <= 0 || recordsOffset + trace + 16 > recordsEnd ||
+                    buf.getInt(offset(recordsOffset + trace, 16)) != RECORD_TRACE) {
+                lostSamples += samples;
+                continue;
+            }
+
+            // Frames are stored from the top one, while FlameGraph expects the root first
+            int pos = (int) (recordsOffset + trace);
+            int numFrames = buf.getInt(pos + 8);
+            offset(pos + 16, (numFrames & 0xffffffffL) * FRAME_SIZE);
+            String[] frames = new String[numFrames];
+            for (int j = 0; j < numFrames; j++) {
+                int frame = pos + 16 + j * FRAME_SIZE;
+                frames[numFrames - 1 - j] = frameName(buf.getLong(frame), buf.getInt(frame + 8));
+            }
+            fg.addSample(frames, total ? counter : samples);
+        }
+    }
+
+    public static void main(String[] args) throws Exception {
+        FlameGraph fg = new FlameGraph(args);
+        if (fg.input == null) {
+            System.out.println("Usage: java " + crash2flame.class.getName() + " [options] input.crash [output.html]");
+            System.out.println();
+            System.out.println("options include all supported FlameGraph options, plus the following:");
+            System.out.println("  --total      Accumulate the total value (time, bytes, etc.)");
+            System.out.println("  --collapsed  Write collapsed stacks instead of HTML");
+            System.exit(1);
+        }
+
+        HashSet<String> options = new HashSet<>(Arrays.asList(args));
+        boolean total = options.contains("--total");
+
+        crash2flame converter = new crash2flame(fg.input);
+
+        if (options.contains("--collapsed")) {
+            final Map<String, Long> stacks = new HashMap<>();
+            FlameGraph collector = new FlameGraph() {
+                @Override
+                public void addSample(String[] trace, long ticks) {
+                    StringBuilder sb = new StringBuilder(trace[0]);
+                    for (int i = 1; i < trace.length; i++) {
+                        sb.append(';').append(trace[i]);
+                    }
+                    String stack = sb.toString();
+                    Long prev = stacks.get(stack);
+                    stacks.put(stack, prev == null ? ticks : prev + ticks);
+                }
+            };
+            converter.convert(collector, total);
+
+            try (PrintStream out = fg.output == null ? System.out : new PrintStream(new FileOutputStream(fg.output), false, "UTF-8")) {
+                for (Map.Entry<String, Long> e : stacks.entrySet()) {
+                    out.println(e.getKey() + ' ' + e.getValue());
+                }
+            }
+        } else {
+            if (fg.title.equals("Flame Graph") && !converter.title.isEmpty()) {
+                fg.title = converter.title;
+            }
+            converter.convert(fg, total);
+            fg.dump();
+        }
+
+        if (converter.lostSamples > 0) {
+            System.err.println("Warning: " + converter.lostSamples + " samples did not fit in the crash file");
+        }
+    }
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "crashFile.h"
+#include "callTraceStorage.h"
+#include "frameName.h"
+
+
+static const u64 CHECKPOINT_INTERVAL = 1000000000;  // 1 s
+
+
+// The file can be resumed only if it is exactly the one this CrashFile wrote last time
+bool CrashFile::canResume(const CrashFileHeader& header, u64 size, int style) {
+    return _start_time != 0 && header.start_time == _start_time &&
+           memcmp(header.magic, CRASH_FILE_MAGIC, sizeof(CRASH_FILE_MAGIC)) == 0 &&
+           header.version == CRASH_FILE_VERSION && header.header_size == sizeof(CrashFileHeader) &&
+           header.file_size == size && header.style == (u32)style;
+}
+
+Error CrashFile::open(Arguments& args, bool reset, const char* title,
+                      Mutex& thread_names_lock, std::map<int, std::string>& thread_names) {
+    u64 size = args._crashsize > 0 ? (u64)args._crashsize : CRASH_FILE_DEFAULT_SIZE;
+    if (size < CRASH_FILE_MIN_SIZE) {
+        return Error("crashsize must be at least 1 MB");
+    }
+
+    // Not truncated right away: when the profiler is resumed, the file keeps accumulating samples
+    int fd = ::open(args._crashfile, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return Error("Could not create crash file");
+    }
+
+    CrashFileHeader old_header;
+    bool resume = !reset && lseek(fd, 0, SEEK_END) == (off_t)size &&
+                  pread(fd, &old_header, sizeof(old_header), 0) == sizeof(old_header) &&
+                  canResume(old_header, size, args._style);
+
+    void* addr = MAP_FAILED;
+    if ((resume || ftruncate(fd, 0) == 0) && ftruncate(fd, size) == 0) {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return Error("Could not map crash file");
+    }
+
+    CrashFileHeader* header = (CrashFileHeader*)addr;
+    if (resume) {
+        // Names of the frames recorded so far are already in the file, as close() writes them
+        _table = (CrashSlot*)((char*)addr + header->table_offset);
+        _records = (char*)addr + header->records_offset;
+        _mask = header->table_capacity - 1;
+    } else {
+        create(header, size, args._style, title);
+    }
+    _thread_names_lock = &thread_names_lock;
+    _thread_names = &thread_names;
+
+    __sync_synchronize();
+    _header = header;
+
+    _lock.lock();
+    _timer = OS::startTimer(CHECKPOINT_INTERVAL, timerCallback, this);
+    _lock.unlock();
+    return Error::OK;
+}
+
+void CrashFile::create(CrashFileHeader* header, u64 size, int style, const char* title) {
+    // About 1/8 of the file goes to the hash table, the rest is for trace and name records
+    u32 table_capacity = 1024;
+    while (table_capacity * 2 * sizeof(CrashSlot) <= size / 8) {
+        table_capacity *= 2;
+    }
+
+    // The file is fresh, so the whole mapping reads as zeros
+    header->version = CRASH_FILE_VERSION;
+    header->header_size = sizeof(CrashFileHeader);
+    header->file_size = size;
+    header->table_offset = sizeof(CrashFileHeader);
+    header->table_capacity = table_capacity;
+    header->style = style;
+    header->records_offset = header->table_offset + table_capacity * sizeof(CrashSlot);
+    header->records_capacity = size - header->records_offset;
+    header->records_used = sizeof(CrashRecord);
+    header->start_time = OS::millis();
+    strncpy(header->title, title, sizeof(header->title) - 1);
+    memcpy(header->magic, CRASH_FILE_MAGIC, sizeof(CRASH_FILE_MAGIC));
+
+    _table = (CrashSlot*)((char*)header + header->table_offset);
+    _records = (char*)header + header->records_offset;
+    _mask = table_capacity - 1;
+    _scanned = header->records_used;
+    _named = IdMap();
+    _style = style;
+    _start_time = header->start_time;
+}
+
+// Signal handlers must not write to the file during close
+void CrashFile::close() {
+    if (_header == NULL) {
+        return;
+    }
+
+    _lock.lock();
+    if (_timer != NULL) {
+        OS::stopTimer(_timer);
+        _timer = NULL;
+    }
+    // The caller is a Java thread, so names can be resolved right here
+    writeNames();
+
+    CrashFileHeader* header = _header;
+    _header = NULL;
+    _lock.unlock();
+
+    munmap(header, header->file_size);
+}
+
+char* CrashFile::reserve(u64 size) {
+    size = (size + 7) & ~7ULL;
+    u64 offset = __sync_fetch_and_add(&_header->records_used, size);
+    if (offset + size > _header->records_capacity) {
+        return NULL;
+    }
+
+    CrashRecord* record = (CrashRecord*)(_records + offset);
+    record->size = (u32)size;
+    return (char*)record;
+}
+
+void CrashFile::record(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+    u64 hash = CallTraceStorage::calcHash(num_frames, frames);
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    u32 slot = (u32)hash & _mask;
+    u32 step = 0;
+
+    while (_table[slot].hash != hash) {
+        if (_table[slot].hash == 0) {
+            if (!__sync_bool_compare_and_swap(&_table[slot].hash, 0, hash)) {
+                continue;
+            }
+
+            // The first sample of the trace appends its frames. If the file is full,
+            // the slot remains without a trace, and its samples are reported as lost.
+            CrashTrace* trace = (CrashTrace*)reserve(sizeof(CrashTrace) + num_frames * sizeof(CrashFrame));
+            if (trace != NULL) {
+                trace->num_frames = num_frames;
+                CrashFrame* f = (CrashFrame*)(trace + 1);
+                for (int i = 0; i < num_frames; i++) {
+                    f[i].method_id = (u64)(uintptr_t)frames[i].method_id;
+                    f[i].bci = frames[i].bci;
+                }
+                __sync_synchronize();
+                trace->record.type = CRASH_RECORD_TRACE;
+                _table[slot].trace = (char*)trace - _records;
+            }
+            break;
+        }
+
+        if (++step > _mask) {
+            atomicInc(_header->lost_samples);
+            return;
+        }
+        slot = (slot + step) & _mask;
+    }
+
+    CrashSlot& s = _table[slot];
+    atomicInc(s.samples);
+    atomicInc(s.counter, counter);
+}
+
+// Appends NAME records for the frames of the trace records that appeared since the last call
+void CrashFile::writeNames() {
+    u64 used = _header->records_used;
+    if (used > _header->records_capacity) {
+        used = _header->records_capacity;
+    }
+    if (_scanned >= used) {
+        return;
+    }
+
+    // Only the naming styles matter here: include/exclude are not applied to the crash file
+    Arguments args;
+    FrameName fn(args, _style, *_thread_names_lock, *_thread_names);
+
+    while (_scanned < used) {
+        CrashRecord* record = (CrashRecord*)(_records + _scanned);
+        if (record->type == 0 || record->size == 0) {
+            // A signal handler is still writing this record; continue from here next time
+            break;
+        }
+
+        if (record->type == CRASH_RECORD_TRACE) {
+            CrashTrace* trace = (CrashTrace*)record;
+            CrashFrame* f = (CrashFrame*)(trace + 1);
+            for (u32 i = 0; i < trace->num_frames; i++) {
+                ASGCT_CallFrame frame;
+                frame.bci = f[i].bci;
+                frame.method_id = (jmethodID)(uintptr_t)f[i].method_id;
+
+                u64 key = FrameName::frameKey(frame, _style);
+                if (_named.get(key) != 0) {
+                    continue;
+                }
+
+                const char* name = fn.name(frame);
+                size_t len = strlen(name);
+                CrashName* cn = (CrashName*)reserve(sizeof(CrashName) + len + 1);
+                if (cn == NULL) {
+                    // Out of space: no further records can be appended anyway
+                    _scanned = used;
+                    return;
+                }
+                cn->key = key;
+                memcpy(cn + 1, name, len + 1);
+                __sync_synchronize();
+                cn->record.type = CRASH_RECORD_NAME;
+                _named.put(key, 1);
+            }
+        }
+
+        _scanned += record->size;
+    }
+}
+
+void CrashFile::checkpoint() {
+    MutexLocker ml(_lock);
+
+    // Resolving method names with JVM TI requires a thread attached to the JVM
+    if (_timer != NULL && VM::attachThread("Async-profiler Crash File") != NULL) {
+        writeNames();
+        VM::detachThread();
+    }
+}
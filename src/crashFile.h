@@ -0,0 +1,140 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CRASHFILE_H
+#define _CRASHFILE_H
+
+#include <map>
+#include <string>
+#include "arch.h"
+#include "arguments.h"
+#include "idMap.h"
+#include "mutex.h"
+#include "os.h"
+#include "vmEntry.h"
+
+
+// Crash file is a MAP_SHARED file mapping that mirrors call trace storage.
+// Whatever is written to the mapping lands in the page cache at once, so the profile
+// survives the process being killed; crash2flame converter reconstructs it offline.
+// Integers are in the native byte order (little-endian on all supported platforms):
+//
+//   CrashFileHeader
+//   CrashSlot table[table_capacity]  - open addressing hash table of call traces
+//   records                          - append-only area of CrashRecords, each 8-byte aligned;
+//                                      offset 0 is reserved, so that 0 means no record
+//
+// A record is published by storing its type last. Records with zero type are incomplete.
+
+const char CRASH_FILE_MAGIC[8] = {'A', 'P', 'C', 'R', 'A', 'S', 'H', 0};
+const u32 CRASH_FILE_VERSION = 1;
+const u64 CRASH_FILE_MIN_SIZE = 1024 * 1024;
+const u64 CRASH_FILE_DEFAULT_SIZE = 64 * 1024 * 1024;
+
+enum CrashRecordType {
+    CRASH_RECORD_TRACE = 1,  // CrashTrace followed by num_frames CrashFrames, the top frame first
+    CRASH_RECORD_NAME  = 2   // CrashName followed by the NUL-terminated frame name
+};
+
+struct CrashFileHeader {
+    char magic[8];
+    u32 version;
+    u32 header_size;
+    u64 file_size;
+    u64 table_offset;
+    u32 table_capacity;
+    u32 style;               // FrameName style: NAME records are keyed by FrameName::frameKey
+    u64 records_offset;
+    u64 records_capacity;
+    volatile u64 records_used;
+    volatile u64 lost_samples;
+    u64 start_time;          // milliseconds since the epoch
+    char title[64];
+};
+
+struct CrashSlot {
+    volatile u64 hash;
+    volatile u64 samples;
+    volatile u64 counter;
+    volatile u64 trace;      // offset of the TRACE record within the records area
+};
+
+struct CrashRecord {
+    volatile u32 type;
+    u32 size;                // including the record header and padding
+};
+
+struct CrashTrace {
+    CrashRecord record;
+    u32 num_frames;
+    u32 reserved;
+};
+
+struct CrashFrame {
+    u64 method_id;
+    int bci;
+    u32 reserved;
+};
+
+struct CrashName {
+    CrashRecord record;
+    u64 key;
+};
+
+class CrashFile {
+  private:
+    CrashFileHeader* _header;
+    CrashSlot* _table;
+    char* _records;
+    u32 _mask;
+    u64 _scanned;
+    IdMap _named;
+    int _style;
+    u64 _start_time;
+    Mutex* _thread_names_lock;
+    std::map<int, std::string>* _thread_names;
+    Timer* _timer;
+    Mutex _lock;
+
+    bool canResume(const CrashFileHeader& header, u64 size, int style);
+    void create(CrashFileHeader* header, u64 size, int style, const char* title);
+    char* reserve(u64 size);
+    void writeNames();
+    void checkpoint();
+
+    static void timerCallback(void* arg) {
+        ((CrashFile*)arg)->checkpoint();
+    }
+
+  public:
+    CrashFile() : _header(NULL), _table(NULL), _records(NULL), _mask(0), _scanned(0), _named(),
+        _style(0), _start_time(0), _thread_names_lock(NULL), _thread_names(NULL), _timer(NULL), _lock() {
+    }
+
+    bool enabled() {
+        return _header != NULL;
+    }
+
+    // Unless reset is set, continues the file left by the previous close(), if it is still intact
+    Error open(Arguments& args, bool reset, const char* title,
+               Mutex& thread_names_lock, std::map<int, std::string>& thread_names);
+    void close();
+
+    // Signal-safe: counts the sample, appending the call trace to the file on its first occurrence
+    void record(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+};
+
+#endif // _CRASHFILE_H
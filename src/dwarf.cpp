@@ -0,0 +1,429 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dwarf.h"
+#include "log.h"
+
+
+enum {
+    DW_CFA_nop                 = 0x0,
+    DW_CFA_set_loc             = 0x1,
+    DW_CFA_advance_loc1        = 0x2,
+    DW_CFA_advance_loc2        = 0x3,
+    DW_CFA_advance_loc4        = 0x4,
+    DW_CFA_offset_extended     = 0x5,
+    DW_CFA_restore_extended    = 0x6,
+    DW_CFA_undefined           = 0x7,
+    DW_CFA_same_value          = 0x8,
+    DW_CFA_register            = 0x9,
+    DW_CFA_remember_state      = 0xa,
+    DW_CFA_restore_state       = 0xb,
+    DW_CFA_def_cfa             = 0xc,
+    DW_CFA_def_cfa_register    = 0xd,
+    DW_CFA_def_cfa_offset      = 0xe,
+    DW_CFA_def_cfa_expression  = 0xf,
+    DW_CFA_expression          = 0x10,
+    DW_CFA_offset_extended_sf  = 0x11,
+    DW_CFA_def_cfa_sf          = 0x12,
+    DW_CFA_def_cfa_offset_sf   = 0x13,
+    DW_CFA_val_offset          = 0x14,
+    DW_CFA_val_offset_sf       = 0x15,
+    DW_CFA_val_expression      = 0x16,
+    DW_CFA_GNU_args_size       = 0x2e,
+    DW_CFA_GNU_negative_offset_extended = 0x2f,
+
+    DW_CFA_advance_loc         = 0x1,
+    DW_CFA_offset              = 0x2,
+    DW_CFA_restore             = 0x3
+};
+
+enum {
+    DW_OP_breg0 = 0x70
+};
+
+enum {
+    DW_EH_PE_absptr  = 0x00,
+    DW_EH_PE_uleb128 = 0x01,
+    DW_EH_PE_udata2  = 0x02,
+    DW_EH_PE_udata4  = 0x03,
+    DW_EH_PE_udata8  = 0x04,
+    DW_EH_PE_sleb128 = 0x09,
+    DW_EH_PE_sdata2  = 0x0a,
+    DW_EH_PE_sdata4  = 0x0b,
+    DW_EH_PE_sdata8  = 0x0c,
+    DW_EH_PE_pcrel   = 0x10,
+    DW_EH_PE_datarel = 0x30,
+    DW_EH_PE_omit    = 0xff
+};
+
+
+FrameDesc FrameDesc::default_frame = {0, DW_REG_FP | (2 * DW_STACK_SLOT) << 8, -2 * DW_STACK_SLOT, -DW_STACK_SLOT};
+
+
+DwarfParser::DwarfParser(const char* name, const char* image_base, const char* eh_frame_hdr) {
+    _name = name;
+    _image_base = image_base;
+
+    _capacity = 128;
+    _count = 0;
+    _table = NULL;
+    _in_cie = false;
+
+    if (DWARF_SUPPORTED) {
+        _table = (FrameDesc*)malloc(_capacity * sizeof(FrameDesc));
+        parse(eh_frame_hdr);
+    }
+}
+
+const char* DwarfParser::getPtr(u8 encoding) {
+    const char* base = _ptr;
+    uintptr_t value;
+
+    switch (encoding & 0x0f) {
+        case DW_EH_PE_absptr:  value = *(uintptr_t*)_ptr; _ptr += sizeof(uintptr_t); break;
+        case DW_EH_PE_uleb128: value = getLeb(); break;
+        case DW_EH_PE_udata2:  value = get16(); break;
+        case DW_EH_PE_udata4:  value = get32(); break;
+        case DW_EH_PE_udata8:  value = (uintptr_t)*(u64*)_ptr; _ptr += 8; break;
+        case DW_EH_PE_sleb128: value = getSLeb(); break;
+        case DW_EH_PE_sdata2:  value = (short)get16(); break;
+        case DW_EH_PE_sdata4:  value = (int)get32(); break;
+        case DW_EH_PE_sdata8:  value = (uintptr_t)*(u64*)_ptr; _ptr += 8; break;
+        default: return NULL;
+    }
+
+    if ((encoding & 0x70) == DW_EH_PE_pcrel) {
+        value += (uintptr_t)base;
+    }
+    return (const char*)value;
+}
+
+void DwarfParser::parse(const char* eh_frame_hdr) {
+    u8 version = eh_frame_hdr[0];
+    u8 eh_frame_ptr_enc = eh_frame_hdr[1];
+    u8 fde_count_enc = eh_frame_hdr[2];
+    u8 table_enc = eh_frame_hdr[3];
+
+    // The binary search table is what makes .eh_frame_hdr useful; without it we would need to scan .eh_frame
+    if (version != 1 || fde_count_enc != DW_EH_PE_udata4 || table_enc != (DW_EH_PE_datarel | DW_EH_PE_sdata4)) {
+        Log::warn("Unsupported .eh_frame_hdr in %s", _name);
+        return;
+    }
+
+    _ptr = eh_frame_hdr + 4;
+    getPtr(eh_frame_ptr_enc);
+    u32 fde_count = get32();
+
+    const int* table = (const int*)_ptr;
+    for (u32 i = 0; i < fde_count; i++) {
+        parseFde(eh_frame_hdr + table[i * 2 + 1]);
+    }
+}
+
+bool DwarfParser::parseCie(const char* cie) {
+    _ptr = cie;
+
+    u32 cie_len = get32();
+    if (cie_len == 0 || cie_len == 0xffffffff) {
+        return false;
+    }
+
+    const char* cie_end = _ptr + cie_len;
+    if (get32() != 0) {
+        return false;  // not a CIE
+    }
+
+    u8 version = get8();
+    const char* augmentation = _ptr;
+    _ptr += strlen(augmentation) + 1;
+
+    _code_align = getLeb();
+    _data_align = getSLeb();
+    _ra_reg = version == 1 ? get8() : getLeb();
+    _ptr_encoding = DW_EH_PE_absptr;
+    _has_augmentation_data = augmentation[0] == 'z';
+
+    if (_has_augmentation_data) {
+        u32 augmentation_len = getLeb();
+        const char* augmentation_end = _ptr + augmentation_len;
+        for (const char* a = augmentation + 1; *a != 0; a++) {
+            if (*a == 'R') {
+                _ptr_encoding = get8();
+            } else if (*a == 'P') {
+                getPtr(get8());
+            } else if (*a == 'L') {
+                get8();
+            }
+        }
+        _ptr = augmentation_end;
+    } else if (augmentation[0] != 0) {
+        return false;
+    }
+
+    // Before the initial instructions, CFA is the stack pointer,
+    // and the return address is in the register where the call has put it
+    _state.cfa_reg = DW_REG_SP;
+    _state.cfa_off = 0;
+    _state.fp_off = DW_SAME_VALUE;
+    _state.pc_off = DW_SAME_VALUE;
+    _remembered_count = 0;
+
+    _in_cie = true;
+    parseInstructions(0, cie_end);
+    _in_cie = false;
+
+    _initial_state = _state;
+    return true;
+}
+
+void DwarfParser::parseFde(const char* fde) {
+    _ptr = fde;
+
+    u32 fde_len = get32();
+    if (fde_len == 0 || fde_len == 0xffffffff) {
+        return;
+    }
+
+    const char* fde_end = _ptr + fde_len;
+    // CIE pointer is relative to its own position in the section
+    const char* cie_pointer = _ptr;
+    u32 cie_offset = get32();
+    const char* cie = cie_pointer - cie_offset;
+    if (!parseCie(cie)) {
+        return;
+    }
+
+    _ptr = fde + 8;
+    const char* range_start = getPtr(_ptr_encoding);
+    uintptr_t range_len = (uintptr_t)getPtr(_ptr_encoding & 0x0f);
+    if (range_start < _image_base || range_start - _image_base + range_len > 0xffffffffUL) {
+        return;
+    }
+
+    if (_has_augmentation_data) {
+        u32 augmentation_len = getLeb();
+        _ptr += augmentation_len;
+    }
+
+    u32 loc = range_start - _image_base;
+    _state = _initial_state;
+    _remembered_count = 0;
+
+    parseInstructions(loc, fde_end);
+
+    // The row after the end of the range tells there is no information about the following code
+    State no_info = {DW_REG_FP, 2 * DW_STACK_SLOT, -2 * DW_STACK_SLOT, -DW_STACK_SLOT};
+    addRecord(loc + (u32)range_len, no_info);
+}
+
+void DwarfParser::parseInstructions(u32 loc, const char* end) {
+    const u32 code_align = _code_align;
+    const int data_align = _data_align;
+
+    // Each row is emitted when the location advances, i.e. after all rules for the row are known
+    while (_ptr < end) {
+        u8 op = get8();
+        switch (op >> 6) {
+            case 0:
+                switch (op) {
+                    case DW_CFA_nop:
+                        break;
+                    case DW_CFA_set_loc:
+                        addRecord(loc, _state);
+                        loc = getPtr(_ptr_encoding) - _image_base;
+                        break;
+                    case DW_CFA_advance_loc1:
+                        addRecord(loc, _state);
+                        loc += get8() * code_align;
+                        break;
+                    case DW_CFA_advance_loc2:
+                        addRecord(loc, _state);
+                        loc += get16() * code_align;
+                        break;
+                    case DW_CFA_advance_loc4:
+                        addRecord(loc, _state);
+                        loc += get32() * code_align;
+                        break;
+                    case DW_CFA_offset_extended: {
+                        int reg = getLeb();
+                        setReg(reg, getLeb() * data_align);
+                        break;
+                    }
+                    case DW_CFA_restore_extended: {
+                        int reg = getLeb();
+                        if (reg == DW_REG_FP) _state.fp_off = _initial_state.fp_off;
+                        if (reg == DW_REG_PC) _state.pc_off = _initial_state.pc_off;
+                        break;
+                    }
+                    case DW_CFA_undefined:
+                    case DW_CFA_same_value:
+                        setReg(getLeb(), DW_SAME_VALUE);
+                        break;
+                    case DW_CFA_register: {
+                        int reg = getLeb();
+                        getLeb();
+                        setReg(reg, DW_SAME_VALUE);
+                        break;
+                    }
+                    case DW_CFA_remember_state:
+                        if (_remembered_count < MAX_REMEMBERED_STATES) {
+                            _remembered[_remembered_count] = _state;
+                        }
+                        _remembered_count++;
+                        break;
+                    case DW_CFA_restore_state:
+                        if (_remembered_count > 0 && --_remembered_count < MAX_REMEMBERED_STATES) {
+                            _state = _remembered[_remembered_count];
+                        }
+                        break;
+                    case DW_CFA_def_cfa:
+                        _state.cfa_reg = getLeb();
+                        _state.cfa_off = getLeb();
+                        break;
+                    case DW_CFA_def_cfa_register:
+                        _state.cfa_reg = getLeb();
+                        break;
+                    case DW_CFA_def_cfa_offset:
+                        _state.cfa_off = getLeb();
+                        break;
+                    case DW_CFA_def_cfa_expression: {
+                        u32 len = getLeb();
+                        const char* expression_end = _ptr + len;
+                        _state.cfa_reg = parseExpression(expression_end);
+                        _ptr = expression_end;
+                        break;
+                    }
+                    case DW_CFA_expression:
+                    case DW_CFA_val_expression: {
+                        int reg = getLeb();
+                        u32 len = getLeb();
+                        _ptr += len;
+                        setReg(reg, DW_SAME_VALUE);
+                        break;
+                    }
+                    case DW_CFA_offset_extended_sf: {
+                        int reg = getLeb();
+                        setReg(reg, getSLeb() * data_align);
+                        break;
+                    }
+                    case DW_CFA_def_cfa_sf:
+                        _state.cfa_reg = getLeb();
+                        _state.cfa_off = getSLeb() * data_align;
+                        break;
+                    case DW_CFA_def_cfa_offset_sf:
+                        _state.cfa_off = getSLeb() * data_align;
+                        break;
+                    case DW_CFA_val_offset:
+                    case DW_CFA_val_offset_sf: {
+                        int reg = getLeb();
+                        getLeb();
+                        setReg(reg, DW_SAME_VALUE);
+                        break;
+                    }
+                    case DW_CFA_GNU_args_size:
+                        getLeb();
+                        break;
+                    case DW_CFA_GNU_negative_offset_extended: {
+                        int reg = getLeb();
+                        setReg(reg, -(int)getLeb() * data_align);
+                        break;
+                    }
+                    default:
+                        // Cannot interpret the rest of the program
+                        _state.cfa_reg = DW_REG_INVALID;
+                        addRecord(loc, _state);
+                        _ptr = end;
+                        return;
+                }
+                break;
+            case DW_CFA_advance_loc:
+                addRecord(loc, _state);
+                loc += (op & 0x3f) * code_align;
+                break;
+            case DW_CFA_offset:
+                setReg(op & 0x3f, getLeb() * data_align);
+                break;
+            case DW_CFA_restore:
+                if ((op & 0x3f) == DW_REG_FP) _state.fp_off = _initial_state.fp_off;
+                if ((op & 0x3f) == DW_REG_PC) _state.pc_off = _initial_state.pc_off;
+                break;
+        }
+    }
+
+    addRecord(loc, _state);
+}
+
+// The only CFA expression we understand is the one generated for PLT entries on x86_64:
+// rsp + 8 + ((rip & 15) >= 11 ? 8 : 0)
+int DwarfParser::parseExpression(const char* end) {
+#ifdef __x86_64__
+    if (_ptr < end && (u8)*_ptr == DW_OP_breg0 + DW_REG_SP) {
+        _ptr++;
+        int offset = getSLeb();
+        if (_ptr < end && (u8)*_ptr == DW_OP_breg0 + DW_REG_PC) {
+            _state.cfa_off = offset;
+            return DW_REG_PLT;
+        }
+    }
+#endif
+    return DW_REG_INVALID;
+}
+
+void DwarfParser::setReg(int reg, int offset) {
+    if (reg == DW_REG_FP) {
+        _state.fp_off = offset;
+    } else if (reg == DW_REG_PC) {
+        _state.pc_off = offset;
+    }
+}
+
+void DwarfParser::addRecord(u32 loc, const State& state) {
+    if (_table == NULL || _in_cie) {
+        return;
+    }
+
+    int cfa_reg = (u32)state.cfa_reg < DW_REG_INVALID ? state.cfa_reg : DW_REG_INVALID;
+    int cfa = cfa_reg | state.cfa_off << 8;
+
+    // Keep the table sorted: a new row supersedes all rows at the same or higher address
+    while (_count > 0 && _table[_count - 1].loc >= loc) {
+        _count--;
+    }
+
+    if (_count > 0) {
+        FrameDesc* prev = &_table[_count - 1];
+        if (prev->cfa == cfa && prev->fp_off == state.fp_off && prev->pc_off == state.pc_off) {
+            return;
+        }
+    }
+
+    if (_count >= _capacity) {
+        FrameDesc* new_table = (FrameDesc*)realloc(_table, _capacity * 2 * sizeof(FrameDesc));
+        if (new_table == NULL) {
+            return;
+        }
+        _table = new_table;
+        _capacity *= 2;
+    }
+
+    FrameDesc* f = &_table[_count++];
+    f->loc = loc;
+    f->cfa = cfa;
+    f->fp_off = state.fp_off;
+    f->pc_off = state.pc_off;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DWARF_H
+#define _DWARF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arch.h"
+
+
+#if defined(__x86_64__)
+
+#define DWARF_SUPPORTED true
+
+const int DW_REG_FP = 6;
+const int DW_REG_SP = 7;
+const int DW_REG_PC = 16;
+
+#elif defined(__i386__)
+
+#define DWARF_SUPPORTED true
+
+const int DW_REG_FP = 5;
+const int DW_REG_SP = 4;
+const int DW_REG_PC = 8;
+
+#elif defined(__aarch64__)
+
+#define DWARF_SUPPORTED true
+
+const int DW_REG_FP = 29;
+const int DW_REG_SP = 31;
+const int DW_REG_PC = 30;
+
+#else
+
+#define DWARF_SUPPORTED false
+
+const int DW_REG_FP = 0;
+const int DW_REG_SP = 1;
+const int DW_REG_PC = 2;
+
+#endif
+
+const int DW_REG_PLT = 128;      // special CFA rule for PLT entries
+const int DW_REG_INVALID = 255;  // the frame cannot be unwound
+
+const int DW_SAME_VALUE = 0x80000000;  // register is not saved in this frame
+const int DW_STACK_SLOT = sizeof(void*);
+
+
+// A row of the unwind table: how to find CFA, saved FP and return address
+// for all instructions from `loc` up to the next row.
+// CFA rule is encoded as (register | offset << 8).
+// fp_off and pc_off are offsets relative to CFA.
+struct FrameDesc {
+    u32 loc;
+    int cfa;
+    int fp_off;
+    int pc_off;
+
+    // Used for code without unwind info: assume a regular frame with frame pointer
+    static FrameDesc default_frame;
+
+    static int comparator(const void* p1, const void* p2) {
+        FrameDesc* fd1 = (FrameDesc*)p1;
+        FrameDesc* fd2 = (FrameDesc*)p2;
+        return fd1->loc < fd2->loc ? -1 : fd1->loc > fd2->loc ? 1 : 0;
+    }
+};
+
+
+// Converts .eh_frame of a loaded library into a compact sorted table of FrameDesc,
+// so that unwinding a frame in a signal handler takes just a binary search.
+class DwarfParser {
+  private:
+    enum { MAX_REMEMBERED_STATES = 8 };
+
+    struct State {
+        int cfa_reg;
+        int cfa_off;
+        int fp_off;
+        int pc_off;
+    };
+
+    const char* _name;
+    const char* _image_base;
+    const char* _ptr;
+
+    int _capacity;
+    int _count;
+    FrameDesc* _table;
+
+    u32 _code_align;
+    int _data_align;
+    u8 _ptr_encoding;
+    bool _has_augmentation_data;
+    int _ra_reg;
+    bool _in_cie;
+
+    State _state;
+    State _initial_state;
+    State _remembered[MAX_REMEMBERED_STATES];
+    int _remembered_count;
+
+    u8 get8() {
+        return *_ptr++;
+    }
+
+    u16 get16() {
+        u16 result = *(u16*)_ptr;
+        _ptr += 2;
+        return result;
+    }
+
+    u32 get32() {
+        u32 result = *(u32*)_ptr;
+        _ptr += 4;
+        return result;
+    }
+
+    u32 getLeb() {
+        u32 result = 0;
+        for (u32 shift = 0; ; shift += 7) {
+            u8 b = *_ptr++;
+            result |= (b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return result;
+            }
+        }
+    }
+
+    int getSLeb() {
+        int result = 0;
+        for (u32 shift = 0; ; shift += 7) {
+            u8 b = *_ptr++;
+            result |= (b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                if ((b & 0x40) != 0 && (shift += 7) < 32) {
+                    result |= -1 << shift;
+                }
+                return result;
+            }
+        }
+    }
+
+    const char* getPtr(u8 encoding);
+
+    void parse(const char* eh_frame_hdr);
+    bool parseCie(const char* cie);
+    void parseFde(const char* fde);
+    void parseInstructions(u32 loc, const char* end);
+    int parseExpression(const char* end);
+
+    void setReg(int reg, int offset);
+    void addRecord(u32 loc, const State& state);
+
+  public:
+    DwarfParser(const char* name, const char* image_base, const char* eh_frame_hdr);
+
+    FrameDesc* table() const {
+        return _table;
+    }
+
+    int count() const {
+        return _count;
+    }
+};
+
+#endif // _DWARF_H
@@ -15,10 +15,16 @@
  */
 
 #include "engine.h"
+#include "dwarf.h"
+#include "profiler.h"
 #include "stackFrame.h"
 
 
+const uintptr_t MAX_FRAME_SIZE = 0x40000;
+
+
 volatile bool Engine::_enabled;
+CStack Engine::_cstack;
 
 Error Engine::check(Arguments& args) {
     return Error::OK;
@@ -34,19 +40,45 @@ void Engine::stop() {
 int Engine::getNativeTrace(void* ucontext, int tid, const void** callchain, int max_depth,
                            CodeCache* java_methods, CodeCache* runtime_stubs) {
     const void* pc;
+    uintptr_t sp;
     uintptr_t fp;
     uintptr_t prev_fp = (uintptr_t)&fp;
     uintptr_t bottom = prev_fp + 0x100000;
 
     if (ucontext == NULL) {
+        // Start from the caller of getNativeTrace: its return address is known,
+        // and on x86 and AArch64 its FP is saved at our FP as a part of the frame record
+        uintptr_t self_fp = (uintptr_t)__builtin_frame_address(0);
         pc = __builtin_return_address(0);
-        fp = (uintptr_t)__builtin_frame_address(1);
+#if defined(__x86_64__) || defined(__i386__)
+        fp = SafeAccess::load((const uintptr_t*)self_fp);
+        sp = self_fp + 2 * sizeof(uintptr_t);
+#elif defined(__aarch64__)
+        // The frame record is not necessarily at the top of the frame, so the caller's SP is unknown
+        fp = SafeAccess::load((const uintptr_t*)self_fp);
+        sp = 0;
+#else
+        fp = 0;
+        sp = 0;
+#endif
     } else {
         StackFrame frame(ucontext);
         pc = (const void*)frame.pc();
+        sp = frame.sp();
         fp = frame.fp();
     }
 
+    // DWARF unwinding needs the exact SP, otherwise fall back to frame pointers
+    if (_cstack == CSTACK_DWARF && sp != 0) {
+        // The interrupted frame is above the signal handler on the same stack
+        if (sp < prev_fp || sp >= bottom) {
+            return 0;
+        }
+
+        StackImage stack(sp, bottom - sp);
+        return walkDwarf((uintptr_t)pc, sp, fp, stack, callchain, max_depth, java_methods, runtime_stubs);
+    }
+
     int depth = 0;
     const void* const valid_pc = (const void* const)0x1000;
 
@@ -59,7 +91,7 @@ int Engine::getNativeTrace(void* ucontext, int tid, const void** callchain, int
         callchain[depth++] = pc;
 
         // Check if the next frame is below on the current stack
-        if (fp <= prev_fp || fp >= prev_fp + 0x40000 || fp >= bottom) {
+        if (fp <= prev_fp || fp >= prev_fp + MAX_FRAME_SIZE || fp >= bottom) {
             break;
         }
 
@@ -69,8 +101,65 @@ int Engine::getNativeTrace(void* ucontext, int tid, const void** callchain, int
         }
 
         prev_fp = fp;
-        pc = stripPointer(((const void**)fp)[1]);
-        fp = ((uintptr_t*)fp)[0];
+        pc = stripPointer((const void*)SafeAccess::load((const uintptr_t*)fp + 1));
+        fp = SafeAccess::load((const uintptr_t*)fp);
+    }
+
+    return depth;
+}
+
+// Unwind native frames using .eh_frame tables of the loaded libraries.
+// Frames without unwind info are assumed to have a regular frame pointer.
+int Engine::walkDwarf(uintptr_t pc, uintptr_t sp, uintptr_t fp, StackImage& stack,
+                      const void** callchain, int max_depth,
+                      CodeCache* java_methods, CodeCache* runtime_stubs) {
+    int depth = 0;
+    const uintptr_t valid_pc = 0x1000;
+
+    while (depth < max_depth && pc >= valid_pc) {
+        if (java_methods->contains((const void*)pc) || runtime_stubs->contains((const void*)pc)) {
+            break;
+        }
+
+        callchain[depth++] = (const void*)pc;
+
+        // Return address may point to the next function, if the call is the last instruction
+        const void* lookup_pc = (const void*)(depth == 1 ? pc : pc - 1);
+        NativeCodeCache* lib = Profiler::_instance.findNativeLibrary(lookup_pc);
+        FrameDesc* f = lib != NULL ? lib->findFrameDesc(lookup_pc) : NULL;
+        if (f == NULL) {
+            f = &FrameDesc::default_frame;
+        }
+
+        u8 cfa_reg = (u8)f->cfa;
+        int cfa_off = f->cfa >> 8;
+        uintptr_t cfa;
+        if (cfa_reg == DW_REG_SP) {
+            cfa = sp + cfa_off;
+        } else if (cfa_reg == DW_REG_FP) {
+            cfa = fp + cfa_off;
+        } else if (cfa_reg == DW_REG_PLT) {
+            cfa = sp + ((pc & 15) >= 11 ? cfa_off * 2 : cfa_off);
+        } else {
+            break;
+        }
+
+        // Check if the next frame is above the current one on the stack
+        if (cfa < sp || cfa - sp >= MAX_FRAME_SIZE) {
+            break;
+        }
+
+        if (f->fp_off != DW_SAME_VALUE && !stack.load(cfa + f->fp_off, fp)) {
+            break;
+        }
+
+        // Return address is still in the link register: cannot unwind further
+        if (f->pc_off == DW_SAME_VALUE || !stack.load(cfa + f->pc_off, pc)) {
+            break;
+        }
+
+        pc = (uintptr_t)stripPointer((const void*)pc);
+        sp = cfa;
     }
 
     return depth;
@@ -17,13 +17,54 @@
 #ifndef _ENGINE_H
 #define _ENGINE_H
 
+#include <stdint.h>
 #include "arguments.h"
 #include "codeCache.h"
+#include "safeAccess.h"
+
+
+// A window of the sampled thread's stack [base, base + size) visible to the unwinder.
+// The contents may be either the live stack or its copy in a perf ring buffer,
+// where the word at address A is found at start + ((offset + A - base) & mask).
+// The live stack may be unmapped beyond its actual top, so it is read with SafeAccess.
+class StackImage {
+  private:
+    const char* _start;
+    uintptr_t _offset;
+    uintptr_t _mask;
+    uintptr_t _base;
+    uintptr_t _size;
+    bool _live;
+
+  public:
+    StackImage(const char* start, uintptr_t offset, uintptr_t mask, uintptr_t base, uintptr_t size) :
+        _start(start), _offset(offset), _mask(mask), _base(base), _size(size), _live(false) {
+    }
+
+    StackImage(uintptr_t base, uintptr_t size) :
+        _start((const char*)base), _offset(0), _mask(~(uintptr_t)0), _base(base), _size(size), _live(true) {
+    }
+
+    bool load(uintptr_t address, uintptr_t& value) {
+        uintptr_t pos = address - _base;
+        if (pos >= _size || _size - pos < sizeof(uintptr_t) || (address & (sizeof(uintptr_t) - 1)) != 0) {
+            return false;
+        }
+        const uintptr_t* ptr = (const uintptr_t*)(_start + ((_offset + pos) & _mask));
+        value = _live ? SafeAccess::load(ptr) : *ptr;
+        return true;
+    }
+};
 
 
 class Engine {
   protected:
     static volatile bool _enabled;
+    static CStack _cstack;
+
+    static int walkDwarf(uintptr_t pc, uintptr_t sp, uintptr_t fp, StackImage& stack,
+                         const void** callchain, int max_depth,
+                         CodeCache* java_methods, CodeCache* runtime_stubs);
 
   public:
     virtual const char* title() {
@@ -44,6 +85,10 @@ class Engine {
     void enableEvents(bool enabled) {
         _enabled = enabled;
     }
+
+    static void setCStack(CStack cstack) {
+        _cstack = cstack;
+    }
 };
 
 #endif // _ENGINE_H
@@ -17,10 +17,15 @@
 #ifndef _EVENT_H
 #define _EVENT_H
 
+#include <jvmti.h>
 #include <stdint.h>
 #include "os.h"
 
 
+// Maximum depth of the lock owner stack attached to a contended lock event
+const int MAX_LOCK_OWNER_FRAMES = 64;
+
+
 class Event {
   public:
     u32 id() {
@@ -36,6 +41,14 @@ class ExecutionEvent : public Event {
     }
 };
 
+class MemoryAccessEvent : public ExecutionEvent {
+  public:
+    const char* _data_source;
+    u32 _class_id;                    // 0 if the address is not inside a known Java object
+    u64 _address;
+    u64 _latency;
+};
+
 class AllocEvent : public Event {
   public:
     u32 _class_id;
@@ -43,6 +56,12 @@ class AllocEvent : public Event {
     u64 _instance_size;
 };
 
+class MallocEvent : public Event {
+  public:
+    uintptr_t _address;
+    u64 _size;
+};
+
 class LockEvent : public Event {
   public:
     u32 _class_id;
@@ -50,6 +69,17 @@ class LockEvent : public Event {
     u64 _end_time;
     uintptr_t _address;
     long long _timeout;
+    int _owner_tid;                   // 0 if the owner has not been sampled
+    int _owner_depth;
+    jvmtiFrameInfo* _owner_frames;
+
+    LockEvent() : _owner_tid(0), _owner_depth(0), _owner_frames(NULL) {
+    }
+};
+
+class NativeLockEvent : public LockEvent {
+  public:
+    const char* _function;
 };
 
 #endif // _EVENT_H
@@ -15,8 +15,10 @@
  */
 
 #include <algorithm>
+#include <fstream>
 #include <vector>
 #include <stdio.h>
+#include <stdlib.h>
 #include "flameGraph.h"
 
 
@@ -87,8 +89,16 @@ static const char FLAMEGRAPH_HEADER[] =
     "\t\treturn '#' + (p[0] + ((p[1] * v) << 16 | (p[2] * v) << 8 | (p[3] * v))).toString(16);\n"
     "\t}\n"
     "\n"
-    "\tfunction f(level, left, width, type, title) {\n"
-    "\t\tlevels[level].push({left: left, width: width, color: getColor(palette[type]), title: title});\n"
+    "\t// Diff mode: red for frames that grew compared to the baseline, blue for frames that shrank\n"
+    "\tfunction getDiffColor(width, base) {\n"
+    "\t\tconst d = (width - base) / Math.max(width, base);\n"
+    "\t\tconst v = 255 - Math.round(Math.min(Math.abs(d), 0.5) * 360);\n"
+    "\t\treturn d > 0 ? 'rgb(255,' + v + ',' + v + ')' : 'rgb(' + v + ',' + v + ',255)';\n"
+    "\t}\n"
+    "\n"
+    "\tfunction f(level, left, width, type, title, base) {\n"
+    "\t\tconst color = base === undefined ? getColor(palette[type]) : getDiffColor(width, base);\n"
+    "\t\tlevels[level].push({left: left, width: width, color: color, title: title, base: base});\n"
     "\t}\n"
     "\n"
     "\tfunction samples(n) {\n"
@@ -203,7 +213,8 @@ static const char FLAMEGRAPH_HEADER[] =
     "\t\t\t\thl.style.top = ((reverse ? h * 16 : canvasHeight - (h + 1) * 16) + canvas.offsetTop) + 'px';\n"
     "\t\t\t\thl.firstChild.textContent = f.title;\n"
     "\t\t\t\thl.style.display = 'block';\n"
-    "\t\t\t\tcanvas.title = f.title + '\\n(' + samples(f.width) + ', ' + pct(f.width, levels[0][0].width) + '%%)';\n"
+    "\t\t\t\tcanvas.title = f.title + '\\n(' + samples(f.width) + ', ' + pct(f.width, levels[0][0].width) + '%%' +\n"
+    "\t\t\t\t\t(f.base === undefined ? ')' : ', baseline ' + pct(f.base, levels[0][0].width) + '%%)');\n"
     "\t\t\t\tcanvas.style.cursor = 'pointer';\n"
     "\t\t\t\tcanvas.onclick = function() {\n"
     "\t\t\t\t\tif (f != root) {\n"
@@ -451,33 +462,223 @@ class Format {
 };
 
 
-class Node {
+// Orders names alphabetically, so that flame graph frames keep their usual layout
+class NameComparator {
+  private:
+    const std::vector<std::string>& _names;
+
   public:
-    std::string _name;
-    const Trie* _trie;
+    NameComparator(const std::vector<std::string>& names) : _names(names) {
+    }
+
+    bool operator()(u32 a, u32 b) const {
+        return _names[a] < _names[b];
+    }
+};
+
+class TotalComparator {
+  private:
+    const std::vector<TrieNode>& _nodes;
 
-    Node(const std::string& name, const Trie& trie) : _name(name), _trie(&trie) {
+  public:
+    TotalComparator(const std::vector<TrieNode>& nodes) : _nodes(nodes) {
     }
 
-    bool operator<(const Node& other) const {
-        return _trie->_total > other._trie->_total;
+    bool operator()(u32 a, u32 b) const {
+        return _nodes[a].total > _nodes[b].total;
     }
 };
 
 
+FlameGraph::FlameGraph(const char* title, Counter counter, double minwidth, bool reverse) :
+    _nodes(),
+    _child_map(),
+    _child_list(),
+    _names(),
+    _name_slots(1024),
+    _title(title),
+    _counter(counter),
+    _minwidth(minwidth),
+    _reverse(reverse),
+    _baseline_scale(0) {
+    _buf[sizeof(_buf) - 1] = 0;
+
+    // Name id 0 is never returned by the string table; it is reserved for the root
+    _names.push_back("all");
+    _nodes.push_back(TrieNode(0, 0));
+}
+
+u32 FlameGraph::hashName(const char* name, size_t len) {
+    u32 h = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (u8)name[i]) * 16777619;
+    }
+    return h;
+}
+
+void FlameGraph::rehashNames() {
+    std::vector<u32> slots(_name_slots.size() * 2);
+    u32 mask = slots.size() - 1;
+
+    for (u32 id = 1; id < _names.size(); id++) {
+        u32 slot = hashName(_names[id].data(), _names[id].length()) & mask;
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = id;
+    }
+
+    _name_slots.swap(slots);
+}
+
+u32 FlameGraph::nameId(const char* name, size_t len) {
+    if (_names.size() * 2 > _name_slots.size()) {
+        rehashNames();
+    }
+
+    u32 mask = _name_slots.size() - 1;
+    for (u32 slot = hashName(name, len) & mask; ; slot = (slot + 1) & mask) {
+        u32 id = _name_slots[slot];
+        if (id == 0) {
+            id = _names.size();
+            _names.push_back(std::string(name, len));
+            _name_slots[slot] = id;
+            return id;
+        }
+
+        const std::string& s = _names[id];
+        if (s.length() == len && memcmp(s.data(), name, len) == 0) {
+            return id;
+        }
+    }
+}
+
+// Groups nodes by parent, so that children of each node make a contiguous range sorted by name
+void FlameGraph::buildChildLists() {
+    std::vector<u32> by_name(_names.size());
+    for (u32 i = 0; i < by_name.size(); i++) {
+        by_name[i] = i;
+    }
+    std::sort(by_name.begin(), by_name.end(), NameComparator(_names));
+
+    std::vector<u32> rank(_names.size());
+    for (u32 i = 0; i < by_name.size(); i++) {
+        rank[by_name[i]] = i;
+    }
+
+    // Counting sort by parent: every node except the root is someone's child
+    for (u32 i = 0; i < _nodes.size(); i++) {
+        _nodes[i].children = 0;
+    }
+    for (u32 i = 1; i < _nodes.size(); i++) {
+        _nodes[_nodes[i].parent].children++;
+    }
+
+    u32 offset = 0;
+    for (u32 i = 0; i < _nodes.size(); i++) {
+        _nodes[i].first_child = offset;
+        offset += _nodes[i].children;
+    }
+
+    std::vector<u64> ranked(_nodes.size() - 1);
+    std::vector<u32> fill(_nodes.size());
+    for (u32 i = 1; i < _nodes.size(); i++) {
+        u32 parent = _nodes[i].parent;
+        ranked[_nodes[parent].first_child + fill[parent]++] = (u64)rank[_nodes[i].name] << 32 | i;
+    }
+
+    _child_list.resize(ranked.size());
+    for (u32 i = 0; i < _nodes.size(); i++) {
+        const TrieNode& f = _nodes[i];
+        std::sort(ranked.begin() + f.first_child, ranked.begin() + f.first_child + f.children);
+    }
+    for (u32 i = 0; i < ranked.size(); i++) {
+        _child_list[i] = (u32)ranked[i];
+    }
+}
+
+int FlameGraph::maxDepth(u32 node, u64 cutoff) const {
+    const TrieNode& f = _nodes[node];
+    if (f.total < cutoff) {
+        return 0;
+    }
+
+    int max_depth = 0;
+    for (u32 i = 0; i < f.children; i++) {
+        int d = maxDepth(_child_list[f.first_child + i], cutoff);
+        if (d > max_depth) max_depth = d;
+    }
+    return max_depth + 1;
+}
+
+Error FlameGraph::loadBaseline(const char* file, bool thread_frame) {
+    std::ifstream in(file);
+    if (!in.is_open()) {
+        return Error("Could not open baseline file");
+    }
+
+    std::vector<u32> frames;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t space = line.rfind(' ');
+        if (space == std::string::npos || space == 0) continue;
+
+        u64 value = strtoull(line.c_str() + space + 1, NULL, 10);
+        if (value == 0) continue;
+
+        frames.clear();
+        for (size_t start = 0; start < space; ) {
+            size_t end = line.find(';', start);
+            if (end > space) end = space;
+            frames.push_back(nameId(line.data() + start, end - start));
+            start = end + 1;
+        }
+
+        u32 f = root();
+        if (_reverse) {
+            size_t first = 0;
+            if (thread_frame && frames.size() > 1) {
+                // Thread frames always come first
+                f = addBaselineChild(f, frames[first++], value);
+            }
+
+            for (size_t i = frames.size(); i > first; i--) {
+                f = addBaselineChild(f, frames[i - 1], value);
+            }
+        } else {
+            for (size_t i = 0; i < frames.size(); i++) {
+                f = addBaselineChild(f, frames[i], value);
+            }
+        }
+        addBaselineLeaf(f, value);
+    }
+
+    return Error::OK;
+}
+
 void FlameGraph::dump(std::ostream& out, bool tree) {
-    _mintotal = _minwidth == 0 && tree ? _root._total / 1000 : (u64)(_root._total * _minwidth / 100);
-    int depth = _root.depth(_mintotal);
+    const TrieNode& root = _nodes[0];
+    _mintotal = _minwidth == 0 && tree ? root.total / 1000 : (u64)(root.total * _minwidth / 100);
+
+    // Normalize the baseline to the same total, so that profiles of different duration are comparable
+    _baseline_scale = root.baseline > 0 ? (double)root.total / root.baseline : 0;
+    if (_baseline_scale > 0 && _mintotal == 0) {
+        // Skip frames that exist only in the baseline
+        _mintotal = 1;
+    }
+
+    buildChildLists();
+    int depth = maxDepth(0, _mintotal);
 
     if (tree) {
         char buf[sizeof(TREE_HEADER) + 256];
         snprintf(buf, sizeof(buf) - 1, TREE_HEADER,
                  _reverse ? "Backtrace" : "Call tree",
                  _counter ==  COUNTER_SAMPLES ? "samples" : "counter",
-                 Format().thousands(_root._total));
+                 Format().thousands(root.total));
         out << buf;
 
-        printTreeFrame(out, _root, 0);
+        printTreeFrame(out, 0, 0);
 
         out << TREE_FOOTER;
     } else {
@@ -486,40 +687,45 @@ void FlameGraph::dump(std::ostream& out, bool tree) {
                  std::min(depth * 16, MAX_CANVAS_HEIGHT), _reverse ? "true" : "false", depth);
         out << buf;
 
-        printFrame(out, "all", _root, 0, 0);
+        printFrame(out, 0, 0, 0);
 
         out << FLAMEGRAPH_FOOTER;
     }
 }
 
-void FlameGraph::printFrame(std::ostream& out, const std::string& name, const Trie& f, int level, u64 x) {
-    std::string name_copy = name;
-    int type = frameType(name_copy);
-    StringUtils::replace(name_copy, '\'', "\\'", 2);
+void FlameGraph::printFrame(std::ostream& out, u32 node, int level, u64 x) {
+    const TrieNode& f = _nodes[node];
+    std::string name = _names[f.name];
+    int type = frameType(name);
+    StringUtils::replace(name, '\'', "\\'", 2);
 
-    snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'%s')\n", level, x, f._total, type, name_copy.c_str());
+    if (_baseline_scale > 0) {
+        u64 base = (u64)(f.baseline * _baseline_scale + 0.5);
+        snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'%s',%llu)\n", level, x, f.total, type, name.c_str(), base);
+    } else {
+        snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'%s')\n", level, x, f.total, type, name.c_str());
+    }
     out << _buf;
 
-    x += f._self;
-    for (std::map<std::string, Trie>::const_iterator it = f._children.begin(); it != f._children.end(); ++it) {
-        if (it->second._total >= _mintotal) {
-            printFrame(out, it->first, it->second, level + 1, x);
+    x += f.self;
+    for (u32 i = 0; i < f.children; i++) {
+        u32 child = _child_list[f.first_child + i];
+        if (_nodes[child].total >= _mintotal) {
+            printFrame(out, child, level + 1, x);
         }
-        x += it->second._total;
+        x += _nodes[child].total;
     }
 }
 
-void FlameGraph::printTreeFrame(std::ostream& out, const Trie& f, int level) {
-    std::vector<Node> subnodes;
-    for (std::map<std::string, Trie>::const_iterator it = f._children.begin(); it != f._children.end(); ++it) {
-        subnodes.push_back(Node(it->first, it->second));
-    }
-    std::sort(subnodes.begin(), subnodes.end());
+void FlameGraph::printTreeFrame(std::ostream& out, u32 node, int level) {
+    const TrieNode& f = _nodes[node];
+    std::vector<u32> subnodes(_child_list.begin() + f.first_child, _child_list.begin() + f.first_child + f.children);
+    std::sort(subnodes.begin(), subnodes.end(), TotalComparator(_nodes));
 
-    double pct = 100.0 / _root._total;
+    double pct = 100.0 / _nodes[0].total;
     for (size_t i = 0; i < subnodes.size(); i++) {
-        std::string name = subnodes[i]._name;
-        const Trie* trie = subnodes[i]._trie;
+        const TrieNode* trie = &_nodes[subnodes[i]];
+        std::string name = _names[trie->name];
 
         int type = frameType(name);
         StringUtils::replace(name, '&', "&amp;", 5);
@@ -530,22 +736,22 @@ void FlameGraph::printTreeFrame(std::ostream& out, const Trie& f, int level) {
             snprintf(_buf, sizeof(_buf) - 1,
                      "<li><div>[%d] %.2f%% %s</div><span class=\"t%d\"> %s</span>\n",
                      level,
-                     trie->_total * pct, Format().thousands(trie->_total),
+                     trie->total * pct, Format().thousands(trie->total),
                      type, name.c_str());
         } else {
             snprintf(_buf, sizeof(_buf) - 1,
                      "<li><div>[%d] %.2f%% %s self: %.2f%% %s</div><span class=\"t%d\"> %s</span>\n",
                      level,
-                     trie->_total * pct, Format().thousands(trie->_total),
-                     trie->_self * pct, Format().thousands(trie->_self),
+                     trie->total * pct, Format().thousands(trie->total),
+                     trie->self * pct, Format().thousands(trie->self),
                      type, name.c_str());
         }
         out << _buf;
 
-        if (trie->_children.size() > 0) {
+        if (trie->children > 0) {
             out << "<ul>\n";
-            if (trie->_total >= _mintotal) {
-                printTreeFrame(out, *trie, level + 1);
+            if (trie->total >= _mintotal) {
+                printTreeFrame(out, subnodes[i], level + 1);
             } else {
                 out << "<li>...\n";
             }
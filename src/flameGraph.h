@@ -17,50 +17,39 @@
 #ifndef _FLAMEGRAPH_H
 #define _FLAMEGRAPH_H
 
-#include <map>
+#include <string.h>
 #include <string>
+#include <vector>
 #include <iostream>
 #include "arch.h"
 #include "arguments.h"
-
-
-class Trie {
-  public:
-    std::map<std::string, Trie> _children;
-    u64 _total;
-    u64 _self;
-
-    Trie() : _children(), _total(0), _self(0) {
-    }
-    
-    Trie* addChild(const std::string& key, u64 value) {
-        _total += value;
-        return &_children[key];
-    }
-
-    void addLeaf(u64 value) {
-        _total += value;
-        _self += value;
-    }
-
-    int depth(u64 cutoff) const {
-        if (_total < cutoff) {
-            return 0;
-        }
-
-        int max_depth = 0;
-        for (std::map<std::string, Trie>::const_iterator it = _children.begin(); it != _children.end(); ++it) {
-            int d = it->second.depth(cutoff);
-            if (d > max_depth) max_depth = d;
-        }
-        return max_depth + 1;
+#include "idMap.h"
+
+
+// Node of the call tree. Nodes refer to each other by index in FlameGraph::_nodes,
+// and frame names are ids in the string table of FlameGraph.
+struct TrieNode {
+    u32 parent;
+    u32 name;
+    u32 first_child;  // index in FlameGraph::_child_list
+    u32 children;
+    u64 total;
+    u64 self;
+    u64 baseline;
+
+    TrieNode(u32 parent, u32 name) :
+        parent(parent), name(name), first_child(0), children(0), total(0), self(0), baseline(0) {
     }
 };
 
 
 class FlameGraph {
   private:
-    Trie _root;
+    std::vector<TrieNode> _nodes;
+    IdMap _child_map;              // (parent, name) -> node
+    std::vector<u32> _child_list;  // children of every node, sorted by name
+    std::vector<std::string> _names;
+    std::vector<u32> _name_slots;
     char _buf[4096];
     u64 _mintotal;
 
@@ -68,25 +57,64 @@ class FlameGraph {
     Counter _counter;
     double _minwidth;
     bool _reverse;
+    double _baseline_scale;
+
+    static u32 hashName(const char* name, size_t len);
+    void rehashNames();
+
+    u32 child(u32 node, u32 name) {
+        u64 key = (u64)node << 32 | name;
+        u32 child = _child_map.get(key);
+        if (child == 0) {
+            child = _nodes.size();
+            _nodes.push_back(TrieNode(node, name));
+            _child_map.put(key, child);
+        }
+        return child;
+    }
 
-    void printFrame(std::ostream& out, const std::string& name, const Trie& f, int level, u64 x);
-    void printTreeFrame(std::ostream& out, const Trie& f, int level);
+    void buildChildLists();
+    int maxDepth(u32 node, u64 cutoff) const;
+    void printFrame(std::ostream& out, u32 node, int level, u64 x);
+    void printTreeFrame(std::ostream& out, u32 node, int level);
     int frameType(std::string& name);
 
   public:
-    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse) :
-        _root(),
-        _title(title),
-        _counter(counter),
-        _minwidth(minwidth),
-        _reverse(reverse) {
-        _buf[sizeof(_buf) - 1] = 0;
+    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse);
+
+    u32 root() const {
+        return 0;
+    }
+
+    // Interns a frame name; the same name always gets the same id within one FlameGraph
+    u32 nameId(const char* name, size_t len);
+
+    u32 nameId(const char* name) {
+        return nameId(name, strlen(name));
+    }
+
+    u32 addChild(u32 node, u32 name, u64 value) {
+        _nodes[node].total += value;
+        return child(node, name);
+    }
+
+    void addLeaf(u32 node, u64 value) {
+        _nodes[node].total += value;
+        _nodes[node].self += value;
     }
 
-    Trie* root() {
-        return &_root;
+    u32 addBaselineChild(u32 node, u32 name, u64 value) {
+        _nodes[node].baseline += value;
+        return child(node, name);
     }
 
+    void addBaselineLeaf(u32 node, u64 value) {
+        _nodes[node].baseline += value;
+    }
+
+    // Loads collapsed stacks of a baseline profile to compare the current profile against
+    Error loadBaseline(const char* file, bool thread_frame);
+
     void dump(std::ostream& out, bool tree);
 };
 
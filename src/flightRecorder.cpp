@@ -49,7 +49,7 @@ const int MAX_STRING_LENGTH = 8191;
 
 
 static const char* const SETTING_RING[] = {NULL, "kernel", "user"};
-static const char* const SETTING_CSTACK[] = {NULL, "no", "fp", "lbr"};
+static const char* const SETTING_CSTACK[] = {NULL, "no", "fp", "dwarf", "lbr"};
 
 
 enum FrameTypeId {
@@ -469,7 +469,7 @@ class Recording {
 
             if (method == NULL) {
                 fillNativeMethodInfo(mi, "unknown");
-            } else if (frame.bci == BCI_NATIVE_FRAME || frame.bci == BCI_ERROR) {
+            } else if (frame.bci == BCI_NATIVE_FRAME || frame.bci == BCI_ERROR || frame.bci == BCI_DATA_SOURCE) {
                 fillNativeMethodInfo(mi, (const char*)method);
             } else {
                 fillJavaMethodInfo(mi, method);
@@ -854,7 +854,7 @@ class Recording {
 
     void writeStackTraces(Buffer* buf) {
         std::map<u32, CallTrace*> traces;
-        Profiler::_instance._call_trace_storage.collectTraces(traces);
+        Profiler::_instance._call_trace_storage->collectTraces(traces);
 
         buf->putVar32(T_STACK_TRACE);
         buf->putVar32(traces.size());
@@ -996,6 +996,7 @@ class Recording {
         buf->putVar32(call_trace_id);
         buf->putVar32(event->_class_id);
         buf->putVar64(event->_address);
+        buf->putVar32(event->_owner_tid);
         buf->put8(start, buf->offset() - start);
     }
 
@@ -1095,6 +1096,7 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
         Buffer* buf = _rec->buffer(lock_index);
         switch (event_type) {
             case 0:
+            case BCI_DATA_SOURCE:
                 _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
                 break;
             case BCI_ALLOC:
@@ -1105,6 +1107,9 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
                 break;
             case BCI_LOCK:
                 _rec->recordMonitorBlocked(buf, tid, call_trace_id, (LockEvent*)event);
+                if (((LockEvent*)event)->_owner_tid != 0) {
+                    _rec->addThread(((LockEvent*)event)->_owner_tid);
+                }
                 break;
             case BCI_PARK:
                 _rec->recordThreadPark(buf, tid, call_trace_id, (LockEvent*)event);
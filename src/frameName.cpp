@@ -23,60 +23,12 @@
 #include "vmStructs.h"
 
 
-Matcher::Matcher(const char* pattern) {
-    if (pattern[0] == '*') {
-        _type = MATCH_ENDS_WITH;
-        _pattern = strdup(pattern + 1);
-    } else {
-        _type = MATCH_EQUALS;
-        _pattern = strdup(pattern);
-    }
-
-    _len = strlen(_pattern);
-    if (_len > 0 && _pattern[_len - 1] == '*') {
-        _type = _type == MATCH_EQUALS ? MATCH_STARTS_WITH : MATCH_CONTAINS;
-        _pattern[--_len] = 0;
-    }
-}
-
-Matcher::~Matcher() {
-    free(_pattern);
-}
-
-Matcher::Matcher(const Matcher& m) {
-    _type = m._type;
-    _pattern = strdup(m._pattern);
-    _len = m._len;
-}
-
-Matcher& Matcher::operator=(const Matcher& m) {
-    free(_pattern);
-
-    _type = m._type;
-    _pattern = strdup(m._pattern);
-    _len = m._len;
-
-    return *this;
-}
-
-bool Matcher::matches(const char* s) {
-    switch (_type) {
-        case MATCH_EQUALS:
-            return strcmp(s, _pattern) == 0;
-        case MATCH_CONTAINS:
-            return strstr(s, _pattern) != NULL;
-        case MATCH_STARTS_WITH:
-            return strncmp(s, _pattern, _len) == 0;
-        case MATCH_ENDS_WITH:
-            int slen = strlen(s);
-            return slen >= _len && strcmp(s + slen - _len, _pattern) == 0;
-    }
-    return false;
-}
-
-
 FrameName::FrameName(Arguments& args, int style, Mutex& thread_names_lock, ThreadMap& thread_names) :
-    _cache(),
+    _frame_index(),
+    _frame_names(),
+    _method_index(),
+    _method_names(),
+    _line_tables(),
     _class_names(),
     _include(),
     _exclude(),
@@ -88,21 +40,21 @@ FrameName::FrameName(Arguments& args, int style, Mutex& thread_names_lock, Threa
     _saved_locale = uselocale(newlocale(LC_NUMERIC_MASK, "C", (locale_t)0));
     memset(_buf, 0, sizeof(_buf));
 
-    buildFilter(_include, args._buf, args._include);
-    buildFilter(_exclude, args._buf, args._exclude);
+    _include.addList(args._buf, args._include);
+    _include.compile();
+    _exclude.addList(args._buf, args._exclude);
+    _exclude.compile();
 
     Profiler::_instance.classMap()->collect(_class_names);
 }
 
 FrameName::~FrameName() {
-    freelocale(uselocale(_saved_locale));
-}
-
-void FrameName::buildFilter(std::vector<Matcher>& vector, const char* base, int offset) {
-    while (offset != 0) {
-        vector.push_back(base + offset);
-        offset = ((int*)(base + offset))[-1];
+    jvmtiEnv* jvmti = VM::jvmti();
+    for (LineTableCache::iterator it = _line_tables.begin(); it != _line_tables.end(); ++it) {
+        jvmti->Deallocate((unsigned char*)it->second.entries);
     }
+
+    freelocale(uselocale(_saved_locale));
 }
 
 char* FrameName::truncate(char* name, int max_length) {
@@ -138,12 +90,7 @@ char* FrameName::javaMethodName(jmethodID method) {
     if ((err = jvmti->GetMethodName(method, &method_name, &method_sig, NULL)) == 0 &&
         (err = jvmti->GetMethodDeclaringClass(method, &method_class)) == 0 &&
         (err = jvmti->GetClassSignature(method_class, &class_name, NULL)) == 0) {
-        // Trim 'L' and ';' off the class descriptor like 'Ljava/lang/Object;'
-        result = javaClassName(class_name + 1, strlen(class_name) - 2, _style);
-        strcat(result, ".");
-        strcat(result, method_name);
-        if (_style & STYLE_SIGNATURES) strcat(result, truncate(method_sig, 255));
-        if (_style & STYLE_ANNOTATE) strcat(result, "_[j]");
+        result = javaMethodName(_buf, class_name, method_name, method_sig, _style);
     } else {
         snprintf(_buf, sizeof(_buf) - 1, "[jvmtiError %d]", err);
         result = _buf;
@@ -156,8 +103,18 @@ char* FrameName::javaMethodName(jmethodID method) {
     return result;
 }
 
-char* FrameName::javaClassName(const char* symbol, int length, int style) {
-    char* result = _buf;
+char* FrameName::javaMethodName(char* buf, const char* class_sig, const char* method_name, char* method_sig, int style) {
+    // Trim 'L' and ';' off the class descriptor like 'Ljava/lang/Object;'
+    char* result = javaClassName(buf, class_sig + 1, strlen(class_sig) - 2, style);
+    strcat(result, ".");
+    strcat(result, method_name);
+    if (style & STYLE_SIGNATURES) strcat(result, truncate(method_sig, 255));
+    if (style & STYLE_ANNOTATE) strcat(result, "_[j]");
+    return result;
+}
+
+char* FrameName::javaClassName(char* buf, const char* symbol, int length, int style) {
+    char* result = buf;
 
     int array_dimension = 0;
     while (*symbol == '[') {
@@ -204,7 +161,47 @@ char* FrameName::javaClassName(const char* symbol, int length, int style) {
     return result;
 }
 
-const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
+const std::string& FrameName::cachedJavaMethodName(jmethodID method) {
+    u64 key = (u64)(uintptr_t)method;
+    u32 index = _method_index.get(key);
+    if (index == 0) {
+        _method_names.push_back(javaMethodName(method));
+        _method_index.put(key, index = _method_names.size());
+    }
+    return _method_names[index - 1];
+}
+
+CachedFrameName& FrameName::cachedFrame(ASGCT_CallFrame& frame) {
+    u64 key = frameKey(frame, _style);
+    u32 index = _frame_index.get(key);
+    if (index == 0) {
+        _frame_names.push_back(CachedFrameName());
+        _frame_index.put(key, index = _frame_names.size());
+    }
+    return _frame_names[index - 1];
+}
+
+const char* FrameName::name(ASGCT_CallFrame& frame) {
+    CachedFrameName& cached = cachedFrame(frame);
+    if (!cached.has_name) {
+        cached.name = formatName(frame, false);
+        cached.has_name = true;
+    }
+    return cached.name.c_str();
+}
+
+int FrameName::filter(ASGCT_CallFrame& frame) {
+    CachedFrameName& cached = cachedFrame(frame);
+    if (cached.filter == 0) {
+        const char* frame_name = formatName(frame, true);
+        cached.filter = FILTER_CHECKED;
+        if (_include.matches(frame_name)) cached.filter |= FILTER_INCLUDED;
+        if (_exclude.matches(frame_name)) cached.filter |= FILTER_EXCLUDED;
+    }
+    return cached.filter;
+}
+
+const char* FrameName::formatName(ASGCT_CallFrame& frame, bool for_matching) {
     if (frame.method_id == NULL) {
         return "[unknown]";
     }
@@ -216,9 +213,10 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
         case BCI_ALLOC:
         case BCI_ALLOC_OUTSIDE_TLAB:
         case BCI_LOCK:
-        case BCI_PARK: {
+        case BCI_PARK:
+        case BCI_DATA_CLASS: {
             const char* symbol = _class_names[(uintptr_t)frame.method_id];
-            char* class_name = javaClassName(symbol, strlen(symbol), _style | STYLE_DOTTED);
+            char* class_name = javaClassName(_buf, symbol, strlen(symbol), _style | STYLE_DOTTED);
             if (!for_matching && !(_style & STYLE_DOTTED)) {
                 strcat(class_name, frame.bci == BCI_ALLOC_OUTSIDE_TLAB ? "_[k]" : "_[i]");
             }
@@ -244,34 +242,56 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
             return _buf;
         }
 
+        case BCI_DATA_SOURCE:
+            return (const char*)frame.method_id;
+
         default: {
-            JMethodCache::iterator it = _cache.lower_bound(frame.method_id);
-            if (it != _cache.end() && it->first == frame.method_id) {
-                return it->second.c_str();
+            const std::string& name = cachedJavaMethodName(frame.method_id);
+
+            int line;
+            if (!(_style & STYLE_LINES) || for_matching || (line = lineNumber(frame.method_id, frame.bci)) == 0) {
+                return name.c_str();
             }
 
-            const char* newName = javaMethodName(frame.method_id);
-            _cache.insert(it, JMethodCache::value_type(frame.method_id, newName));
-            return newName;
+            // Keep the _[j] annotation at the end, where FlameGraph expects it
+            int len = name.length();
+            if ((_style & STYLE_ANNOTATE) && len >= 4 && name.compare(len - 4, 4, "_[j]") == 0) {
+                len -= 4;
+            }
+            snprintf(_buf, sizeof(_buf) - 1, "%.*s:%d%s", len, name.c_str(), line, name.c_str() + len);
+            return _buf;
         }
     }
 }
 
-bool FrameName::include(const char* frame_name) {
-    for (int i = 0; i < _include.size(); i++) {
-        if (_include[i].matches(frame_name)) {
-            return true;
+int FrameName::lineNumber(jmethodID method, jint bci) {
+    LineTableCache::iterator it = _line_tables.lower_bound(method);
+    if (it == _line_tables.end() || it->first != method) {
+        LineTable table;
+        if (VM::jvmti()->GetLineNumberTable(method, &table.size, &table.entries) != 0) {
+            table.size = 0;
+            table.entries = NULL;
         }
+        it = _line_tables.insert(it, LineTableCache::value_type(method, table));
+    }
+
+    const LineTable& table = it->second;
+    if (table.size == 0 || bci < 0) {
+        return 0;
     }
-    return false;
-}
 
-bool FrameName::exclude(const char* frame_name) {
-    for (int i = 0; i < _exclude.size(); i++) {
-        if (_exclude[i].matches(frame_name)) {
-            return true;
+    // The table is not guaranteed to be sorted by start_location: take the closest entry at or before bci,
+    // or the first entry of the method, if bci precedes all of them
+    int best = -1;
+    int first = 0;
+    for (int i = 0; i < table.size; i++) {
+        jlocation start = table.entries[i].start_location;
+        if (start <= bci && (best < 0 || start > table.entries[best].start_location)) {
+            best = i;
+        }
+        if (start < table.entries[first].start_location) {
+            first = i;
         }
     }
-    return false;
+    return table.entries[best >= 0 ? best : first].line_number;
 }
-
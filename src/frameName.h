@@ -19,10 +19,13 @@
 
 #include <jvmti.h>
 #include <locale.h>
+#include <deque>
 #include <map>
 #include <vector>
 #include <string>
 #include "arguments.h"
+#include "idMap.h"
+#include "matcher.h"
 #include "mutex.h"
 #include "vmEntry.h"
 
@@ -31,65 +34,96 @@
 #endif
 
 
-typedef std::map<jmethodID, std::string> JMethodCache;
+// Must be large enough for class name + method name + method signature
+const size_t MAX_FRAME_NAME_LENGTH = 800;
+
 typedef std::map<int, std::string> ThreadMap;
 typedef std::map<unsigned int, const char*> ClassMap;
 
-
-enum MatchType {
-  MATCH_EQUALS,
-  MATCH_CONTAINS,
-  MATCH_STARTS_WITH,
-  MATCH_ENDS_WITH
+struct LineTable {
+    jint size;
+    jvmtiLineNumberEntry* entries;
 };
 
+typedef std::map<jmethodID, LineTable> LineTableCache;
 
-class Matcher {
-  private:
-    MatchType _type;
-    char* _pattern;
-    int _len;
-
-  public:
-    Matcher(const char* pattern);
-    ~Matcher();
+enum FrameFilter {
+    FILTER_CHECKED  = 1,
+    FILTER_INCLUDED = 2,
+    FILTER_EXCLUDED = 4
+};
 
-    Matcher(const Matcher& m);
-    Matcher& operator=(const Matcher& m);
+// Name of one distinct frame and its include/exclude verdict; both are computed on first use
+struct CachedFrameName {
+    std::string name;
+    bool has_name;
+    unsigned char filter;
 
-    bool matches(const char* s);
+    CachedFrameName() : name(), has_name(false), filter(0) {
+    }
 };
 
 
 class FrameName {
   private:
-    JMethodCache _cache;
+    IdMap _frame_index;  // frame key -> index in _frame_names + 1
+    std::deque<CachedFrameName> _frame_names;
+    IdMap _method_index;  // jmethodID -> index in _method_names + 1
+    std::deque<std::string> _method_names;
+    LineTableCache _line_tables;
     ClassMap _class_names;
-    std::vector<Matcher> _include;
-    std::vector<Matcher> _exclude;
-    char _buf[800];  // must be large enough for class name + method name + method signature
+    Matcher _include;
+    Matcher _exclude;
+    char _buf[MAX_FRAME_NAME_LENGTH];
     int _style;
     Mutex& _thread_names_lock;
     ThreadMap& _thread_names;
     locale_t _saved_locale;
 
-    void buildFilter(std::vector<Matcher>& vector, const char* base, int offset);
-    char* truncate(char* name, int max_length);
     const char* cppDemangle(const char* name);
     char* javaMethodName(jmethodID method);
-    char* javaClassName(const char* symbol, int length, int style);
+    const std::string& cachedJavaMethodName(jmethodID method);
+    CachedFrameName& cachedFrame(ASGCT_CallFrame& frame);
+    const char* formatName(ASGCT_CallFrame& frame, bool for_matching);
+
+    static char* truncate(char* name, int max_length);
 
   public:
     FrameName(Arguments& args, int style, Mutex& thread_names_lock, ThreadMap& thread_names);
     ~FrameName();
 
-    const char* name(ASGCT_CallFrame& frame, bool for_matching = false);
+    // Frames with the same key have the same name: Java frames of one method differ only by line,
+    // other frames are identified by method_id and bci kind. User space pointers never use
+    // the two top bytes, so they can hold the kind or bci (limited to 16 bits by the bytecode length).
+    static u64 frameKey(const ASGCT_CallFrame& frame, int style) {
+        if (frame.bci < 0) {
+            return (u64)(uintptr_t)frame.method_id ^ (u64)(u8)frame.bci << 56;
+        } else if (style & STYLE_LINES) {
+            return (u64)(uintptr_t)frame.method_id ^ (u64)(frame.bci & 0xffff) << 48;
+        }
+        return (u64)(uintptr_t)frame.method_id;
+    }
+
+    // Java class name from a symbol like java/lang/String or [Ljava/lang/String;
+    // The result points into buf of MAX_FRAME_NAME_LENGTH bytes.
+    static char* javaClassName(char* buf, const char* symbol, int length, int style);
+
+    // Java method name as it appears in the output, e.g. java/lang/String.hashCode.
+    // class_sig is a class descriptor like Ljava/lang/String; method_sig may be truncated in place.
+    static char* javaMethodName(char* buf, const char* class_sig, const char* method_name, char* method_sig, int style);
+
+    // Names are formatted once per distinct frame; the result remains valid for the lifetime of FrameName
+    const char* name(ASGCT_CallFrame& frame);
+
+    // FrameFilter bits telling whether the frame matches include and exclude lists.
+    // Like names, the verdict is computed once per distinct frame.
+    int filter(ASGCT_CallFrame& frame);
+
+    // Line number of the given bci, or 0 if unknown. Line tables are fetched once per method.
+    int lineNumber(jmethodID method, jint bci);
 
     bool hasIncludeList() { return !_include.empty(); }
     bool hasExcludeList() { return !_exclude.empty(); }
-
-    bool include(const char* frame_name);
-    bool exclude(const char* frame_name);
 };
 
 #endif // _FRAMENAME_H
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "idMap.h"
+
+
+void IdMap::grow() {
+    std::vector<Slot> slots(_slots.size() * 2);
+    u32 mask = slots.size() - 1;
+
+    for (size_t i = 0; i < _slots.size(); i++) {
+        if (_slots[i].value != 0) {
+            u32 slot = hash(_slots[i].key) & mask;
+            while (slots[slot].value != 0) {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = _slots[i];
+        }
+    }
+
+    _slots.swap(slots);
+}
+
+u32 IdMap::get(u64 key) const {
+    u32 mask = _slots.size() - 1;
+    for (u32 slot = hash(key) & mask; _slots[slot].value != 0; slot = (slot + 1) & mask) {
+        if (_slots[slot].key == key) {
+            return _slots[slot].value;
+        }
+    }
+    return 0;
+}
+
+void IdMap::put(u64 key, u32 value) {
+    if (++_size * 2 > _slots.size()) {
+        grow();
+    }
+
+    u32 mask = _slots.size() - 1;
+    u32 slot = hash(key) & mask;
+    while (_slots[slot].value != 0) {
+        slot = (slot + 1) & mask;
+    }
+    _slots[slot].key = key;
+    _slots[slot].value = value;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IDMAP_H
+#define _IDMAP_H
+
+#include <stddef.h>
+#include <vector>
+#include "arch.h"
+
+
+// Open addressing hash table from arbitrary 64-bit keys to non-zero u32 values
+class IdMap {
+  private:
+    struct Slot {
+        u64 key;
+        u32 value;
+    };
+
+    std::vector<Slot> _slots;
+    u32 _size;
+
+    static u32 hash(u64 key) {
+        key = (key ^ (key >> 33)) * 0xff51afd7ed558ccdULL;
+        key = (key ^ (key >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+        return (u32)(key ^ (key >> 33));
+    }
+
+    void grow();
+
+  public:
+    IdMap() : _slots(1024), _size(0) {
+    }
+
+    // Returns 0 if the key is absent
+    u32 get(u64 key) const;
+    void put(u64 key, u32 value);
+};
+
+#endif // _IDMAP_H
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dlfcn.h>
+#include "importHooks.h"
+#include "profiler.h"
+
+
+bool ImportHooks::resolve() {
+    for (int i = 0; i < _count; i++) {
+        if (*_hooks[i].original == NULL && (*_hooks[i].original = dlsym(RTLD_DEFAULT, _hooks[i].name)) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ImportHooks::findSelf() {
+    NativeCodeCache* self = Profiler::_instance.findNativeLibrary(_hooks[0].hook);
+    if (self == NULL) {
+        return false;
+    }
+    _self_min = self->minAddress();
+    _self_max = self->maxAddress();
+    return true;
+}
+
+bool ImportHooks::imported(int count) {
+    Profiler* profiler = &Profiler::_instance;
+    for (int i = 0; i < profiler->_native_lib_count; i++) {
+        NativeCodeCache* cc = profiler->_native_libs[i];
+        if (cc->minAddress() == _self_min) {
+            continue;
+        }
+        for (int j = 0; j < count; j++) {
+            if (cc->hasImport(_hooks[j].id)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void ImportHooks::patchLibraries(int from, bool install) {
+    Profiler* profiler = &Profiler::_instance;
+    int count = profiler->_native_lib_count;
+
+    for (int i = from; i < count; i++) {
+        NativeCodeCache* cc = profiler->_native_libs[i];
+        if (cc->minAddress() == _self_min) {
+            continue;
+        }
+        for (int j = 0; j < _installed; j++) {
+            cc->patchImport(_hooks[j].id, install ? _hooks[j].hook : *_hooks[j].original);
+        }
+    }
+
+    _patched_libs = count;
+}
+
+void ImportHooks::install(int count) {
+    _installed = count;
+    _running = true;
+    patchLibraries(0, true);
+}
+
+void ImportHooks::uninstall() {
+    _running = false;
+    patchLibraries(0, false);
+}
+
+void ImportHooks::installNew() {
+    if (_running) {
+        patchLibraries(_patched_libs, true);
+    }
+}
+
+int ImportHooks::skipSelfFrames(const void** callchain, int depth) {
+    int skip = 0;
+    while (skip < depth && callchain[skip] >= _self_min && callchain[skip] < _self_max) {
+        skip++;
+    }
+    for (int i = skip; i < depth; i++) {
+        callchain[i - skip] = callchain[i];
+    }
+    return depth - skip;
+}
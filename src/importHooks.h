@@ -0,0 +1,72 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IMPORTHOOKS_H
+#define _IMPORTHOOKS_H
+
+#include <stddef.h>
+#include "codeCache.h"
+
+
+// A library function whose GOT entries are redirected to a hook
+struct ImportHook {
+    ImportId id;
+    const char* name;
+    void* hook;
+    void** original;  // receives the address of the original function
+};
+
+// Redirects GOT entries of the loaded libraries to hooks, as done by the engines
+// that intercept calls of native library functions. The profiler library itself
+// is never patched, so that calls made while recording a sample are not intercepted.
+class ImportHooks {
+  private:
+    const ImportHook* _hooks;
+    int _count;
+    int _installed;
+    volatile bool _running;
+    int _patched_libs;
+    const void* _self_min;
+    const void* _self_max;
+
+    void patchLibraries(int from, bool install);
+
+  public:
+    ImportHooks(const ImportHook* hooks, int count) : _hooks(hooks), _count(count), _installed(0),
+        _running(false), _patched_libs(0), _self_min(NULL), _self_max(NULL) {
+    }
+
+    // Resolves the original functions the same way the dynamic linker would for a library
+    bool resolve();
+
+    // Finds the profiler library by the address of the first hook
+    bool findSelf();
+
+    // Whether any library imports one of the first count functions
+    bool imported(int count);
+
+    // Patches the first count functions in all loaded libraries
+    void install(int count);
+    void uninstall();
+
+    // Patches libraries that have been loaded since install
+    void installNew();
+
+    // Removes the frames of the hook and the profiler itself from the top of the stack
+    int skipSelfFrames(const void** callchain, int depth);
+};
+
+#endif // _IMPORTHOOKS_H
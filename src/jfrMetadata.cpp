@@ -116,7 +116,8 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
                 << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
                 << field("monitorClass", T_CLASS, "Monitor Class", F_CPOOL)
-                << field("address", T_LONG, "Monitor Address", F_ADDRESS))
+                << field("address", T_LONG, "Monitor Address", F_ADDRESS)
+                << field("previousOwner", T_THREAD, "Previous Monitor Owner", F_CPOOL))
 
             << (type("jdk.ThreadPark", T_THREAD_PARK, "Java Thread Park")
                 << category("Java Application")
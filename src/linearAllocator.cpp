@@ -14,35 +14,89 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include "linearAllocator.h"
-#include "os.h"
 
 
 LinearAllocator::LinearAllocator(size_t chunk_size) {
     _chunk_size = chunk_size;
-    _reserve = _tail = allocateChunk(NULL);
+    _policy = 0;
+    _lanes = 1;
+    _reserved = 0;
+    _reserve[0] = _tail[0] = allocateChunk(NULL, 0);
+    memset(_slots, 0, sizeof(_slots));
 }
 
 LinearAllocator::~LinearAllocator() {
     clear();
-    freeChunk(_tail);
+    for (int lane = 0; lane < _lanes; lane++) {
+        freeChunk(_tail[lane]);
+    }
 }
 
-void LinearAllocator::clear() {
-    if (_reserve->prev == _tail) {
-        freeChunk(_reserve);
+void LinearAllocator::setMemoryPolicy(int policy) {
+    _policy = policy;
+
+    // Lanes are never removed, since they may hold live data
+    int nodes = policy & MEMORY_NUMA ? OS::numaNodes() : 1;
+    for (; _lanes < nodes && _lanes < MAX_ALLOCATOR_LANES; _lanes++) {
+        Chunk* chunk = allocateChunk(NULL, _lanes);
+        if (chunk == NULL) {
+            break;
+        }
+        _reserve[_lanes] = _tail[_lanes] = chunk;
     }
-    while (_tail->prev != NULL) {
-        Chunk* current = _tail;
-        _tail = _tail->prev;
-        freeChunk(current);
+}
+
+void LinearAllocator::clear() {
+    memset(_slots, 0, sizeof(_slots));
+
+    for (int lane = 0; lane < _lanes; lane++) {
+        if (_reserve[lane]->prev == _tail[lane]) {
+            freeChunk(_reserve[lane]);
+        }
+        while (_tail[lane]->prev != NULL) {
+            Chunk* current = _tail[lane];
+            _tail[lane] = _tail[lane]->prev;
+            freeChunk(current);
+        }
+        _reserve[lane] = _tail[lane];
+        _tail[lane]->offs = sizeof(Chunk);
     }
-    _reserve = _tail;
-    _tail->offs = sizeof(Chunk);
 }
 
 void* LinearAllocator::alloc(size_t size) {
-    Chunk* chunk = _tail;
+    if (size > SUB_CHUNK_SIZE / 8 || SUB_CHUNK_SIZE > _chunk_size / 8) {
+        return allocShared(size);
+    }
+
+    AllocatorSlot& slot = _slots[(u32)OS::cpuId() % ALLOCATOR_SLOTS];
+    while (true) {
+        // The slot is contended only if the thread is interrupted by a signal or migrates to another CPU
+        SubChunk* sub_chunk = slot.sub_chunk;
+        if (sub_chunk != NULL) {
+            for (size_t offs = sub_chunk->offs; offs + size <= sub_chunk->size; offs = sub_chunk->offs) {
+                if (__sync_bool_compare_and_swap(&sub_chunk->offs, offs, offs + size)) {
+                    return (char*)sub_chunk + offs;
+                }
+            }
+        }
+
+        SubChunk* new_sub_chunk = (SubChunk*)allocShared(SUB_CHUNK_SIZE);
+        if (new_sub_chunk == NULL) {
+            return allocShared(size);
+        }
+        new_sub_chunk->offs = sizeof(SubChunk);
+        new_sub_chunk->size = SUB_CHUNK_SIZE;
+
+        // If another thread has refilled the slot meanwhile, the new sub-chunk is wasted
+        __sync_bool_compare_and_swap(&slot.sub_chunk, sub_chunk, new_sub_chunk);
+    }
+}
+
+void* LinearAllocator::allocShared(size_t size) {
+    int lane = currentLane();
+    Chunk* chunk = _tail[lane];
 
     do {
         // Fast path: bump a pointer with CAS
@@ -50,19 +104,20 @@ void* LinearAllocator::alloc(size_t size) {
             if (__sync_bool_compare_and_swap(&chunk->offs, offs, offs + size)) {
                 if (_chunk_size / 2 - offs < size) {
                     // Stepped over a middle of the chunk - it's time to prepare a new one
-                    reserveChunk(chunk);
+                    reserveChunk(chunk, lane);
                 }
                 return (char*)chunk + offs;
             }
         }
-    } while ((chunk = getNextChunk(chunk)) != NULL);
+    } while ((chunk = getNextChunk(chunk, lane)) != NULL);
 
     return NULL;
 }
 
-Chunk* LinearAllocator::allocateChunk(Chunk* current) {
-    Chunk* chunk = (Chunk*)OS::safeAlloc(_chunk_size);
+Chunk* LinearAllocator::allocateChunk(Chunk* current, int lane) {
+    Chunk* chunk = (Chunk*)OS::safeAlloc(_chunk_size, _policy, _lanes > 1 ? lane : -1);
     if (chunk != NULL) {
+        atomicInc(_reserved, _chunk_size);
         chunk->prev = current;
         chunk->offs = sizeof(Chunk);
     }
@@ -71,29 +126,30 @@ Chunk* LinearAllocator::allocateChunk(Chunk* current) {
 
 void LinearAllocator::freeChunk(Chunk* current) {
     OS::safeFree(current, _chunk_size);
+    atomicInc(_reserved, -(u64)_chunk_size);
 }
 
-void LinearAllocator::reserveChunk(Chunk* current) {
-    Chunk* reserve = allocateChunk(current);
-    if (reserve != NULL && !__sync_bool_compare_and_swap(&_reserve, current, reserve)) {
+void LinearAllocator::reserveChunk(Chunk* current, int lane) {
+    Chunk* reserve = allocateChunk(current, lane);
+    if (reserve != NULL && !__sync_bool_compare_and_swap(&_reserve[lane], current, reserve)) {
         // Unlikely case that we are too late
         freeChunk(reserve);
     }
 }
 
-Chunk* LinearAllocator::getNextChunk(Chunk* current) {
-    Chunk* reserve = _reserve;
+Chunk* LinearAllocator::getNextChunk(Chunk* current, int lane) {
+    Chunk* reserve = _reserve[lane];
 
     if (reserve == current) {
         // Unlikely case: no reserve yet.
         // It's probably being allocated right now, so let's compete
-        reserve = allocateChunk(current);
+        reserve = allocateChunk(current, lane);
         if (reserve == NULL) {
             // Not enough memory
             return NULL;
         }
 
-        Chunk* prev_reserve = __sync_val_compare_and_swap(&_reserve, current, reserve);
+        Chunk* prev_reserve = __sync_val_compare_and_swap(&_reserve[lane], current, reserve);
         if (prev_reserve != current) {
             freeChunk(reserve);
             reserve = prev_reserve;
@@ -101,6 +157,6 @@ Chunk* LinearAllocator::getNextChunk(Chunk* current) {
     }
 
     // Expected case: a new chunk is already reserved
-    Chunk* tail = __sync_val_compare_and_swap(&_tail, current, reserve);
+    Chunk* tail = __sync_val_compare_and_swap(&_tail[lane], current, reserve);
     return tail == current ? reserve : tail;
 }
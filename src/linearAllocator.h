@@ -18,6 +18,12 @@
 #define _LINEARALLOCATOR_H
 
 #include <stddef.h>
+#include "os.h"
+
+
+const int MAX_ALLOCATOR_LANES = 16;
+const int ALLOCATOR_SLOTS = 64;
+const size_t SUB_CHUNK_SIZE = 64 * 1024;
 
 
 struct Chunk {
@@ -27,24 +33,56 @@ struct Chunk {
     char _padding[56];
 };
 
+// A piece of a Chunk privately used by one CPU
+struct SubChunk {
+    volatile size_t offs;
+    size_t size;
+};
+
+// Each slot takes its own cache line to avoid false sharing between CPUs
+struct AllocatorSlot {
+    SubChunk* volatile sub_chunk;
+} __attribute__((aligned(64)));
+
+// Lock-free bump allocator. Small allocations are served from per-CPU sub-chunks,
+// so that CPUs do not contend on the same offset; only refills touch the shared chunk.
+// With MEMORY_NUMA policy, there is a separate chain of chunks (a lane) per NUMA node,
+// and each thread allocates from the lane of its node.
 class LinearAllocator {
   private:
     size_t _chunk_size;
-    Chunk* _tail;
-    Chunk* _reserve;
+    int _policy;
+    int _lanes;
+    volatile u64 _reserved;
+    Chunk* _tail[MAX_ALLOCATOR_LANES];
+    Chunk* _reserve[MAX_ALLOCATOR_LANES];
+    AllocatorSlot _slots[ALLOCATOR_SLOTS];
 
-    Chunk* allocateChunk(Chunk* current);
+    Chunk* allocateChunk(Chunk* current, int lane);
     void freeChunk(Chunk* current);
-    void reserveChunk(Chunk* current);
-    Chunk* getNextChunk(Chunk* current);
+    void reserveChunk(Chunk* current, int lane);
+    Chunk* getNextChunk(Chunk* current, int lane);
+    void* allocShared(size_t size);
+
+    int currentLane() {
+        return _lanes > 1 && (_policy & MEMORY_NUMA) ? OS::numaNode() % _lanes : 0;
+    }
 
   public:
     LinearAllocator(size_t chunk_size);
     ~LinearAllocator();
 
+    // Applies to chunks allocated from now on. Must not be called concurrently with alloc()
+    void setMemoryPolicy(int policy);
+
     void clear();
 
     void* alloc(size_t size);
+
+    // Total size of chunks currently held, including the reserve and partly used sub-chunks
+    u64 reserved() {
+        return _reserved;
+    }
 };
 
 #endif // _LINEARALLOCATOR_H
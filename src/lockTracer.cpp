@@ -15,13 +15,139 @@
  */
 
 #include <string.h>
+#include <time.h>
 #include "lockTracer.h"
 #include "os.h"
 #include "profiler.h"
+#include "vmStructs.h"
+
+
+static const u32 WAITER_SLOTS = 1024;
+static const u32 LOCK_CLASS_SLOTS = 1024;
+static const u32 MAX_PROBES = 16;
+static const u32 CONCURRENT_LOCK = 0x80000000;
+
+
+// The time when the current thread started waiting for a contended monitor.
+// MonitorContendedEnter and MonitorContendedEntered are called on the waiting thread itself,
+// so unlike JVM TI tags, this requires neither a JVM lock nor a tag map lookup.
+static __thread u64 _enter_time = 0;
+
+
+// A thread waiting for a contended monitor, while lock owners are sampled.
+// The slot is taken by the waiting thread on MonitorContendedEnter and released
+// on MonitorContendedEntered. The owner sampler thread fills in the owner of a wait
+// that has lasted longer than the threshold; owner_time tells which wait it belongs to.
+struct Waiter {
+    volatile int tid;
+    volatile u64 enter_time;
+    volatile u64 owner_time;
+    LockOwner owner;
+};
+
+// Allocated on the first start with lockowner option
+static Waiter* _waiters = NULL;
+
+// The slot of the current thread, if it has taken one
+static __thread Waiter* _current_waiter = NULL;
+
+static Waiter* takeWaiterSlot(int tid, u64 enter_time) {
+    u32 slot = (u32)((u64)tid * 0x9e3779b97f4a7c15ULL >> 32) & (WAITER_SLOTS - 1);
+    for (u32 step = 0; step < MAX_PROBES; step++, slot = (slot + 1) & (WAITER_SLOTS - 1)) {
+        Waiter* w = &_waiters[slot];
+        int current = w->tid;
+        // A slot with the same tid is left from a wait that has not seen MonitorContendedEntered
+        if (current == tid || (current == 0 && __sync_bool_compare_and_swap(&w->tid, 0, tid))) {
+            w->owner_time = 0;
+            w->enter_time = enter_time;
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static bool getOwner(Waiter* w, u64 enter_time, LockOwner& owner) {
+    if (w->owner_time != enter_time) {
+        return false;
+    }
+    __sync_synchronize();
+
+    owner.tid = w->owner.tid;
+    owner.num_frames = w->owner.num_frames;
+    if (owner.num_frames < 0 || owner.num_frames > MAX_LOCK_OWNER_FRAMES) {
+        return false;
+    }
+    memcpy(owner.frames, w->owner.frames, owner.num_frames * sizeof(jvmtiFrameInfo));
+    return owner.tid != 0;
+}
+
+
+// Lock class ids by Klass pointer, so that a contended lock does not allocate a class signature
+// every time. After a class is unloaded, its Klass address may be reused by another class,
+// so an entry is valid only while the Klass still has the same name Symbol: class id and
+// the concurrent flag depend on nothing but the name. Entries are never evicted; the cache
+// is cleared on start, since class ids do not survive profiler reset. Classes that do not fit,
+// or whose slot is held by an unloaded class, are resolved on every event.
+class LockClassCache {
+  private:
+    struct Entry {
+        volatile uintptr_t klass;
+        volatile uintptr_t name;
+        volatile u32 value;  // class_id | CONCURRENT_LOCK; 0 while being inserted
+    };
+
+    Entry _entries[LOCK_CLASS_SLOTS];
+
+    static u32 hash(uintptr_t klass) {
+        return (u32)(((u64)klass >> 3) * 0x9e3779b97f4a7c15ULL >> 32) & (LOCK_CLASS_SLOTS - 1);
+    }
+
+  public:
+    void clear() {
+        memset(_entries, 0, sizeof(_entries));
+    }
+
+    // Returns 0 if the class is not cached yet
+    u32 get(uintptr_t klass, uintptr_t name) {
+        u32 slot = hash(klass);
+        for (u32 step = 0; step < MAX_PROBES; step++, slot = (slot + 1) & (LOCK_CLASS_SLOTS - 1)) {
+            uintptr_t current = _entries[slot].klass;
+            if (current == klass) {
+                // The name is published before the value
+                u32 value = _entries[slot].value;
+                __sync_synchronize();
+                return _entries[slot].name == name ? value : 0;
+            } else if (current == 0) {
+                return 0;
+            }
+        }
+        return 0;
+    }
+
+    void put(uintptr_t klass, uintptr_t name, u32 value) {
+        u32 slot = hash(klass);
+        for (u32 step = 0; step < MAX_PROBES; step++, slot = (slot + 1) & (LOCK_CLASS_SLOTS - 1)) {
+            uintptr_t current = _entries[slot].klass;
+            if (current == klass) {
+                return;
+            } else if (current == 0 && __sync_bool_compare_and_swap(&_entries[slot].klass, 0, klass)) {
+                _entries[slot].name = name;
+                __sync_synchronize();
+                _entries[slot].value = value;
+                return;
+            }
+        }
+    }
+};
+
+static LockClassCache _lock_classes;
 
 
 jlong LockTracer::_threshold;
 jlong LockTracer::_start_time = 0;
+int LockTracer::_owner_rate = 0;
+volatile bool LockTracer::_owner_running = false;
+pthread_t LockTracer::_owner_thread;
 jclass LockTracer::_UnsafeClass = NULL;
 jclass LockTracer::_LockSupport = NULL;
 jmethodID LockTracer::_getBlocker = NULL;
@@ -32,10 +158,29 @@ bool LockTracer::_initialized = false;
 Error LockTracer::start(Arguments& args) {
     _threshold = args._lock;
 
+    if (args._lockowner > 0 && _waiters == NULL) {
+        _waiters = (Waiter*)OS::safeAlloc(WAITER_SLOTS * sizeof(Waiter));
+        if (_waiters == NULL) {
+            return Error("Not enough memory to sample lock owners");
+        }
+    }
+    _owner_rate = args._lockowner;
+    if (_owner_rate > 0 && !VMThread::hasNativeId()) {
+        Log::warn("Lock owners cannot be sampled on this JVM");
+        _owner_rate = 0;
+    }
+    if (_waiters != NULL) {
+        // Slots of waits that have not seen MonitorContendedEntered before the previous stop
+        memset(_waiters, 0, WAITER_SLOTS * sizeof(Waiter));
+    }
+
     if (!_initialized) {
         initialize();
     }
 
+    // Class ids of the previous session may be gone after reset
+    _lock_classes.clear();
+
     // Enable Java Monitor events
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, NULL);
@@ -47,10 +192,24 @@ Error LockTracer::start(Arguments& args) {
         bindUnsafePark(UnsafeParkHook);
     }
 
+    if (_owner_rate > 0) {
+        _owner_running = true;
+        if (pthread_create(&_owner_thread, NULL, ownerThreadEntry, NULL) != 0) {
+            Log::warn("Unable to create lock owner sampler thread");
+            _owner_running = false;
+            _owner_rate = 0;
+        }
+    }
+
     return Error::OK;
 }
 
 void LockTracer::stop() {
+    if (_owner_running) {
+        _owner_running = false;
+        pthread_join(_owner_thread, NULL);
+    }
+
     // Disable Java Monitor events
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, NULL);
@@ -96,23 +255,159 @@ void LockTracer::initialize() {
 }
 
 void JNICALL LockTracer::MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
-    jlong enter_time = OS::nanotime();
-    jvmti->SetTag(thread, enter_time);
+    u64 enter_time = OS::nanotime();
+    _enter_time = enter_time;
+
+    if (_owner_rate > 0) {
+        int tid = OS::threadId();
+        Waiter* w = _current_waiter;
+        if (w != NULL && w->tid == tid) {
+            // The previous wait has not seen MonitorContendedEntered, since profiling was stopped
+            w->enter_time = 0;
+            __sync_synchronize();
+            w->tid = 0;
+        }
+        _current_waiter = takeWaiterSlot(tid, enter_time);
+    }
 }
 
 void JNICALL LockTracer::MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
     jlong entered_time = OS::nanotime();
-    jlong enter_time;
-    jvmti->GetTag(thread, &enter_time);
+
+    jlong enter_time = _enter_time;
+    _enter_time = 0;
+
+    LockOwner owner;
+    bool has_owner = false;
+
+    Waiter* w = _current_waiter;
+    if (w != NULL) {
+        _current_waiter = NULL;
+        // The slot is not ours if the table has been cleared on restart
+        if (w->tid == OS::threadId()) {
+            has_owner = getOwner(w, enter_time, owner);
+            w->enter_time = 0;
+            __sync_synchronize();
+            w->tid = 0;
+        }
+    }
 
     // Time is meaningless if lock attempt has started before profiling
-    if (_enabled && entered_time - enter_time >= _threshold && enter_time >= _start_time) {
-        char* lock_name = getLockName(jvmti, env, object);
-        recordContendedLock(BCI_LOCK, enter_time, entered_time, lock_name, object, 0);
-        jvmti->Deallocate((unsigned char*)lock_name);
+    if (_enabled && enter_time != 0 && entered_time - enter_time >= _threshold && enter_time >= _start_time) {
+        bool concurrent;
+        u32 class_id = getLockClass(jvmti, env, object, concurrent);
+        recordContendedLock(BCI_LOCK, enter_time, entered_time, class_id, object, 0, has_owner ? &owner : NULL);
     }
 }
 
+void* LockTracer::ownerThreadEntry(void* unused) {
+    ownerLoop();
+    return NULL;
+}
+
+// Finding the owner of a monitor requires VM operations, so it is done off the waiting threads
+// at most _owner_rate times per second, and only for waits that have already exceeded the threshold
+void LockTracer::ownerLoop() {
+    JNIEnv* env = VM::attachThread("Async-profiler Lock Owner Sampler");
+    if (env == NULL) {
+        return;
+    }
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    const u64 interval = 1000000000ULL / _owner_rate;
+    u64 next_sample_time = OS::nanotime() + interval;
+
+    while (_owner_running) {
+        // Sleep in short steps to respond to stop() promptly
+        u64 now = OS::nanotime();
+        if (now < next_sample_time) {
+            u64 sleep_time = next_sample_time - now < 100000000 ? next_sample_time - now : 100000000;
+            struct timespec timeout = {0, (long)sleep_time};
+            nanosleep(&timeout, NULL);
+            continue;
+        }
+        next_sample_time = now + interval;
+
+        if (_enabled && env->PushLocalFrame(16) == 0) {
+            sampleOwner(jvmti, env);
+            env->PopLocalFrame(NULL);
+        }
+    }
+
+    VM::detachThread();
+}
+
+// Samples the owner for the longest wait that exceeds the threshold and has no owner yet
+void LockTracer::sampleOwner(jvmtiEnv* jvmti, JNIEnv* env) {
+    u64 now = OS::nanotime();
+    Waiter* target = NULL;
+    int tid = 0;
+    u64 enter_time = 0;
+
+    for (u32 i = 0; i < WAITER_SLOTS; i++) {
+        Waiter* w = &_waiters[i];
+        int t = w->tid;
+        u64 e = w->enter_time;
+        if (t != 0 && e >= (u64)_start_time && e != 0 && w->owner_time != e &&
+            now - e >= (u64)_threshold && (target == NULL || e < enter_time)) {
+            target = w;
+            tid = t;
+            enter_time = e;
+        }
+    }
+    if (target == NULL) {
+        return;
+    }
+
+    // A failed attempt is also marked with owner_time, so that the same wait is not retried forever
+    LockOwner& owner = target->owner;
+    owner.tid = 0;
+    owner.num_frames = 0;
+
+    jthread thread = findThread(jvmti, env, tid);
+    jobject monitor;
+    jvmtiMonitorUsage usage;
+    if (thread != NULL && jvmti->GetCurrentContendedMonitor(thread, &monitor) == 0 && monitor != NULL &&
+        jvmti->GetObjectMonitorUsage(monitor, &usage) == 0) {
+        jvmti->Deallocate((unsigned char*)usage.waiters);
+        jvmti->Deallocate((unsigned char*)usage.notify_waiters);
+
+        // The monitor may have been released in the meantime
+        VMThread* vm_thread = usage.owner != NULL ? VMThread::fromJavaThread(env, usage.owner) : NULL;
+        int owner_tid = vm_thread != NULL ? vm_thread->osThreadId() : 0;
+        if (owner_tid != 0 && owner_tid != tid &&
+            jvmti->GetStackTrace(usage.owner, 0, MAX_LOCK_OWNER_FRAMES, owner.frames, &owner.num_frames) == 0) {
+            owner.tid = owner_tid;
+        }
+    }
+
+    // The waiter might have entered the monitor and released the slot while the owner was sampled
+    __sync_synchronize();
+    if (target->tid == tid && target->enter_time == enter_time) {
+        target->owner_time = enter_time;
+    }
+}
+
+jthread LockTracer::findThread(jvmtiEnv* jvmti, JNIEnv* env, int tid) {
+    jint thread_count;
+    jthread* thread_objects;
+    if (jvmti->GetAllThreads(&thread_count, &thread_objects) != 0) {
+        return NULL;
+    }
+
+    jthread result = NULL;
+    for (int i = 0; i < thread_count; i++) {
+        VMThread* vm_thread = VMThread::fromJavaThread(env, thread_objects[i]);
+        if (vm_thread != NULL && vm_thread->osThreadId() == tid) {
+            result = thread_objects[i];
+            break;
+        }
+    }
+
+    jvmti->Deallocate((unsigned char*)thread_objects);
+    return result;
+}
+
 jint JNICALL LockTracer::RegisterNativesHook(JNIEnv* env, jclass cls, const JNINativeMethod* methods, jint nMethods) {
     if (env->IsSameObject(cls, _UnsafeClass)) {
         for (jint i = 0; i < nMethods; i++) {
@@ -140,11 +435,12 @@ void JNICALL LockTracer::UnsafeParkHook(JNIEnv* env, jobject instance, jboolean
     if (park_blocker != NULL) {
         park_end_time = OS::nanotime();
         if (park_end_time - park_start_time >= _threshold) {
-            char* lock_name = getLockName(jvmti, env, park_blocker);
-            if (lock_name == NULL || isConcurrentLock(lock_name)) {
-                recordContendedLock(BCI_PARK, park_start_time, park_end_time, lock_name, park_blocker, time);
+            // A blocker of unknown class is recorded as well
+            bool concurrent;
+            u32 class_id = getLockClass(jvmti, env, park_blocker, concurrent);
+            if (concurrent) {
+                recordContendedLock(BCI_PARK, park_start_time, park_end_time, class_id, park_blocker, time, NULL);
             }
-            jvmti->Deallocate((unsigned char*)lock_name);
         }
     }
 }
@@ -159,36 +455,66 @@ jobject LockTracer::getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env) {
     return env->CallStaticObjectMethod(_LockSupport, _getBlocker, thread);
 }
 
-char* LockTracer::getLockName(jvmtiEnv* jvmti, JNIEnv* env, jobject lock) {
-    char* class_name;
-    if (jvmti->GetClassSignature(env->GetObjectClass(lock), &class_name, NULL) != 0) {
-        return NULL;
+// Returns class_id of the lock object, or 0 if the class is unknown.
+// concurrent tells if the class is a synchronizer that is profiled on park()
+u32 LockTracer::getLockClass(jvmtiEnv* jvmti, JNIEnv* env, jobject lock, bool& concurrent) {
+    jclass lock_class = env->GetObjectClass(lock);
+    u32 class_id = 0;
+    concurrent = true;
+
+    if (VMStructs::hasClassNames()) {
+        VMKlass* klass = VMKlass::fromJavaClass(env, lock_class);
+        VMSymbol* symbol = klass->name();
+        u32 value = _lock_classes.get((uintptr_t)klass, (uintptr_t)symbol);
+        if (value != 0) {
+            class_id = value & ~CONCURRENT_LOCK;
+            concurrent = (value & CONCURRENT_LOCK) != 0;
+        } else {
+            class_id = lookupLockClass(symbol->body(), symbol->length(), concurrent);
+            _lock_classes.put((uintptr_t)klass, (uintptr_t)symbol, class_id | (concurrent ? CONCURRENT_LOCK : 0));
+        }
+    } else {
+        char* lock_name;
+        if (jvmti->GetClassSignature(lock_class, &lock_name, NULL) == 0) {
+            if (lock_name[0] == 'L') {
+                class_id = lookupLockClass(lock_name + 1, strlen(lock_name) - 2, concurrent);
+            } else {
+                class_id = lookupLockClass(lock_name, strlen(lock_name), concurrent);
+            }
+            jvmti->Deallocate((unsigned char*)lock_name);
+        }
     }
-    return class_name;
+
+    env->DeleteLocalRef(lock_class);
+    return class_id;
+}
+
+// lock_name is a class name in the internal form, not necessarily NUL-terminated
+u32 LockTracer::lookupLockClass(const char* lock_name, size_t len, bool& concurrent) {
+    concurrent = isConcurrentLock(lock_name, len);
+    return Profiler::_instance.classMap()->lookup(lock_name, len);
 }
 
-bool LockTracer::isConcurrentLock(const char* lock_name) {
+bool LockTracer::isConcurrentLock(const char* lock_name, size_t len) {
     // Do not count synchronizers other than ReentrantLock, ReentrantReadWriteLock and Semaphore
-    return strncmp(lock_name, "Ljava/util/concurrent/locks/ReentrantLock", 41) == 0 ||
-           strncmp(lock_name, "Ljava/util/concurrent/locks/ReentrantReadWriteLock", 50) == 0 ||
-           strncmp(lock_name, "Ljava/util/concurrent/Semaphore", 31) == 0;
+    return (len >= 40 && strncmp(lock_name, "java/util/concurrent/locks/ReentrantLock", 40) == 0) ||
+           (len >= 49 && strncmp(lock_name, "java/util/concurrent/locks/ReentrantReadWriteLock", 49) == 0) ||
+           (len >= 30 && strncmp(lock_name, "java/util/concurrent/Semaphore", 30) == 0);
 }
 
 void LockTracer::recordContendedLock(int event_type, u64 start_time, u64 end_time,
-                                     const char* lock_name, jobject lock, jlong timeout) {
+                                     u32 class_id, jobject lock, jlong timeout, LockOwner* owner) {
     LockEvent event;
-    event._class_id = 0;
+    event._class_id = class_id;
     event._start_time = start_time;
     event._end_time = end_time;
     event._address = *(uintptr_t*)lock;
     event._timeout = timeout;
 
-    if (lock_name != NULL) {
-        if (lock_name[0] == 'L') {
-            event._class_id = Profiler::_instance.classMap()->lookup(lock_name + 1, strlen(lock_name) - 2);
-        } else {
-            event._class_id = Profiler::_instance.classMap()->lookup(lock_name);
-        }
+    if (owner != NULL) {
+        event._owner_tid = owner->tid;
+        event._owner_depth = owner->num_frames;
+        event._owner_frames = owner->frames;
     }
 
     Profiler::_instance.recordSample(NULL, end_time - start_time, event_type, &event);
@@ -18,17 +18,28 @@
 #define _LOCKTRACER_H
 
 #include <jvmti.h>
+#include <pthread.h>
 #include "arch.h"
 #include "engine.h"
+#include "event.h"
 
 
 typedef jint (JNICALL *RegisterNativesFunc)(JNIEnv*, jclass, const JNINativeMethod*, jint);
 typedef void (JNICALL *UnsafeParkFunc)(JNIEnv*, jobject, jboolean, jlong);
 
+struct LockOwner {
+    int tid;
+    jint num_frames;
+    jvmtiFrameInfo frames[MAX_LOCK_OWNER_FRAMES];
+};
+
 class LockTracer : public Engine {
   private:
     static jlong _threshold;
     static jlong _start_time;
+    static int _owner_rate;
+    static volatile bool _owner_running;
+    static pthread_t _owner_thread;
     static jclass _UnsafeClass;
     static jclass _LockSupport;
     static jmethodID _getBlocker;
@@ -43,10 +54,15 @@ class LockTracer : public Engine {
     static void JNICALL UnsafeParkHook(JNIEnv* env, jobject instance, jboolean isAbsolute, jlong time);
 
     static jobject getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env);
-    static char* getLockName(jvmtiEnv* jvmti, JNIEnv* env, jobject lock);
-    static bool isConcurrentLock(const char* lock_name);
+    static u32 getLockClass(jvmtiEnv* jvmti, JNIEnv* env, jobject lock, bool& concurrent);
+    static u32 lookupLockClass(const char* lock_name, size_t len, bool& concurrent);
+    static bool isConcurrentLock(const char* lock_name, size_t len);
+    static void* ownerThreadEntry(void* unused);
+    static void ownerLoop();
+    static void sampleOwner(jvmtiEnv* jvmti, JNIEnv* env);
+    static jthread findThread(jvmtiEnv* jvmti, JNIEnv* env, int tid);
     static void recordContendedLock(int event_type, u64 start_time, u64 end_time,
-                                    const char* lock_name, jobject lock, jlong timeout);
+                                    u32 class_id, jobject lock, jlong timeout, LockOwner* owner);
     static void bindUnsafePark(UnsafeParkFunc entry);
 
   public:
@@ -0,0 +1,306 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/mman.h>
+#include "mallocTracer.h"
+#include "importHooks.h"
+#include "os.h"
+#include "profiler.h"
+
+
+static const u64 DEFAULT_NATIVEMEM_INTERVAL = 1024 * 1024;
+static const u32 LIVE_CAPACITY = 256 * 1024;
+static const u32 MAX_PROBES = 64;
+static const u64 TOMBSTONE = 1;
+// The slot is being filled; its address is stored once the other fields are written
+static const u64 BUSY = 2;
+
+
+struct LiveAllocation {
+    volatile u64 address;
+    u32 call_trace_id;
+    u32 reserved;
+    u64 size;
+};
+
+// Open addressing table of the sampled allocations that have not been freed.
+// Lookups are bounded by MAX_PROBES; freed slots become tombstones that new allocations may reuse.
+// Samples that do not fit are not tracked, so they never show up as leaks.
+// Blocks freed by code that is not hooked stay in the table until their address is allocated again.
+class LiveAllocations {
+  private:
+    LiveAllocation _slots[LIVE_CAPACITY];
+
+    static u32 hash(u64 address) {
+        // Allocations are at least 8-byte aligned
+        return (u32)((address >> 3) * 0x9e3779b97f4a7c15ULL >> 32) & (LIVE_CAPACITY - 1);
+    }
+
+  public:
+    static LiveAllocations* allocate() {
+        return (LiveAllocations*)OS::safeAlloc(sizeof(LiveAllocations));
+    }
+
+    void destroy() {
+        OS::safeFree(this, sizeof(LiveAllocations));
+    }
+
+    void add(u64 address, u32 call_trace_id, u64 size) {
+        // An entry with the same address is stale: that block was freed without the hook
+        u32 slot = hash(address);
+        for (u32 step = 0; step < MAX_PROBES; step++, slot = (slot + 1) & (LIVE_CAPACITY - 1)) {
+            u64 current = _slots[slot].address;
+            if (current == address) {
+                if (__sync_bool_compare_and_swap(&_slots[slot].address, current, BUSY)) {
+                    fill(_slots[slot], address, call_trace_id, size);
+                }
+                return;
+            } else if (current == 0) {
+                break;
+            }
+        }
+
+        slot = hash(address);
+        for (u32 step = 0; step < MAX_PROBES; step++, slot = (slot + 1) & (LIVE_CAPACITY - 1)) {
+            u64 current = _slots[slot].address;
+            if ((current == 0 || current == TOMBSTONE) &&
+                __sync_bool_compare_and_swap(&_slots[slot].address, current, BUSY)) {
+                fill(_slots[slot], address, call_trace_id, size);
+                return;
+            }
+        }
+    }
+
+    // A concurrent dump must not see the address of a slot before its trace and size
+    static void fill(LiveAllocation& a, u64 address, u32 call_trace_id, u64 size) {
+        a.call_trace_id = call_trace_id;
+        a.size = size;
+        __sync_synchronize();
+        a.address = address;
+    }
+
+    void remove(u64 address) {
+        u32 slot = hash(address);
+        for (u32 step = 0; step < MAX_PROBES; step++, slot = (slot + 1) & (LIVE_CAPACITY - 1)) {
+            u64 current = _slots[slot].address;
+            if (current == address) {
+                __sync_bool_compare_and_swap(&_slots[slot].address, current, TOMBSTONE);
+                return;
+            } else if (current == 0) {
+                return;
+            }
+        }
+    }
+
+    void collect(std::map<u32, CallTrace*>& traces, std::map<u64, CallTraceSample>& map) {
+        for (u32 slot = 0; slot < LIVE_CAPACITY; slot++) {
+            const LiveAllocation& a = _slots[slot];
+            if (a.address <= BUSY) {
+                continue;
+            }
+
+            std::map<u32, CallTrace*>::const_iterator it = traces.find(a.call_trace_id);
+            if (it != traces.end()) {
+                CallTraceSample& sample = map[(u64)(uintptr_t)it->second];
+                sample.trace = it->second;
+                sample.samples++;
+                sample.counter += a.size;
+            }
+        }
+    }
+};
+
+
+typedef void* (*malloc_t)(size_t);
+typedef void* (*calloc_t)(size_t, size_t);
+typedef void* (*realloc_t)(void*, size_t);
+typedef void (*free_t)(void*);
+typedef void* (*mmap_t)(void*, size_t, int, int, int, off_t);
+typedef int (*munmap_t)(void*, size_t);
+
+static malloc_t _orig_malloc = NULL;
+static calloc_t _orig_calloc = NULL;
+static realloc_t _orig_realloc = NULL;
+static free_t _orig_free = NULL;
+static mmap_t _orig_mmap = NULL;
+static munmap_t _orig_munmap = NULL;
+
+static void* malloc_hook(size_t size) {
+    void* result = _orig_malloc(size);
+    if (result != NULL && size != 0) {
+        MallocTracer::recordMalloc(result, size);
+    }
+    return result;
+}
+
+static void* calloc_hook(size_t num, size_t size) {
+    void* result = _orig_calloc(num, size);
+    if (result != NULL && num * size != 0) {
+        MallocTracer::recordMalloc(result, num * size);
+    }
+    return result;
+}
+
+static void* realloc_hook(void* address, size_t size) {
+    void* result = _orig_realloc(address, size);
+    if (result != NULL || size == 0) {
+        // On failure, the original block remains allocated
+        if (address != NULL) {
+            MallocTracer::recordFree(address);
+        }
+        if (result != NULL && size != 0) {
+            MallocTracer::recordMalloc(result, size);
+        }
+    }
+    return result;
+}
+
+static void free_hook(void* address) {
+    // Forget the block before it can be reused by another thread
+    if (address != NULL) {
+        MallocTracer::recordFree(address);
+    }
+    _orig_free(address);
+}
+
+static void* mmap_hook(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    void* result = _orig_mmap(addr, length, prot, flags, fd, offset);
+    // File mappings are not native memory allocations
+    if (result != MAP_FAILED && (flags & MAP_ANONYMOUS)) {
+        MallocTracer::recordMalloc(result, length);
+    }
+    return result;
+}
+
+static int munmap_hook(void* addr, size_t length) {
+    MallocTracer::recordFree(addr);
+    return _orig_munmap(addr, length);
+}
+
+// free and munmap come last: they are hooked only when tracking leaks
+static const ImportHook MALLOC_HOOKS[] = {
+    {IMPORT_MALLOC, "malloc", (void*)malloc_hook, (void**)&_orig_malloc},
+    {IMPORT_CALLOC, "calloc", (void*)calloc_hook, (void**)&_orig_calloc},
+    {IMPORT_REALLOC, "realloc", (void*)realloc_hook, (void**)&_orig_realloc},
+    {IMPORT_MMAP, "mmap", (void*)mmap_hook, (void**)&_orig_mmap},
+    {IMPORT_FREE, "free", (void*)free_hook, (void**)&_orig_free},
+    {IMPORT_MUNMAP, "munmap", (void*)munmap_hook, (void**)&_orig_munmap}
+};
+
+static const int ALLOC_HOOK_COUNT = 4;
+static const int LEAK_HOOK_COUNT = sizeof(MALLOC_HOOKS) / sizeof(MALLOC_HOOKS[0]);
+
+static ImportHooks malloc_hooks(MALLOC_HOOKS, LEAK_HOOK_COUNT);
+
+
+u64 MallocTracer::_interval;
+volatile u64 MallocTracer::_allocated_bytes;
+bool MallocTracer::_leaks = false;
+LiveAllocations* MallocTracer::_live = NULL;
+
+
+void MallocTracer::recordMalloc(void* address, size_t size) {
+    if (!_enabled) {
+        return;
+    }
+
+    if (_interval > 1) {
+        // Sample once per _interval bytes: a single atomic add, no retries under contention
+        u64 prev = __sync_fetch_and_add(&_allocated_bytes, size);
+        if ((prev + size) / _interval == prev / _interval) {
+            return;
+        }
+    }
+
+    MallocEvent event;
+    event._address = (uintptr_t)address;
+    event._size = size;
+
+    u32 call_trace_id = Profiler::_instance.recordSample(NULL, size, BCI_MALLOC, &event);
+    if (call_trace_id != 0 && _live != NULL) {
+        _live->add((uintptr_t)address, call_trace_id, size);
+    }
+}
+
+void MallocTracer::recordFree(void* address) {
+    LiveAllocations* live = _live;
+    if (live != NULL) {
+        live->remove((uintptr_t)address);
+    }
+}
+
+void MallocTracer::collectLeaks(std::map<u32, CallTrace*>& traces, std::map<u64, CallTraceSample>& map) {
+    if (_live != NULL) {
+        _live->collect(traces, map);
+    }
+}
+
+// Skip the frames of the hook and the profiler itself: the stack starts from the caller of malloc
+int MallocTracer::getNativeTrace(void* ucontext, int tid, const void** callchain, int max_depth,
+                                 CodeCache* java_methods, CodeCache* runtime_stubs) {
+    int depth = Engine::getNativeTrace(ucontext, tid, callchain, max_depth, java_methods, runtime_stubs);
+    return malloc_hooks.skipSelfFrames(callchain, depth);
+}
+
+void MallocTracer::installHooks() {
+    malloc_hooks.installNew();
+}
+
+Error MallocTracer::check(Arguments& args) {
+    if (args._output == OUTPUT_JFR) {
+        return Error("nativemem is not supported with JFR output");
+    }
+
+    if (!malloc_hooks.resolve()) {
+        return Error("Could not resolve native memory allocation functions");
+    } else if (!malloc_hooks.findSelf()) {
+        return Error("Could not find the profiler library");
+    } else if (!malloc_hooks.imported(1)) {
+        return Error("No libraries import malloc");
+    }
+    return Error::OK;
+}
+
+Error MallocTracer::start(Arguments& args) {
+    if (args._interval < 0) {
+        return Error("interval must be positive");
+    }
+
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    _interval = args._interval ? args._interval : DEFAULT_NATIVEMEM_INTERVAL;
+    _allocated_bytes = 0;
+    _leaks = args._leaks;
+
+    // Allocations of the previous session are kept until now, since they may still be dumped
+    if (_live != NULL) {
+        _live->destroy();
+        _live = NULL;
+    }
+    if (_leaks && (_live = LiveAllocations::allocate()) == NULL) {
+        return Error("Not enough memory to track live allocations");
+    }
+
+    malloc_hooks.install(_leaks ? LEAK_HOOK_COUNT : ALLOC_HOOK_COUNT);
+    return Error::OK;
+}
+
+void MallocTracer::stop() {
+    malloc_hooks.uninstall();
+}
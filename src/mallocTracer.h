@@ -0,0 +1,69 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MALLOCTRACER_H
+#define _MALLOCTRACER_H
+
+#include <map>
+#include <stdint.h>
+#include "callTraceStorage.h"
+#include "engine.h"
+
+
+class LiveAllocations;
+
+// Samples native memory allocations by redirecting GOT entries of malloc, calloc, realloc and mmap
+// in the loaded libraries. With the leaks option, also hooks free and munmap to keep track
+// of sampled allocations that are not released yet.
+class MallocTracer : public Engine {
+  private:
+    static u64 _interval;
+    static volatile u64 _allocated_bytes;
+    static bool _leaks;
+    static LiveAllocations* _live;
+
+  public:
+    const char* title() {
+        return "Native memory profile";
+    }
+
+    const char* units() {
+        return "bytes";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    int getNativeTrace(void* ucontext, int tid, const void** callchain, int max_depth,
+                       CodeCache* java_methods, CodeCache* runtime_stubs);
+
+    // Live allocations refer to traces by call_trace_id, so the profile cannot be reset meanwhile
+    static bool trackingLeaks() {
+        return _live != NULL;
+    }
+
+    // Hooks libraries that have been loaded since start
+    static void installHooks();
+
+    static void recordMalloc(void* address, size_t size);
+    static void recordFree(void* address);
+
+    // Samples of the allocations that were not freed
+    static void collectLeaks(std::map<u32, CallTrace*>& traces, std::map<u64, CallTraceSample>& map);
+};
+
+#endif // _MALLOCTRACER_H
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <string.h>
+#include "matcher.h"
+
+
+// Markers surrounding the scanned string. Frame names never contain control characters.
+const unsigned char MATCH_START = 1;
+const unsigned char MATCH_END = 2;
+
+Matcher::Matcher() : _states(1), _fail(), _goto(), _empty(true), _match_all(false) {
+    _states[0].parent = 0;
+    _states[0].depth = 0;
+    _states[0].c = 0;
+    _states[0].output = false;
+}
+
+void Matcher::addChar(u32& state, unsigned char c) {
+    u32 next = transition(state, c);
+    if (next == 0) {
+        State s = {state, _states[state].depth + 1, c, false};
+        next = _states.size();
+        _states.push_back(s);
+        _goto.put((u64)state << 8 | c, next);
+    }
+    state = next;
+}
+
+void Matcher::add(const char* pattern) {
+    _empty = false;
+
+    bool starts_with = pattern[0] != '*';
+    if (!starts_with) pattern++;
+
+    size_t len = strlen(pattern);
+    bool ends_with = len == 0 || pattern[len - 1] != '*';
+    if (!ends_with) len--;
+
+    if (!starts_with && !ends_with && len == 0) {
+        _match_all = true;
+        return;
+    }
+
+    u32 state = 0;
+    if (starts_with) addChar(state, MATCH_START);
+    for (size_t i = 0; i < len; i++) {
+        addChar(state, (unsigned char)pattern[i]);
+    }
+    if (ends_with) addChar(state, MATCH_END);
+
+    _states[state].output = true;
+}
+
+void Matcher::addList(const char* base, int offset) {
+    while (offset != 0) {
+        add(base + offset);
+        offset = ((int*)(base + offset))[-1];
+    }
+}
+
+void Matcher::compile() {
+    // Failure links point to shallower states, so compute them in the order of depth
+    std::vector<u64> by_depth(_states.size());
+    for (u32 i = 0; i < _states.size(); i++) {
+        by_depth[i] = (u64)_states[i].depth << 32 | i;
+    }
+    std::sort(by_depth.begin(), by_depth.end());
+
+    _fail.assign(_states.size(), 0);
+    for (size_t i = 1; i < by_depth.size(); i++) {
+        u32 state = (u32)by_depth[i];
+        u32 parent = _states[state].parent;
+        unsigned char c = _states[state].c;
+
+        u32 fail = 0;
+        if (parent != 0) {
+            fail = _fail[parent];
+            while (fail != 0 && transition(fail, c) == 0) {
+                fail = _fail[fail];
+            }
+            fail = transition(fail, c);
+        }
+
+        _fail[state] = fail;
+        _states[state].output |= _states[fail].output;
+    }
+}
+
+bool Matcher::matches(const char* s) {
+    if (_match_all) {
+        return true;
+    } else if (_empty) {
+        return false;
+    }
+
+    u32 state = 0;
+    for (size_t i = 0; ; i++) {
+        unsigned char c = i == 0 ? MATCH_START : s[i - 1] != 0 ? (unsigned char)s[i - 1] : MATCH_END;
+
+        u32 next;
+        while ((next = transition(state, c)) == 0 && state != 0) {
+            state = _fail[state];
+        }
+        state = next;
+
+        if (_states[state].output) {
+            return true;
+        } else if (c == MATCH_END) {
+            return false;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MATCHER_H
+#define _MATCHER_H
+
+#include <vector>
+#include "arch.h"
+#include "idMap.h"
+
+
+// Matches a string against a set of patterns at once. A pattern is a literal name
+// with an optional '*' wildcard at the beginning and/or at the end.
+// All patterns are compiled into one Aho-Corasick automaton: the string is scanned
+// between start and end markers, so that a pattern anchored to either end
+// is just a literal that includes the corresponding marker.
+class Matcher {
+  private:
+    struct State {
+        u32 parent;
+        u32 depth;
+        unsigned char c;
+        bool output;  // some pattern ends in this state or in one of its suffixes
+    };
+
+    std::vector<State> _states;
+    std::vector<u32> _fail;
+    IdMap _goto;  // state << 8 | char -> next state
+    bool _empty;
+    bool _match_all;
+
+    u32 transition(u32 state, unsigned char c) {
+        return _goto.get((u64)state << 8 | c);
+    }
+
+    void addChar(u32& state, unsigned char c);
+
+  public:
+    Matcher();
+
+    bool empty() { return _empty; }
+
+    void add(const char* pattern);
+    // Adds all patterns of the embedded list (see Arguments::appendToEmbeddedList)
+    void addList(const char* base, int offset);
+    void compile();
+
+    bool matches(const char* s);
+};
+
+#endif // _MATCHER_H
@@ -0,0 +1,199 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include "methodFilter.h"
+
+
+const u32 INITIAL_FILTER_CAPACITY = 4096;
+
+
+MethodFilter::Table* MethodFilter::allocateTable(u32 capacity) {
+    Table* table = (Table*)calloc(1, sizeof(Table) + (capacity - 1) * sizeof(uintptr_t));
+    table->capacity = capacity;
+    return table;
+}
+
+u32 MethodFilter::hash(jmethodID method) {
+    u64 key = (u64)(uintptr_t)method;
+    key = (key ^ (key >> 33)) * 0xff51afd7ed558ccdULL;
+    return (u32)(key ^ (key >> 33));
+}
+
+void MethodFilter::release() {
+    free(_table);
+    _table = NULL;
+
+    for (size_t i = 0; i < _retired.size(); i++) {
+        free(_retired[i]);
+    }
+    _retired.clear();
+
+    delete _include;
+    delete _exclude;
+    _include = NULL;
+    _exclude = NULL;
+    _has_include = false;
+    _has_exclude = false;
+}
+
+void MethodFilter::init(Arguments& args) {
+    {
+        MutexLocker ml(_lock);
+        _enabled = false;
+        release();
+
+        if (!args._prefilter || (args._include == 0 && args._exclude == 0)) {
+            return;
+        }
+
+        _include = new Matcher();
+        _include->addList(args._buf, args._include);
+        _include->compile();
+        _has_include = !_include->empty();
+
+        _exclude = new Matcher();
+        _exclude->addList(args._buf, args._exclude);
+        _exclude->compile();
+        _has_exclude = !_exclude->empty();
+
+        _style = args._style;
+        _table = allocateTable(INITIAL_FILTER_CAPACITY);
+        _enabled = true;
+    }
+
+    // Classes prepared from now on are handled by addMethods; resolve the ones already loaded
+    jvmtiEnv* jvmti = VM::jvmti();
+    jint class_count;
+    jclass* classes;
+    if (jvmti->GetLoadedClasses(&class_count, &classes) == 0) {
+        for (int i = 0; i < class_count; i++) {
+            jint method_count;
+            jmethodID* methods;
+            if (jvmti->GetClassMethods(classes[i], &method_count, &methods) == 0) {
+                addMethods(jvmti, classes[i], method_count, methods);
+                jvmti->Deallocate((unsigned char*)methods);
+            }
+        }
+        jvmti->Deallocate((unsigned char*)classes);
+    }
+}
+
+void MethodFilter::addMethods(jvmtiEnv* jvmti, jclass klass, jint method_count, jmethodID* methods) {
+    char* class_sig;
+    if (method_count == 0 || jvmti->GetClassSignature(klass, &class_sig, NULL) != 0) {
+        return;
+    }
+
+    MutexLocker ml(_lock);
+    if (_enabled) {
+        for (int i = 0; i < method_count; i++) {
+            int verdict = matchMethod(jvmti, class_sig, methods[i]);
+            if (verdict != 0) {
+                put(methods[i], verdict);
+            }
+        }
+    }
+
+    jvmti->Deallocate((unsigned char*)class_sig);
+}
+
+int MethodFilter::matchMethod(jvmtiEnv* jvmti, const char* class_sig, jmethodID method) {
+    char* method_name;
+    char* method_sig;
+    if (jvmti->GetMethodName(method, &method_name, &method_sig, NULL) != 0) {
+        return 0;
+    }
+
+    // Patterns must see the same name as FrameName::filter does
+    char buf[MAX_FRAME_NAME_LENGTH];
+    const char* name = FrameName::javaMethodName(buf, class_sig, method_name, method_sig, _style);
+    int verdict = (_has_include && _include->matches(name) ? METHOD_INCLUDED : 0) |
+                  (_has_exclude && _exclude->matches(name) ? METHOD_EXCLUDED : 0);
+
+    jvmti->Deallocate((unsigned char*)method_sig);
+    jvmti->Deallocate((unsigned char*)method_name);
+    return verdict;
+}
+
+// Called under _lock. Readers may access the table concurrently:
+// every update is a single word store, and a grown table is published only when complete.
+void MethodFilter::put(jmethodID method, int verdict) {
+    Table* table = _table;
+    if (table->size * 2 >= table->capacity) {
+        Table* new_table = allocateTable(table->capacity * 2);
+        u32 new_mask = new_table->capacity - 1;
+        for (u32 i = 0; i < table->capacity; i++) {
+            uintptr_t entry = table->entries[i];
+            if (entry != 0) {
+                u32 slot = hash((jmethodID)(entry & ~(uintptr_t)3)) & new_mask;
+                while (new_table->entries[slot] != 0) {
+                    slot = (slot + 1) & new_mask;
+                }
+                new_table->entries[slot] = entry;
+            }
+        }
+        new_table->size = table->size;
+
+        __sync_synchronize();
+        _table = new_table;
+        // Signal handlers may still be reading the old table
+        _retired.push_back(table);
+        table = new_table;
+    }
+
+    u32 mask = table->capacity - 1;
+    u32 slot = hash(method) & mask;
+    while (table->entries[slot] != 0) {
+        if ((table->entries[slot] & ~(uintptr_t)3) == (uintptr_t)method) {
+            table->entries[slot] = (uintptr_t)method | verdict;
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    table->entries[slot] = (uintptr_t)method | verdict;
+    table->size++;
+}
+
+int MethodFilter::verdict(jmethodID method) {
+    Table* table = _table;
+    u32 mask = table->capacity - 1;
+    for (u32 slot = hash(method) & mask; ; slot = (slot + 1) & mask) {
+        uintptr_t entry = table->entries[slot];
+        if (entry == 0) {
+            return 0;
+        } else if ((entry & ~(uintptr_t)3) == (uintptr_t)method) {
+            return (int)(entry & 3);
+        }
+    }
+}
+
+bool MethodFilter::accept(ASGCT_CallFrame* frames, int num_frames) {
+    bool need_include = _has_include;
+    for (int i = 0; i < num_frames; i++) {
+        // Special frames have bci <= BCI_NATIVE_FRAME
+        if (frames[i].bci > BCI_NATIVE_FRAME && frames[i].method_id != NULL) {
+            int verdict = this->verdict(frames[i].method_id);
+            if (verdict & METHOD_EXCLUDED) {
+                return false;
+            } else if (verdict & METHOD_INCLUDED) {
+                need_include = false;
+                if (!_has_exclude) break;
+            }
+        }
+    }
+    return !need_include;
+}
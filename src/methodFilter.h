@@ -0,0 +1,90 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METHODFILTER_H
+#define _METHODFILTER_H
+
+#include <jvmti.h>
+#include <vector>
+#include "arch.h"
+#include "arguments.h"
+#include "frameName.h"
+#include "mutex.h"
+#include "vmEntry.h"
+
+
+// Applies include/exclude lists when a sample is recorded, so that unwanted traces
+// do not occupy CallTraceStorage at all. Patterns are matched against Java method names
+// once, when a class is prepared; the matching jmethodIDs go to a hash set
+// that recordSample queries without locks.
+class MethodFilter {
+  private:
+    enum {
+        METHOD_INCLUDED = 1,
+        METHOD_EXCLUDED = 2
+    };
+
+    // Open addressing table of jmethodIDs. jmethodID is a pointer to an aligned slot,
+    // so the two lowest bits are free to hold the verdict. Only matching methods are stored.
+    struct Table {
+        u32 capacity;
+        u32 size;
+        uintptr_t entries[1];
+    };
+
+    Table* volatile _table;
+    std::vector<Table*> _retired;
+    Mutex _lock;
+    Matcher* _include;
+    Matcher* _exclude;
+    bool _has_include;
+    bool _has_exclude;
+    int _style;
+    volatile bool _enabled;
+
+    static Table* allocateTable(u32 capacity);
+    static u32 hash(jmethodID method);
+
+    void release();
+    void put(jmethodID method, int verdict);
+    int verdict(jmethodID method);
+    int matchMethod(jvmtiEnv* jvmti, const char* class_sig, jmethodID method);
+
+  public:
+    MethodFilter() : _table(NULL), _retired(), _lock(), _include(NULL), _exclude(NULL),
+        _has_include(false), _has_exclude(false), _style(0), _enabled(false) {
+    }
+
+    ~MethodFilter() {
+        release();
+    }
+
+    bool enabled() {
+        return _enabled;
+    }
+
+    // Must not be called while samples are being recorded
+    void init(Arguments& args);
+
+    // Called whenever jmethodIDs of a class are (re)created
+    void addMethods(jvmtiEnv* jvmti, jclass klass, jint method_count, jmethodID* methods);
+
+    // Signal-safe. Only Java frames are taken into account:
+    // a trace without included Java methods is rejected, even if it has a matching native frame.
+    bool accept(ASGCT_CallFrame* frames, int num_frames);
+};
+
+#endif // _METHODFILTER_H
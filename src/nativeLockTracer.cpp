@@ -0,0 +1,158 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include "nativeLockTracer.h"
+#include "importHooks.h"
+#include "os.h"
+#include "profiler.h"
+
+
+static const u64 DEFAULT_NATIVELOCK_THRESHOLD = 10000;  // 10 us
+
+
+typedef int (*mutex_lock_t)(pthread_mutex_t*);
+typedef int (*rwlock_lock_t)(pthread_rwlock_t*);
+
+static mutex_lock_t _orig_mutex_lock = NULL;
+static mutex_lock_t _orig_mutex_trylock = NULL;
+static rwlock_lock_t _orig_rwlock_rdlock = NULL;
+static rwlock_lock_t _orig_rwlock_tryrdlock = NULL;
+static rwlock_lock_t _orig_rwlock_wrlock = NULL;
+static rwlock_lock_t _orig_rwlock_trywrlock = NULL;
+
+// Only EBUSY means the lock would block. Any other result of trylock, including
+// EOWNERDEAD of a robust mutex that has been acquired, is final.
+static int pthread_mutex_lock_hook(pthread_mutex_t* mutex) {
+    int result = _orig_mutex_trylock(mutex);
+    if (result != EBUSY) {
+        return result;
+    }
+
+    u64 start_time = OS::nanotime();
+    result = _orig_mutex_lock(mutex);
+    NativeLockTracer::recordContendedLock("pthread_mutex_lock", mutex, start_time, OS::nanotime());
+    return result;
+}
+
+static int pthread_rwlock_rdlock_hook(pthread_rwlock_t* rwlock) {
+    int result = _orig_rwlock_tryrdlock(rwlock);
+    if (result != EBUSY) {
+        return result;
+    }
+
+    u64 start_time = OS::nanotime();
+    result = _orig_rwlock_rdlock(rwlock);
+    NativeLockTracer::recordContendedLock("pthread_rwlock_rdlock", rwlock, start_time, OS::nanotime());
+    return result;
+}
+
+static int pthread_rwlock_wrlock_hook(pthread_rwlock_t* rwlock) {
+    int result = _orig_rwlock_trywrlock(rwlock);
+    if (result != EBUSY) {
+        return result;
+    }
+
+    u64 start_time = OS::nanotime();
+    result = _orig_rwlock_wrlock(rwlock);
+    NativeLockTracer::recordContendedLock("pthread_rwlock_wrlock", rwlock, start_time, OS::nanotime());
+    return result;
+}
+
+static const ImportHook LOCK_HOOKS[] = {
+    {IMPORT_PTHREAD_MUTEX_LOCK, "pthread_mutex_lock", (void*)pthread_mutex_lock_hook, (void**)&_orig_mutex_lock},
+    {IMPORT_PTHREAD_RWLOCK_RDLOCK, "pthread_rwlock_rdlock", (void*)pthread_rwlock_rdlock_hook, (void**)&_orig_rwlock_rdlock},
+    {IMPORT_PTHREAD_RWLOCK_WRLOCK, "pthread_rwlock_wrlock", (void*)pthread_rwlock_wrlock_hook, (void**)&_orig_rwlock_wrlock}
+};
+
+static const int LOCK_HOOK_COUNT = sizeof(LOCK_HOOKS) / sizeof(LOCK_HOOKS[0]);
+
+static ImportHooks lock_hooks(LOCK_HOOKS, LOCK_HOOK_COUNT);
+
+
+u64 NativeLockTracer::_threshold;
+
+
+void NativeLockTracer::recordContendedLock(const char* function, void* lock, u64 start_time, u64 end_time) {
+    if (!_enabled || end_time - start_time < _threshold) {
+        return;
+    }
+
+    NativeLockEvent event;
+    event._class_id = 0;
+    event._start_time = start_time;
+    event._end_time = end_time;
+    event._address = (uintptr_t)lock;
+    event._timeout = 0;
+    event._function = function;
+
+    Profiler::_instance.recordSample(NULL, end_time - start_time, BCI_NATIVE_LOCK, &event);
+}
+
+// Skip the frames of the hook and the profiler itself: the stack starts from the caller of the lock function
+int NativeLockTracer::getNativeTrace(void* ucontext, int tid, const void** callchain, int max_depth,
+                                     CodeCache* java_methods, CodeCache* runtime_stubs) {
+    int depth = Engine::getNativeTrace(ucontext, tid, callchain, max_depth, java_methods, runtime_stubs);
+    return lock_hooks.skipSelfFrames(callchain, depth);
+}
+
+void NativeLockTracer::installHooks() {
+    lock_hooks.installNew();
+}
+
+Error NativeLockTracer::check(Arguments& args) {
+    if (args._output == OUTPUT_JFR) {
+        return Error("nativelock is not supported with JFR output");
+    }
+
+    // Trylock functions are called by the hooks, but not hooked themselves
+    if (_orig_mutex_trylock == NULL) {
+        _orig_mutex_trylock = (mutex_lock_t)dlsym(RTLD_DEFAULT, "pthread_mutex_trylock");
+        _orig_rwlock_tryrdlock = (rwlock_lock_t)dlsym(RTLD_DEFAULT, "pthread_rwlock_tryrdlock");
+        _orig_rwlock_trywrlock = (rwlock_lock_t)dlsym(RTLD_DEFAULT, "pthread_rwlock_trywrlock");
+    }
+    if (!lock_hooks.resolve() || _orig_mutex_trylock == NULL ||
+        _orig_rwlock_tryrdlock == NULL || _orig_rwlock_trywrlock == NULL) {
+        return Error("Could not resolve pthread lock functions");
+    } else if (!lock_hooks.findSelf()) {
+        return Error("Could not find the profiler library");
+    } else if (!lock_hooks.imported(LOCK_HOOK_COUNT)) {
+        return Error("No libraries import pthread lock functions");
+    }
+    return Error::OK;
+}
+
+Error NativeLockTracer::start(Arguments& args) {
+    if (args._interval < 0) {
+        return Error("interval must be positive");
+    }
+
+    Error error = check(args);
+    if (error) {
+        return error;
+    }
+
+    _threshold = args._interval ? args._interval : DEFAULT_NATIVELOCK_THRESHOLD;
+
+    lock_hooks.install(LOCK_HOOK_COUNT);
+    return Error::OK;
+}
+
+void NativeLockTracer::stop() {
+    lock_hooks.uninstall();
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NATIVELOCKTRACER_H
+#define _NATIVELOCKTRACER_H
+
+#include "arch.h"
+#include "engine.h"
+
+
+// Profiles contended pthread mutexes and read-write locks by redirecting GOT entries
+// of pthread_mutex_lock, pthread_rwlock_rdlock and pthread_rwlock_wrlock in the loaded libraries.
+// Locks are first tried without blocking, so an uncontended lock costs one extra trylock call.
+// HotSpot internal mutexes are built on pthread_mutex_lock since JDK 11, so they are covered, too.
+class NativeLockTracer : public Engine {
+  private:
+    static u64 _threshold;
+
+  public:
+    const char* title() {
+        return "Native lock profile";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    int getNativeTrace(void* ucontext, int tid, const void** callchain, int max_depth,
+                       CodeCache* java_methods, CodeCache* runtime_stubs);
+
+    // Hooks libraries that have been loaded since start
+    static void installHooks();
+
+    static void recordContendedLock(const char* function, void* lock, u64 start_time, u64 end_time);
+};
+
+#endif // _NATIVELOCKTRACER_H
@@ -27,6 +27,16 @@ typedef void (*SigAction)(int, siginfo_t*, void*);
 typedef void (*SigHandler)(int);
 typedef void (*TimerCallback)(void*);
 
+// Backing of memory returned by OS::safeAlloc
+enum MemoryPolicy {
+    MEMORY_HUGE_PAGES = 1,  // transparent huge pages
+    MEMORY_HUGETLB    = 2,  // explicit huge pages from the reserved pool; THP if the pool is exhausted
+    MEMORY_NUMA       = 4   // place pages on the given node, or interleave them across all nodes
+};
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+
 enum ThreadState {
     THREAD_INVALID,
     THREAD_RUNNING,
@@ -74,6 +84,8 @@ class OS {
     static int getMaxThreadId();
     static int processId();
     static int threadId();
+    // Signal-safe hint for spreading per-CPU data: the current CPU, where it is cheap to find out
+    static int cpuId();
     static bool threadName(int thread_id, char* name_buf, size_t name_len);
     static ThreadState threadState(int thread_id);
     static ThreadList* listThreads();
@@ -83,9 +95,14 @@ class OS {
     static SigAction installSignalHandler(int signo, SigAction action, SigHandler handler = NULL);
     static bool sendSignalToThread(int thread_id, int signo);
 
-    static void* safeAlloc(size_t size);
+    // Signal-safe. The policy is a combination of MemoryPolicy bits;
+    // with MEMORY_HUGETLB, the size must be a multiple of HUGE_PAGE_SIZE.
+    static void* safeAlloc(size_t size, int policy = 0, int node = -1);
     static void safeFree(void* addr, size_t size);
 
+    static int numaNodes();  // the first call must not be from a signal handler
+    static int numaNode();
+
     static Timer* startTimer(u64 interval, TimerCallback callback, void* arg);
     static void stopTimer(Timer* timer);
 
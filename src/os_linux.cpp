@@ -20,6 +20,7 @@
 #include <byteswap.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,6 +42,19 @@
 #  define MMAP_SYSCALL __NR_mmap2
 #endif
 
+#ifndef MAP_HUGETLB
+#  define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MADV_HUGEPAGE
+#  define MADV_HUGEPAGE 14
+#endif
+
+// From numaif.h, which comes with libnuma rather than libc
+const int MPOL_PREFERRED = 1;
+const int MPOL_INTERLEAVE = 3;
+const int MAX_NUMA_NODES = 1024;
+
 
 class LinuxThreadList : public ThreadList {
   private:
@@ -177,6 +191,12 @@ int OS::threadId() {
     return syscall(__NR_gettid);
 }
 
+int OS::cpuId() {
+    // Served by vDSO or rseq without entering the kernel
+    int cpu = sched_getcpu();
+    return cpu >= 0 ? cpu : 0;
+}
+
 bool OS::threadName(int thread_id, char* name_buf, size_t name_len) {
     char buf[64];
     sprintf(buf, "/proc/self/task/%d/comm", thread_id);
@@ -242,13 +262,50 @@ bool OS::sendSignalToThread(int thread_id, int signo) {
     return syscall(__NR_tgkill, processId(), thread_id, signo) == 0;
 }
 
-void* OS::safeAlloc(size_t size) {
+static bool isMmapError(intptr_t result) {
+    return result < 0 && result > -4096;
+}
+
+void* OS::safeAlloc(size_t size, int policy, int node) {
     // Naked syscall can be used inside a signal handler.
     // Also, we don't want to catch our own calls when profiling mmap.
-    intptr_t result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (result < 0 && result > -4096) {
-        return NULL;
+    intptr_t result = -1;
+    if (policy & MEMORY_HUGETLB) {
+        result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (!isMmapError(result)) {
+            policy &= ~MEMORY_HUGETLB;
+        } else {
+            // No pages in the hugetlb pool: fall back to transparent huge pages
+            policy = (policy & ~MEMORY_HUGETLB) | MEMORY_HUGE_PAGES;
+        }
+    }
+
+    if (isMmapError(result)) {
+        result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (isMmapError(result)) {
+            return NULL;
+        }
     }
+
+    // Advice must be given before the memory is touched. Failures are not fatal:
+    // the memory just remains backed by regular pages with the default placement.
+    if ((policy & MEMORY_HUGE_PAGES) && !(policy & MEMORY_HUGETLB)) {
+        syscall(__NR_madvise, result, size, MADV_HUGEPAGE);
+    }
+
+    if (policy & MEMORY_NUMA) {
+        unsigned long nodemask[MAX_NUMA_NODES / 64] = {0};
+        if (node >= 0 && node < MAX_NUMA_NODES) {
+            nodemask[node / 64] = 1UL << (node % 64);
+            syscall(__NR_mbind, result, size, MPOL_PREFERRED, nodemask, MAX_NUMA_NODES, 0);
+        } else {
+            for (int i = 0; i < numaNodes(); i++) {
+                nodemask[i / 64] |= 1UL << (i % 64);
+            }
+            syscall(__NR_mbind, result, size, MPOL_INTERLEAVE, nodemask, MAX_NUMA_NODES, 0);
+        }
+    }
+
     return (void*)result;
 }
 
@@ -256,6 +313,25 @@ void OS::safeFree(void* addr, size_t size) {
     syscall(__NR_munmap, addr, size);
 }
 
+int OS::numaNodes() {
+    static int nodes = 0;
+    if (nodes == 0) {
+        // Node IDs are dense on all known platforms
+        char path[64];
+        do {
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", nodes);
+        } while (access(path, F_OK) == 0 && ++nodes < MAX_NUMA_NODES);
+
+        if (nodes == 0) nodes = 1;
+    }
+    return nodes;
+}
+
+int OS::numaNode() {
+    unsigned int node;
+    return syscall(__NR_getcpu, NULL, &node, NULL) == 0 ? (int)node : 0;
+}
+
 Timer* OS::startTimer(u64 interval, TimerCallback callback, void* arg) {
     struct sigevent sev;
     sev.sigev_notify = SIGEV_THREAD;
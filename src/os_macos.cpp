@@ -161,6 +161,11 @@ int OS::processId() {
     return self_pid;
 }
 
+int OS::cpuId() {
+    // No cheap way to get the current CPU; a thread ID is good enough to spread the load
+    return threadId();
+}
+
 int OS::threadId() {
     // Used to be pthread_mach_thread_np(pthread_self()),
     // but pthread_mach_thread_np is not async signal safe
@@ -228,7 +233,7 @@ bool OS::sendSignalToThread(int thread_id, int signo) {
 #endif
 }
 
-void* OS::safeAlloc(size_t size) {
+void* OS::safeAlloc(size_t size, int policy, int node) {
     // mmap() is not guaranteed to be async signal safe, but in practice, it is.
     // There is no a reasonable alternative anyway.
     void* result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -242,6 +247,14 @@ void OS::safeFree(void* addr, size_t size) {
     munmap(addr, size);
 }
 
+int OS::numaNodes() {
+    return 1;
+}
+
+int OS::numaNode() {
+    return 0;
+}
+
 Timer* OS::startTimer(u64 interval, TimerCallback callback, void* arg) {
     dispatch_queue_t queue = dispatch_get_global_queue(QOS_CLASS_UTILITY, 0);
     dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
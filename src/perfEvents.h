@@ -18,23 +18,48 @@
 #define _PERFEVENTS_H
 
 #include <signal.h>
+#include <pthread.h>
 #include "engine.h"
 
 
 class PerfEvent;
 class PerfEventType;
+struct SampleInfo;
 
 class PerfEvents : public Engine {
   private:
+    static PerfEvent* _events[];
     static int _max_events;
-    static PerfEvent* _events;
+    static volatile int _active_events;
+    static bool _budget_exceeded;
+    static volatile u64 _open_failures;
+    static volatile u64 _last_open_warning;
+    static volatile bool _scanning;
+    static pthread_t _scanner;
     static PerfEventType* _event_type;
     static long _interval;
     static Ring _ring;
-    static CStack _cstack;
+    static size_t _buffer_size;
+
+    static u64 _sample_type;
+
+    static PerfEvent* findEvent(int tid);
+    static PerfEvent* allocateEvent(int tid);
+
+    static void warnOpenFailed(int err);
 
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
 
+    static void scannerLoop();
+
+    static void* scannerEntry(void* unused) {
+        scannerLoop();
+        return NULL;
+    }
+
+    static bool readSampleInfo(int tid, SampleInfo* info);
+    static const char* dataSource(u64 address, u64 data_src, uintptr_t sp);
+
   public:
     Error check(Arguments& args);
     Error start(Arguments& args);
@@ -17,6 +17,7 @@
 #ifdef __linux__
 
 #include <jvmti.h>
+#include <vector>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -25,8 +26,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <linux/perf_event.h>
@@ -38,6 +41,7 @@
 #include "spinLock.h"
 #include "stackFrame.h"
 #include "symbols.h"
+#include "vmStructs.h"
 
 
 // Ancient fcntl.h does not define F_SETOWN_EX constants and structures
@@ -52,6 +56,55 @@ struct f_owner_ex {
 #endif // F_SETOWN_EX
 
 
+// How much of the user stack to copy for DWARF unwinding
+const u32 DWARF_STACK_SIZE = 8192;
+
+// Ring buffer should fit at least one sample with the user stack copy
+const int DWARF_RING_PAGES = 4;
+
+// Per-thread events live in a sparse table of pages allocated for the used tid ranges
+const int EVENTS_PER_PAGE = 1024;
+const int MAX_EVENT_PAGES = (1 << 22) / EVENTS_PER_PAGE;  // pid_max cannot exceed 2^22
+
+// How often to look for threads that need a perf_event
+const long SCAN_INTERVAL = 100000000;  // 100 ms
+
+// perf_event_open may fail for every thread on every scan: report it not more often than this
+const u64 OPEN_WARNING_INTERVAL = 10000000000ULL;  // 10 s
+
+// Loads faster than this number of cycles are not sampled by mem-loads event
+const u64 MEMLOADS_MIN_LATENCY = 30;
+
+// Loads within this distance from the stack pointer are considered stack accesses
+const uintptr_t MAX_STACK_DISTANCE = 8 * 1024 * 1024;
+const uintptr_t STACK_RED_ZONE = 128;
+
+#define MEMORY_LEVELS(region) { \
+    "[" region " L1]", "[" region " LFB]", "[" region " L2]", "[" region " L3]", "[" region " RAM]", \
+    "[" region " remote RAM]", "[" region " remote cache]", "[" region " I/O]", "[" region " uncached]", "[" region "]" }
+
+enum {
+    REGION_JAVA_HEAP,
+    REGION_STACK,
+    REGION_NATIVE
+};
+
+// Indexed by memory region and PERF_MEM_LVL_* bit; the last column is for an unknown level
+static const char* const DATA_SOURCES[][10] = {
+    MEMORY_LEVELS("java_heap"),
+    MEMORY_LEVELS("stack"),
+    MEMORY_LEVELS("native")
+};
+
+// Part of the sample record that does not belong to the stack trace
+struct SampleInfo {
+    u64 time;
+    u64 addr;
+    u64 weight;
+    u64 data_src;
+};
+
+
 enum {
     HW_BREAKPOINT_R  = 1,
     HW_BREAKPOINT_W  = 2,
@@ -161,7 +214,7 @@ struct PerfEventType {
     int counter_arg;
 
     enum {
-        IDX_PREDEFINED = 12,
+        IDX_PREDEFINED = 14,
         IDX_RAW,
         IDX_PMU,
         IDX_BREAKPOINT,
@@ -258,6 +311,36 @@ struct PerfEventType {
         return tracepoint;
     }
 
+    // Off-CPU samples are taken when a thread is switched out
+    static PerfEventType* getOffCpu(PerfEventType* offcpu) {
+        if (offcpu->config == 0) {
+            offcpu->config = findTracepointId("sched:sched_switch");
+        }
+        return offcpu->config > 0 ? offcpu : NULL;
+    }
+
+    // Precise sampling of memory loads is exposed by Intel PEBS as cpu/mem-loads/
+    // with a latency threshold in ldlat parameter
+    static PerfEventType* getMemLoads(PerfEventType* memloads) {
+        if (memloads->type == 0) {
+            PerfEventType* pmu = getPmuEvent("cpu/mem-loads/");
+            if (pmu == NULL) {
+                return NULL;
+            }
+
+            __u64 config[3] = {pmu->config, 0, pmu->config2};
+            if (!setPmuConfig("cpu", "ldlat", config, MEMLOADS_MIN_LATENCY)) {
+                config[1] = pmu->config1;
+            }
+
+            memloads->type = pmu->type;
+            memloads->config = config[0];
+            memloads->config1 = config[1];
+            memloads->config2 = config[2];
+        }
+        return memloads;
+    }
+
     static PerfEventType* getProbe(PerfEventType* probe, const char* type, const char* name, __u64 ret) {
         static char probe_func[256];
         strncpy(probe_func, name, sizeof(probe_func) - 1);
@@ -348,7 +431,13 @@ struct PerfEventType {
         // Look through the table of predefined perf events
         for (int i = 0; i < IDX_PREDEFINED; i++) {
             if (strcmp(name, AVAILABLE_EVENTS[i].name) == 0) {
-                return &AVAILABLE_EVENTS[i];
+                PerfEventType* event_type = &AVAILABLE_EVENTS[i];
+                if (event_type->name == EVENT_OFFCPU) {
+                    return getOffCpu(event_type);
+                } else if (event_type->name == EVENT_MEMLOADS) {
+                    return getMemLoads(event_type);
+                }
+                return event_type;
             }
         }
 
@@ -414,6 +503,7 @@ PerfEventType PerfEventType::AVAILABLE_EVENTS[] = {
     {"cpu",          DEFAULT_INTERVAL, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK},
     {"page-faults",                 1, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
     {"context-switches",            1, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {EVENT_OFFCPU,                  1, PERF_TYPE_TRACEPOINT, 0},
 
     {"cycles",                1000000, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
     {"instructions",          1000000, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
@@ -426,6 +516,7 @@ PerfEventType PerfEventType::AVAILABLE_EVENTS[] = {
     {"L1-dcache-load-misses", 1000000, PERF_TYPE_HW_CACHE, LOAD_MISS(PERF_COUNT_HW_CACHE_L1D)},
     {"LLC-load-misses",          1000, PERF_TYPE_HW_CACHE, LOAD_MISS(PERF_COUNT_HW_CACHE_LL)},
     {"dTLB-load-misses",         1000, PERF_TYPE_HW_CACHE, LOAD_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {EVENT_MEMLOADS,            10000, 0, 0},
 
     {"rNNN",                     1000, PERF_TYPE_RAW, 0}, /* IDX_RAW */
     {"pmu/event-descriptor/",    1000, PERF_TYPE_RAW, 0}, /* IDX_PMU */
@@ -455,26 +546,37 @@ class RingBuffer {
   private:
     const char* _start;
     unsigned long _offset;
+    unsigned long _mask;
 
   public:
-    RingBuffer(struct perf_event_mmap_page* page) {
+    RingBuffer(struct perf_event_mmap_page* page, size_t size) {
         _start = (const char*)page + OS::page_size;
+        _mask = size - 1;
     }
 
     struct perf_event_header* seek(u64 offset) {
-        _offset = (unsigned long)offset & OS::page_mask;
+        _offset = (unsigned long)offset & _mask;
         return (struct perf_event_header*)(_start + _offset);
     }
 
     u64 next() {
-        _offset = (_offset + sizeof(u64)) & OS::page_mask;
+        _offset = (_offset + sizeof(u64)) & _mask;
         return *(u64*)(_start + _offset);
     }
 
+    void skip(unsigned long words) {
+        _offset = (_offset + words * sizeof(u64)) & _mask;
+    }
+
     u64 peek(unsigned long words) {
-        unsigned long peek_offset = (_offset + words * sizeof(u64)) & OS::page_mask;
+        unsigned long peek_offset = (_offset + words * sizeof(u64)) & _mask;
         return *(u64*)(_start + peek_offset);
     }
+
+    // The user stack copy that follows the current word
+    StackImage stackImage(uintptr_t sp, u64 size) {
+        return StackImage(_start, _offset + sizeof(u64), _mask, sp, size);
+    }
 };
 
 
@@ -482,29 +584,116 @@ class PerfEvent : public SpinLock {
   private:
     int _fd;
     struct perf_event_mmap_page* _page;
+    u32 _seen;  // the last scan that found the thread in /proc/self/task
 
     friend class PerfEvents;
 };
 
 
+// Choose what goes into a sample record besides the callchain
+static void setSampleType(struct perf_event_attr* attr, PerfEventType* event_type, CStack cstack) {
+    attr->sample_type = PERF_SAMPLE_CALLCHAIN;
+
+#ifdef PERF_ATTR_SIZE_VER5
+    if (event_type->name == EVENT_OFFCPU) {
+        // Time of the switch is compared to OS::nanotime() when the thread gets back on CPU
+        attr->sample_type |= PERF_SAMPLE_TIME;
+        attr->use_clockid = 1;
+        attr->clockid = CLOCK_MONOTONIC;
+    } else if (event_type->name == EVENT_MEMLOADS) {
+        // Data address, load latency and memory hierarchy level require PEBS
+        attr->sample_type |= PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC;
+        attr->precise_ip = 2;
+    }
+
+    if (cstack == CSTACK_LBR) {
+        attr->sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
+        attr->branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
+        attr->sample_regs_user = 1ULL << PERF_REG_PC;
+        attr->exclude_callchain_user = 1;
+    } else if (cstack == CSTACK_DWARF) {
+        attr->sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+        attr->sample_regs_user = 1ULL << PERF_REG_PC | 1ULL << PERF_REG_SP | 1ULL << PERF_REG_FP;
+        attr->sample_stack_user = DWARF_STACK_SIZE;
+        attr->exclude_callchain_user = 1;
+    }
+#else
+#warning "Compiling without LBR, DWARF, off-CPU and memory sampling support. Kernel headers 4.1+ required"
+#endif
+}
+
+
+PerfEvent* PerfEvents::_events[MAX_EVENT_PAGES];
 int PerfEvents::_max_events = 0;
-PerfEvent* PerfEvents::_events = NULL;
+volatile int PerfEvents::_active_events = 0;
+bool PerfEvents::_budget_exceeded = false;
+volatile u64 PerfEvents::_open_failures = 0;
+volatile u64 PerfEvents::_last_open_warning = 0;
+volatile bool PerfEvents::_scanning = false;
+pthread_t PerfEvents::_scanner;
 PerfEventType* PerfEvents::_event_type = NULL;
 long PerfEvents::_interval;
 Ring PerfEvents::_ring;
-CStack PerfEvents::_cstack;
+size_t PerfEvents::_buffer_size;
+u64 PerfEvents::_sample_type;
 
-int PerfEvents::createForThread(int tid) {
-    if (tid >= _max_events) {
-        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_events);
-        return -1;
+// Async signal safe: returns NULL if the event has never been allocated for this tid
+PerfEvent* PerfEvents::findEvent(int tid) {
+    if ((u32)tid >= MAX_EVENT_PAGES * EVENTS_PER_PAGE) {
+        return NULL;
+    }
+    PerfEvent* page = _events[(u32)tid / EVENTS_PER_PAGE];
+    return page != NULL ? &page[(u32)tid % EVENTS_PER_PAGE] : NULL;
+}
+
+PerfEvent* PerfEvents::allocateEvent(int tid) {
+    if ((u32)tid >= MAX_EVENT_PAGES * EVENTS_PER_PAGE) {
+        Log::warn("tid[%d] exceeds the maximum possible pid_max", tid);
+        return NULL;
     }
 
+    PerfEvent** page_ptr = &_events[(u32)tid / EVENTS_PER_PAGE];
+    if (*page_ptr == NULL) {
+        PerfEvent* page = (PerfEvent*)calloc(EVENTS_PER_PAGE, sizeof(PerfEvent));
+        if (page == NULL) {
+            return NULL;
+        }
+        if (!__sync_bool_compare_and_swap(page_ptr, NULL, page)) {
+            free(page);
+        }
+    }
+    return &(*page_ptr)[(u32)tid % EVENTS_PER_PAGE];
+}
+
+// Perf events are created for all threads accepted by the thread filter.
+// Whether a thread is running at the moment does not matter: a mostly sleeping or bursty thread
+// still needs its event, especially for off-CPU profiling, where it is the sleep that is sampled
+static bool isProfiledThread(int tid) {
+    ThreadFilter* thread_filter = Profiler::_instance.threadFilter();
+    return !thread_filter->enabled() || thread_filter->accept(tid);
+}
+
+int PerfEvents::createForThread(int tid) {
     PerfEventType* event_type = _event_type;
     if (event_type == NULL) {
         return -1;
     }
 
+    PerfEvent* event = allocateEvent(tid);
+    if (event == NULL || event->_fd != 0) {
+        return -1;
+    }
+
+    // Each event costs a file descriptor and a few mmapped pages
+    if (__sync_fetch_and_add(&_active_events, 1) >= _max_events) {
+        __sync_fetch_and_sub(&_active_events, 1);
+        if (!_budget_exceeded) {
+            _budget_exceeded = true;
+            Log::warn("Too many threads: perf events are limited to %d. Raise 'ulimit -n' to profile more", _max_events);
+        }
+        return -1;
+    }
+
     struct perf_event_attr attr = {0};
     attr.size = sizeof(attr);
     attr.type = event_type->type;
@@ -523,48 +712,46 @@ int PerfEvents::createForThread(int tid) {
     }
 
     attr.sample_period = _interval;
-    attr.sample_type = PERF_SAMPLE_CALLCHAIN;
     attr.disabled = 1;
     attr.wakeup_events = 1;
 
-    if (_ring == RING_USER) {
+    if (event_type->name == EVENT_OFFCPU) {
+        // Context switch happens in the kernel: do not filter it out, just skip kernel frames
+        attr.exclude_callchain_kernel = _ring == RING_USER ? 1 : 0;
+    } else if (_ring == RING_USER) {
         attr.exclude_kernel = 1;
     } else if (_ring == RING_KERNEL) {
         attr.exclude_user = 1;
     }
 
-#ifdef PERF_ATTR_SIZE_VER5
-    if (_cstack == CSTACK_LBR) {
-        attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
-        attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
-        attr.sample_regs_user = 1ULL << PERF_REG_PC;
-        attr.exclude_callchain_user = 1;
-    }
-#else
-#warning "Compiling without LBR support. Kernel headers 4.1+ required"
-#endif
+    setSampleType(&attr, event_type, _cstack);
 
     int fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
     if (fd == -1) {
         int err = errno;
-        Log::warn("perf_event_open failed: %s", strerror(errno));
+        __sync_fetch_and_sub(&_active_events, 1);
+        if (err != ESRCH) {
+            // ESRCH is a normal race with an exiting thread
+            warnOpenFailed(err);
+        }
         return err;
     }
 
-    if (!__sync_bool_compare_and_swap(&_events[tid]._fd, 0, fd)) {
-        // Lost race. The event is created either from start() or from onThreadStart()
+    if (!__sync_bool_compare_and_swap(&event->_fd, 0, fd)) {
+        // Lost race. The event is created from start(), onThreadStart() or the scanner thread
+        __sync_fetch_and_sub(&_active_events, 1);
         close(fd);
         return -1;
     }
 
-    void* page = mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void* page = mmap(NULL, OS::page_size + _buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (page == MAP_FAILED) {
         Log::warn("perf_event mmap failed: %s", strerror(errno));
         page = NULL;
     }
 
-    _events[tid].reset();
-    _events[tid]._page = (struct perf_event_mmap_page*)page;
+    event->reset();
+    event->_page = (struct perf_event_mmap_page*)page;
 
     struct f_owner_ex ex;
     ex.type = F_OWNER_TID;
@@ -580,20 +767,35 @@ int PerfEvents::createForThread(int tid) {
     return 0;
 }
 
+void PerfEvents::warnOpenFailed(int err) {
+    u64 failures = atomicInc(_open_failures) + 1;
+    u64 now = OS::nanotime();
+    u64 last = _last_open_warning;
+    if ((last == 0 || now - last >= OPEN_WARNING_INTERVAL) && __sync_bool_compare_and_swap(&_last_open_warning, last, now)) {
+        __sync_fetch_and_sub(&_open_failures, failures);
+        if (failures > 1) {
+            Log::warn("perf_event_open failed: %s (%llu times)", strerror(err), failures);
+        } else {
+            Log::warn("perf_event_open failed: %s", strerror(err));
+        }
+    }
+}
+
 void PerfEvents::destroyForThread(int tid) {
-    if (tid >= _max_events) {
+    PerfEvent* event = findEvent(tid);
+    if (event == NULL) {
         return;
     }
 
-    PerfEvent* event = &_events[tid];
     int fd = event->_fd;
     if (fd != 0 && __sync_bool_compare_and_swap(&event->_fd, fd, 0)) {
         ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
         close(fd);
+        __sync_fetch_and_sub(&_active_events, 1);
     }
     if (event->_page != NULL) {
         event->lock();
-        munmap(event->_page, 2 * OS::page_size);
+        munmap(event->_page, OS::page_size + _buffer_size);
         event->_page = NULL;
         event->unlock();
     }
@@ -605,7 +807,41 @@ void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
         return;
     }
 
-    if (_enabled) {
+    if (_enabled && _event_type->name == EVENT_OFFCPU) {
+        // The signal is delivered when the thread is back on CPU after the context switch
+        int tid = OS::threadId();
+        SampleInfo info;
+        u64 now = OS::nanotime();
+        if (readSampleInfo(tid, &info) && info.time != 0 && now > info.time) {
+            ExecutionEvent event;
+            event._thread_state = THREAD_SLEEPING;
+            Profiler::_instance.recordSample(ucontext, (now - info.time) * _interval, 0, &event);
+        }
+        if (_cstack == CSTACK_NO) {
+            resetBuffer(tid);
+        }
+    } else if (_enabled && _event_type->name == EVENT_MEMLOADS) {
+        // Precise sample carries the data address, the load latency and where the data came from
+        int tid = OS::threadId();
+        SampleInfo info;
+        if (readSampleInfo(tid, &info)) {
+            MemoryAccessEvent event;
+            event._address = info.addr;
+            event._latency = info.weight;
+            event._data_source = dataSource(info.addr, info.data_src, StackFrame(ucontext).sp());
+            event._class_id = 0;
+
+            VMKlass* klass = CollectedHeap::findObjectKlass(info.addr);
+            if (klass != NULL) {
+                VMSymbol* name = klass->name();
+                event._class_id = Profiler::_instance.classMap()->lookup(name->body(), name->length());
+            }
+            Profiler::_instance.recordSample(ucontext, info.weight, BCI_DATA_SOURCE, &event);
+        }
+        if (_cstack == CSTACK_NO) {
+            resetBuffer(tid);
+        }
+    } else if (_enabled) {
         u64 counter;
         switch (_event_type->counter_arg) {
             case 1: counter = StackFrame(ucontext).arg0(); break;
@@ -631,6 +867,10 @@ void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
 const char* PerfEvents::title() {
     if (_event_type == NULL || _event_type->name == EVENT_CPU) {
         return "CPU profile";
+    } else if (_event_type->name == EVENT_OFFCPU) {
+        return "Off-CPU profile";
+    } else if (_event_type->name == EVENT_MEMLOADS) {
+        return "Memory loads";
     } else if (_event_type->type == PERF_TYPE_SOFTWARE || _event_type->type == PERF_TYPE_HARDWARE || _event_type->type == PERF_TYPE_HW_CACHE) {
         return _event_type->name;
     } else {
@@ -638,8 +878,50 @@ const char* PerfEvents::title() {
     }
 }
 
+const char* PerfEvents::dataSource(u64 address, u64 data_src, uintptr_t sp) {
+    int region;
+    if (CollectedHeap::contains(address)) {
+        region = REGION_JAVA_HEAP;
+    } else if (address - (sp - STACK_RED_ZONE) < MAX_STACK_DISTANCE) {
+        region = REGION_STACK;
+    } else {
+        region = REGION_NATIVE;
+    }
+
+    u64 lvl = data_src >> PERF_MEM_LVL_SHIFT;
+    int level;
+    if (lvl & PERF_MEM_LVL_L1) {
+        level = 0;
+    } else if (lvl & PERF_MEM_LVL_LFB) {
+        level = 1;
+    } else if (lvl & PERF_MEM_LVL_L2) {
+        level = 2;
+    } else if (lvl & PERF_MEM_LVL_L3) {
+        level = 3;
+    } else if (lvl & PERF_MEM_LVL_LOC_RAM) {
+        level = 4;
+    } else if (lvl & (PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2)) {
+        level = 5;
+    } else if (lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2)) {
+        level = 6;
+    } else if (lvl & PERF_MEM_LVL_IO) {
+        level = 7;
+    } else if (lvl & PERF_MEM_LVL_UNC) {
+        level = 8;
+    } else {
+        level = 9;
+    }
+
+    return DATA_SOURCES[region][level];
+}
+
 const char* PerfEvents::units() {
-    return _event_type == NULL || _event_type->name == EVENT_CPU ? "ns" : "total";
+    if (_event_type == NULL || _event_type->name == EVENT_CPU || _event_type->name == EVENT_OFFCPU) {
+        return "ns";
+    } else if (_event_type->name == EVENT_MEMLOADS) {
+        return "cycles";
+    }
+    return "total";
 }
 
 Error PerfEvents::check(Arguments& args) {
@@ -663,10 +945,11 @@ Error PerfEvents::check(Arguments& args) {
     attr.config2 = event_type->config2;
 
     attr.sample_period = event_type->default_interval;
-    attr.sample_type = PERF_SAMPLE_CALLCHAIN;
     attr.disabled = 1;
 
-    if (args._ring == RING_USER) {
+    if (event_type->name == EVENT_OFFCPU) {
+        attr.exclude_callchain_kernel = args._ring == RING_USER ? 1 : 0;
+    } else if (args._ring == RING_USER) {
         attr.exclude_kernel = 1;
     } else if (args._ring == RING_KERNEL) {
         attr.exclude_user = 1;
@@ -675,14 +958,7 @@ Error PerfEvents::check(Arguments& args) {
         attr.exclude_kernel = Symbols::haveKernelSymbols() ? 0 : 1;
     }
 
-#ifdef PERF_ATTR_SIZE_VER5
-    if (args._cstack == CSTACK_LBR) {
-        attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
-        attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
-        attr.sample_regs_user = 1ULL << PERF_REG_PC;
-        attr.exclude_callchain_user = 1;
-    }
-#endif
+    setSampleType(&attr, event_type, args._cstack);
 
     int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
     if (fd == -1) {
@@ -713,31 +989,51 @@ Error PerfEvents::start(Arguments& args) {
                   "  sysctl kernel.perf_event_paranoid=1");
         _ring = RING_USER;
     }
-    _cstack = args._cstack;
+    _buffer_size = (_cstack == CSTACK_DWARF ? DWARF_RING_PAGES : 1) * OS::page_size;
 
-    int max_events = OS::getMaxThreadId();
-    if (max_events != _max_events) {
-        free(_events);
-        _events = (PerfEvent*)calloc(max_events, sizeof(PerfEvent));
-        _max_events = max_events;
+    struct perf_event_attr attr = {0};
+    setSampleType(&attr, _event_type, _cstack);
+    _sample_type = attr.sample_type;
+
+    // Leave at least a half of file descriptors to the application
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY) {
+        _max_events = rlim.rlim_cur / 2;
+    } else {
+        _max_events = OS::getMaxThreadId();
     }
+    _budget_exceeded = false;
+    _open_failures = 0;
+    _last_open_warning = 0;
 
     OS::installSignalHandler(SIGPROF, signalHandler);
 
     // Enable thread events before traversing currently running threads
     Profiler::_instance.switchThreadEvents(JVMTI_ENABLE);
 
-    // Create perf_events for all existing threads
-    int err;
+    // Create perf_events for the threads that are profiled right now; the scanner thread
+    // picks up threads started without JVM TI events or accepted by the filter later
+    int err = 0;
     bool created = false;
     ThreadList* thread_list = OS::listThreads();
     for (int tid; (tid = thread_list->next()) != -1; ) {
-        if ((err = createForThread(tid)) == 0) {
+        if (isProfiledThread(tid) && (err = createForThread(tid)) == 0) {
             created = true;
         }
     }
     delete thread_list;
 
+    if (!created && err == 0) {
+        // No eligible threads yet: make sure perf events are available at all
+        int self = OS::threadId();
+        if ((err = createForThread(self)) == 0) {
+            created = true;
+            if (!isProfiledThread(self)) {
+                destroyForThread(self);
+            }
+        }
+    }
+
     if (!created) {
         Profiler::_instance.switchThreadEvents(JVMTI_DISABLE);
         if (err == EACCES || err == EPERM) {
@@ -746,19 +1042,129 @@ Error PerfEvents::start(Arguments& args) {
             return Error("Perf events unavailable");
         }
     }
+
+    _scanning = true;
+    if (pthread_create(&_scanner, NULL, scannerEntry, NULL) != 0) {
+        Log::warn("Unable to create perf_events scanner thread");
+        _scanning = false;
+    }
+
     return Error::OK;
 }
 
 void PerfEvents::stop() {
-    for (int i = 0; i < _max_events; i++) {
-        destroyForThread(i);
+    if (_scanning) {
+        _scanning = false;
+        // Interrupt sleep; SIGPROF from tgkill is ignored by the signal handler
+        pthread_kill(_scanner, SIGPROF);
+        pthread_join(_scanner, NULL);
+    }
+
+    for (int i = 0; i < MAX_EVENT_PAGES; i++) {
+        if (_events[i] != NULL) {
+            for (int j = 0; j < EVENTS_PER_PAGE; j++) {
+                destroyForThread(i * EVENTS_PER_PAGE + j);
+            }
+        }
+    }
+}
+
+static bool threadExists(int tid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d", tid);
+    return access(path, F_OK) == 0;
+}
+
+void PerfEvents::scannerLoop() {
+    int self = OS::threadId();
+    ThreadFilter* thread_filter = Profiler::_instance.threadFilter();
+    ThreadList* thread_list = OS::listThreads();
+    std::vector<struct pollfd> fds;
+    std::vector<int> fd_tids;
+    u32 scan = 0;
+
+    while (_scanning) {
+        struct timespec timeout = {0, SCAN_INTERVAL};
+        nanosleep(&timeout, NULL);
+
+        scan++;
+        fds.clear();
+        fd_tids.clear();
+
+        bool thread_filter_enabled = thread_filter->enabled();
+        thread_list->rewind();
+        for (int tid; _scanning && (tid = thread_list->next()) != -1; ) {
+            PerfEvent* event = findEvent(tid);
+            if (event != NULL) {
+                event->_seen = scan;
+            }
+            if (tid == self) {
+                continue;
+            }
+
+            bool active = event != NULL && event->_fd != 0;
+            if (thread_filter_enabled) {
+                // Follow the changes of the thread filter
+                bool accepted = thread_filter->accept(tid);
+                if (accepted && !active) {
+                    createForThread(tid);
+                } else if (!accepted && active) {
+                    destroyForThread(tid);
+                }
+            } else if (!active) {
+                // Native threads, or threads that did not fit into the budget before
+                createForThread(tid);
+            }
+
+            if (event != NULL && event->_fd != 0) {
+                struct pollfd pfd = {event->_fd, 0, 0};
+                fds.push_back(pfd);
+                fd_tids.push_back(tid);
+            }
+        }
+
+        if (!_scanning) {
+            break;
+        }
+
+        // A tid may be reused by a new thread before the event of the exited one is closed.
+        // Such event stays bound to the exited task, which perf reports with POLLHUP
+        if (!fds.empty() && poll(&fds[0], fds.size(), 0) > 0) {
+            for (size_t i = 0; i < fds.size(); i++) {
+                int tid = fd_tids[i];
+                if ((fds[i].revents & POLLHUP) && findEvent(tid)->_fd == fds[i].fd) {
+                    destroyForThread(tid);
+                    if (isProfiledThread(tid)) {
+                        createForThread(tid);
+                    }
+                }
+            }
+        }
+
+        // Close events of the threads that are no longer in /proc/self/task,
+        // e.g. native threads, or threads whose event was recreated after onThreadEnd.
+        // A thread started after the listing is not seen yet, but still exists
+        for (int i = 0; i < MAX_EVENT_PAGES; i++) {
+            PerfEvent* page = _events[i];
+            if (page == NULL) {
+                continue;
+            }
+            for (int j = 0; j < EVENTS_PER_PAGE; j++) {
+                int tid = i * EVENTS_PER_PAGE + j;
+                if (page[j]._fd != 0 && page[j]._seen != scan && !threadExists(tid)) {
+                    destroyForThread(tid);
+                }
+            }
+        }
     }
+
+    delete thread_list;
 }
 
 int PerfEvents::getNativeTrace(void* ucontext, int tid, const void** callchain, int max_depth,
                                CodeCache* java_methods, CodeCache* runtime_stubs) {
-    PerfEvent* event = &_events[tid];
-    if (!event->tryLock()) {
+    PerfEvent* event = findEvent(tid);
+    if (event == NULL || !event->tryLock()) {
         return 0;  // the event is being destroyed
     }
 
@@ -770,11 +1176,14 @@ int PerfEvents::getNativeTrace(void* ucontext, int tid, const void** callchain,
         u64 head = page->data_head;
         rmb();
 
-        RingBuffer ring(page);
+        RingBuffer ring(page, _buffer_size);
 
         while (tail < head) {
             struct perf_event_header* hdr = ring.seek(tail);
             if (hdr->type == PERF_RECORD_SAMPLE) {
+                if (_sample_type & PERF_SAMPLE_TIME) ring.next();
+                if (_sample_type & PERF_SAMPLE_ADDR) ring.next();
+
                 u64 nr = ring.next();
                 while (nr-- > 0) {
                     u64 ip = ring.next();
@@ -813,6 +1222,22 @@ int PerfEvents::getNativeTrace(void* ucontext, int tid, const void** callchain,
                         }
                         callchain[depth++] = from;
                     }
+                } else if (_cstack == CSTACK_DWARF) {
+                    if (ring.next() == PERF_SAMPLE_REGS_ABI_NONE) {
+                        goto stack_complete;
+                    }
+
+                    // Registers are stored in the order of their bits in sample_regs_user
+                    uintptr_t fp = ring.next();
+                    uintptr_t sp = ring.next();
+                    uintptr_t pc = ring.next();
+
+                    u64 stack_size = ring.next();
+                    u64 dyn_size = stack_size == 0 ? 0 : ring.peek(stack_size / sizeof(u64) + 1);
+                    StackImage stack = ring.stackImage(sp, dyn_size < stack_size ? dyn_size : stack_size);
+
+                    depth += walkDwarf(pc, sp, fp, stack, callchain + depth, max_depth - depth,
+                                       java_methods, runtime_stubs);
                 }
 
                 break;
@@ -828,9 +1253,64 @@ stack_complete:
     return depth;
 }
 
+// Fill in the fields of the first pending sample that are not a part of the stack trace
+bool PerfEvents::readSampleInfo(int tid, SampleInfo* info) {
+    PerfEvent* event = findEvent(tid);
+    if (event == NULL || !event->tryLock()) {
+        return false;  // the event is being destroyed
+    }
+
+    bool found = false;
+
+    struct perf_event_mmap_page* page = event->_page;
+    if (page != NULL) {
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page, _buffer_size);
+
+        while (tail < head) {
+            struct perf_event_header* hdr = ring.seek(tail);
+            if (hdr->type == PERF_RECORD_SAMPLE) {
+                info->time = _sample_type & PERF_SAMPLE_TIME ? ring.next() : 0;
+                info->addr = _sample_type & PERF_SAMPLE_ADDR ? ring.next() : 0;
+
+                if (_sample_type & (PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC)) {
+                    // These go after the stack trace
+                    ring.skip(ring.next());
+                    if (_sample_type & PERF_SAMPLE_BRANCH_STACK) {
+                        ring.skip(ring.next() * 3);
+                    }
+                    if (_sample_type & PERF_SAMPLE_REGS_USER) {
+                        if (ring.next() != PERF_SAMPLE_REGS_ABI_NONE) {
+                            ring.skip(_cstack == CSTACK_DWARF ? 3 : 1);
+                        }
+                    }
+                    if (_sample_type & PERF_SAMPLE_STACK_USER) {
+                        u64 stack_size = ring.next();
+                        if (stack_size != 0) {
+                            ring.skip(stack_size / sizeof(u64) + 1);
+                        }
+                    }
+                }
+
+                info->weight = _sample_type & PERF_SAMPLE_WEIGHT ? ring.next() : 0;
+                info->data_src = _sample_type & PERF_SAMPLE_DATA_SRC ? ring.next() : 0;
+                found = true;
+                break;
+            }
+            tail += hdr->size;
+        }
+    }
+
+    event->unlock();
+    return found;
+}
+
 void PerfEvents::resetBuffer(int tid) {
-    PerfEvent* event = &_events[tid];
-    if (!event->tryLock()) {
+    PerfEvent* event = findEvent(tid);
+    if (event == NULL || !event->tryLock()) {
         return;  // the event is being destroyed
     }
 
@@ -20,7 +20,6 @@
 
 
 int PerfEvents::_max_events;
-PerfEvent* PerfEvents::_events;
 PerfEventType* PerfEvents::_event_type;
 long PerfEvents::_interval;
 Ring PerfEvents::_ring;
@@ -26,7 +26,10 @@
 #include "profiler.h"
 #include "perfEvents.h"
 #include "allocTracer.h"
+#include "binaryProfile.h"
 #include "lockTracer.h"
+#include "mallocTracer.h"
+#include "nativeLockTracer.h"
 #include "wallClock.h"
 #include "instrument.h"
 #include "itimer.h"
@@ -34,9 +37,12 @@
 #include "flightRecorder.h"
 #include "frameName.h"
 #include "os.h"
+#include "proto.h"
+#include "safeAccess.h"
 #include "stackFrame.h"
 #include "symbols.h"
 #include "vmStructs.h"
+#include "writer.h"
 
 
 Profiler Profiler::_instance;
@@ -45,6 +51,8 @@ static Engine noop_engine;
 static PerfEvents perf_events;
 static AllocTracer alloc_tracer;
 static LockTracer lock_tracer;
+static MallocTracer malloc_tracer;
+static NativeLockTracer native_lock_tracer;
 static WallClock wall_clock;
 static ITimer itimer;
 static Instrument instrument;
@@ -117,7 +125,8 @@ void Profiler::onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     _thread_filter.remove(tid);
     updateThreadName(jvmti, jni, thread);
 
-    if (_engine == &perf_events) {
+    // With the thread filter, the scanner thread creates the event once the thread is accepted
+    if (_engine == &perf_events && !_thread_filter.enabled()) {
         PerfEvents::createForThread(tid);
     }
 }
@@ -154,6 +163,8 @@ const char* Profiler::asgctError(int code) {
             return "safepoint";
         case ticks_skipped:
             return "skipped";
+        case ticks_filtered:
+            return "filtered";
         default:
             // Should not happen
             return "unexpected_state";
@@ -169,6 +180,9 @@ inline u32 Profiler::getLockIndex(int tid) {
 
 void Profiler::updateSymbols(bool kernel_symbols) {
     Symbols::parseLibraries(_native_libs, _native_lib_count, MAX_NATIVE_LIBS, kernel_symbols);
+    // Libraries loaded while native memory or native lock profiling is active need hooks, too
+    MallocTracer::installHooks();
+    NativeLockTracer::installHooks();
 }
 
 void Profiler::mangle(const char* name, char* buf, size_t size) {
@@ -303,7 +317,8 @@ int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max
         return trace.num_frames;
     }
 
-    if ((trace.num_frames == ticks_unknown_Java || trace.num_frames == ticks_not_walkable_Java) && _safe_mode < MAX_RECOVERY) {
+    if ((trace.num_frames == ticks_unknown_Java || trace.num_frames == ticks_not_walkable_Java) &&
+        _safe_mode < MAX_RECOVERY && ucontext != NULL) {
         // If current Java stack is not walkable (e.g. the top frame is not fully constructed),
         // try to manually pop the top frame off, hoping that the previous frame is walkable.
         // This is a temporary workaround for AsyncGetCallTrace issues,
@@ -564,10 +579,12 @@ AddressType Profiler::getAddressType(instruction_t* pc) {
     return ADDR_UNKNOWN;
 }
 
-void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event* event) {
+u32 Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event* event) {
     atomicInc(_total_samples);
 
     int tid = OS::threadId();
+    bool execution_sample = event_type == 0 || event_type == BCI_DATA_SOURCE;
+
     u32 lock_index = getLockIndex(tid);
     if (!_locks[lock_index].tryLock() &&
         !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
@@ -576,36 +593,58 @@ void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event*
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
 
-        if (event_type == 0 && _engine == &perf_events) {
+        if (execution_sample && _engine == &perf_events) {
             // Need to reset PerfEvents ring buffer, even though we discard the collected trace
             PerfEvents::resetBuffer(tid);
         }
-        return;
+        return 0;
     }
 
     ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
     jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
 
     int num_frames = 0;
+    if (event_type == BCI_LOCK && ((LockEvent*)event)->_owner_tid != 0 && !_jfr.active()) {
+        // Blocked-on edge: the owner's stack and thread go above the contended lock class
+        LockEvent* lock_event = (LockEvent*)event;
+        num_frames = convertFrames(lock_event->_owner_frames, frames, lock_event->_owner_depth);
+        num_frames += makeEventFrame(frames + num_frames, BCI_THREAD_ID, lock_event->_owner_tid);
+    }
+
     if (!_jfr.active() && event_type <= BCI_ALLOC && event_type >= BCI_PARK && event->id()) {
-        num_frames = makeEventFrame(frames, event_type, event->id());
+        num_frames += makeEventFrame(frames + num_frames, event_type, event->id());
+    } else if (event_type == BCI_DATA_SOURCE) {
+        // The class of the loaded object is the leaf, so that --reverse aggregates latency by class
+        MemoryAccessEvent* access_event = (MemoryAccessEvent*)event;
+        if (access_event->_class_id != 0 && !_jfr.active()) {
+            num_frames = makeEventFrame(frames, BCI_DATA_CLASS, access_event->_class_id);
+        }
+        num_frames += makeEventFrame(frames + num_frames, event_type, (uintptr_t)access_event->_data_source);
+    } else if (event_type == BCI_NATIVE_LOCK) {
+        num_frames = makeEventFrame(frames, BCI_NATIVE_FRAME, (uintptr_t)((NativeLockEvent*)event)->_function);
     }
 
     // Use engine stack walker for execution samples, or basic stack walker for other events
-    if (event_type == 0 && _cstack != CSTACK_NO) {
+    if (execution_sample && _cstack != CSTACK_NO) {
+        num_frames += getNativeTrace(_engine, ucontext, frames + num_frames, tid);
+    } else if ((event_type == BCI_MALLOC || event_type == BCI_NATIVE_LOCK) && _cstack != CSTACK_NO) {
+        // Native callers are what native memory and lock profiling is about, so they are collected by default
         num_frames += getNativeTrace(_engine, ucontext, frames + num_frames, tid);
-    } else if (event_type != 0 && _cstack > CSTACK_NO) {
+    } else if (!execution_sample && _cstack > CSTACK_NO) {
         num_frames += getNativeTrace(&noop_engine, ucontext, frames + num_frames, tid);
     }
 
     int first_java_frame = num_frames;
-    if (event_type <= BCI_LOCK) {
+    if (execution_sample || event_type == BCI_MALLOC || event_type == BCI_NATIVE_LOCK) {
+        // Async events, or malloc and pthread locks that may be called in any thread state
+        num_frames += getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth);
+    } else if (event_type <= BCI_LOCK) {
         // Lock events and instrumentation events can safely call synchronous JVM TI stack walker.
         // Skip Instrument.recordSample() method
         int start_depth = event_type == BCI_INSTRUMENT ? 1 : 0;
         num_frames += getJavaTraceJvmti(jvmti_frames + num_frames, frames + num_frames, start_depth, _max_stack_depth);
-    } else if (event_type == 0 || VMStructs::_get_stack_trace == NULL) {
-        // Async events
+    } else if (VMStructs::_get_stack_trace == NULL) {
+        // Internal stack walker is not available
         num_frames += getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth);
     } else {
         // Events like object allocation happen at known places where it is safe to call JVM TI,
@@ -622,14 +661,27 @@ void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event*
     //     frames[first_java_frame].bci = 0;
     // }
 
+    if (_method_filter.enabled() && !_method_filter.accept(frames, num_frames)) {
+        atomicInc(_failures[-ticks_filtered]);
+        _locks[lock_index].unlock();
+        return 0;
+    }
+
     if (_add_thread_frame) {
         num_frames += makeEventFrame(frames + num_frames, BCI_THREAD_ID, tid);
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+    if (_crash_file.enabled()) {
+        // Before put(), which may truncate the frames in place
+        _crash_file.record(num_frames, frames, counter);
+    }
+
+    u32 call_trace_id = _call_trace_storage->put(num_frames, frames, counter);
+    _time_series.record(call_trace_id, counter);
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
 
     _locks[lock_index].unlock();
+    return call_trace_id;
 }
 
 void Profiler::writeLog(LogLevel level, const char* message) {
@@ -798,6 +850,37 @@ void Profiler::setupTrapHandler() {
     }
 }
 
+void Profiler::segvHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    StackFrame frame(ucontext);
+    uintptr_t length = SafeAccess::skipLoad(frame.pc());
+    if (length > 0) {
+        // Skip the faulting instruction, as if it has successfully loaded 0
+        frame.pc() += length;
+        frame.retval() = 0;
+        return;
+    }
+
+    SigAction orig_handler = signo == SIGBUS ? _instance._orig_busHandler : _instance._orig_segvHandler;
+    if (orig_handler != NULL) {
+        orig_handler(signo, siginfo, ucontext);
+    } else {
+        // Restore the default action: the faulting instruction will be executed again
+        OS::installSignalHandler(signo, NULL, SIG_DFL);
+    }
+}
+
+void Profiler::setupSegvHandler() {
+    SigAction prev_handler = OS::installSignalHandler(SIGSEGV, segvHandler);
+    if (prev_handler != segvHandler) {
+        _orig_segvHandler = prev_handler == (void*)SIG_DFL || prev_handler == (void*)SIG_IGN ? NULL : prev_handler;
+    }
+
+    prev_handler = OS::installSignalHandler(SIGBUS, segvHandler);
+    if (prev_handler != segvHandler) {
+        _orig_busHandler = prev_handler == (void*)SIG_DFL || prev_handler == (void*)SIG_IGN ? NULL : prev_handler;
+    }
+}
+
 void Profiler::setThreadInfo(int tid, const char* name, jlong java_thread_id) {
     MutexLocker ml(_thread_names_lock);
     _thread_names[tid] = name;
@@ -862,11 +945,11 @@ bool Profiler::excludeTrace(FrameName* fn, CallTrace* trace) {
     }
 
     for (int i = 0; i < trace->num_frames; i++) {
-        const char* frame_name = fn->name(trace->frames[i], true);
-        if (checkExclude && fn->exclude(frame_name)) {
+        int filter = fn->filter(trace->frames[i]);
+        if (filter & FILTER_EXCLUDED) {
             return true;
         }
-        if (checkInclude && fn->include(frame_name)) {
+        if (checkInclude && (filter & FILTER_INCLUDED)) {
             checkInclude = false;
             if (!checkExclude) break;
         }
@@ -875,6 +958,26 @@ bool Profiler::excludeTrace(FrameName* fn, CallTrace* trace) {
     return checkInclude;
 }
 
+// The generation detached by snapshot with reset, or the current one
+CallTraceStorage* Profiler::dumpedStorage() {
+    return _snapshot_storage != NULL ? _snapshot_storage : _call_trace_storage;
+}
+
+// Samples of the entire profile, or only of the time window selected by the slice option
+void Profiler::collectSamples(Arguments& args, std::map<u64, CallTraceSample>& map) {
+    if (args._slice >= 0 && _time_series.enabled()) {
+        std::map<u32, CallTrace*> traces;
+        dumpedStorage()->collectTraces(traces);
+        _time_series.collectSamples(args._slice, traces, map);
+    } else if (_engine == &malloc_tracer && MallocTracer::trackingLeaks()) {
+        std::map<u32, CallTrace*> traces;
+        dumpedStorage()->collectTraces(traces);
+        MallocTracer::collectLeaks(traces, map);
+    } else {
+        dumpedStorage()->collectSamples(map);
+    }
+}
+
 Engine* Profiler::selectEngine(const char* event_name) {
     if (event_name == NULL) {
         return &noop_engine;
@@ -884,6 +987,10 @@ Engine* Profiler::selectEngine(const char* event_name) {
         return &wall_clock;
     } else if (strcmp(event_name, EVENT_ITIMER) == 0) {
         return &itimer;
+    } else if (strcmp(event_name, EVENT_NATIVEMEM) == 0) {
+        return &malloc_tracer;
+    } else if (strcmp(event_name, EVENT_NATIVELOCK) == 0) {
+        return &native_lock_tracer;
     } else if (strchr(event_name, '.') != NULL && strchr(event_name, ':') == NULL) {
         return &instrument;
     } else {
@@ -946,7 +1053,7 @@ Error Profiler::start(Arguments& args, bool reset) {
         // Reset dicrionaries and bitmaps
         _class_map.clear();
         _thread_filter.clear();
-        _call_trace_storage.clear();
+        _call_trace_storage->clear();
 
         // Reset thread names and IDs
         MutexLocker ml(_thread_names_lock);
@@ -957,7 +1064,7 @@ Error Profiler::start(Arguments& args, bool reset) {
     // (Re-)allocate calltrace buffers
     if (_max_stack_depth != args._jstackdepth) {
         _max_stack_depth = args._jstackdepth;
-        size_t buffer_size = (_max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES) * sizeof(CallTraceBuffer);
+        size_t buffer_size = (_max_stack_depth + MAX_NATIVE_FRAMES + MAX_LOCK_OWNER_FRAMES + RESERVED_FRAMES) * sizeof(CallTraceBuffer);
 
         for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
             free(_calltrace_buffer[i]);
@@ -969,6 +1076,11 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    _storage_generations[0].setMemoryLimit(args._tracemem, &_storage_generations[1]);
+    _storage_generations[1].setMemoryLimit(args._tracemem, &_storage_generations[0]);
+    _storage_generations[0].setMemoryPolicy(args._memory_policy);
+    _storage_generations[1].setMemoryPolicy(args._memory_policy);
+
     updateSymbols(args._ring != RING_USER);
 
     _safe_mode = args._safe_mode;
@@ -980,24 +1092,43 @@ Error Profiler::start(Arguments& args, bool reset) {
     _add_thread_frame = args._threads && args._output != OUTPUT_JFR;
     _update_thread_names = args._threads || args._output == OUTPUT_JFR;
     _thread_filter.init(args._filter);
+    _method_filter.init(args);
 
     _engine = selectEngine(args._event);
     _cstack = args._cstack;
     if (_cstack == CSTACK_LBR && _engine != &perf_events) {
         return Error("Branch stack is supported only with PMU events");
     }
+    Engine::setCStack(_cstack);
 
     error = installTraps(args._begin, args._end);
     if (error) {
         return error;
     }
 
+    error = _time_series.start(args._window, args._history, reset);
+    if (error) {
+        uninstallTraps();
+        return error;
+    }
+
+    if (args._crashfile != NULL) {
+        error = _crash_file.open(args, reset, _engine->title(), _thread_names_lock, _thread_names);
+        if (error) {
+            _time_series.stop();
+            uninstallTraps();
+            return error;
+        }
+    }
+
     switchNativeMethodTraps(true);
 
     if (args._output == OUTPUT_JFR) {
         error = _jfr.start(args, reset);
         if (error) {
+            _time_series.stop();
             uninstallTraps();
+            _crash_file.close();
             switchNativeMethodTraps(false);
             return error;
         }
@@ -1035,10 +1166,12 @@ error2:
     _engine->stop();
 
 error1:
+    _time_series.stop();
     uninstallTraps();
     switchNativeMethodTraps(false);
     for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
     _jfr.stop();
+    _crash_file.close();
     for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].unlock();
     return error;
 }
@@ -1055,6 +1188,7 @@ Error Profiler::stop() {
     if (_event_mask & EM_ALLOC) alloc_tracer.stop();
 
     _engine->stop();
+    _time_series.stop();
 
     switchNativeMethodTraps(false);
     switchThreadEvents(JVMTI_DISABLE);
@@ -1064,6 +1198,7 @@ Error Profiler::stop() {
     // Acquire all spinlocks to avoid race with remaining signals
     for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
     _jfr.stop();
+    _crash_file.close();
     for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].unlock();
 
     _state = IDLE;
@@ -1101,11 +1236,73 @@ void Profiler::switchThreadEvents(jvmtiEventMode mode) {
     }
 }
 
+// Swap in an empty generation of call traces and time windows.
+// Holding all locks guarantees no signal handler is writing to the detached generation.
+void Profiler::resetSamples() {
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
+
+    _snapshot_storage = _call_trace_storage;
+    _call_trace_storage = _call_trace_storage == &_storage_generations[0] ? &_storage_generations[1] : &_storage_generations[0];
+    _time_series.clear();
+
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].unlock();
+}
+
+/*
+ * Dump profile while sampling continues. With reset option, the dumped samples
+ * are detached first, so the output is consistent, and the profile starts over.
+ */
+Error Profiler::snapshot(std::ostream& out, Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return Error("Profiler is not active");
+    } else if (args._output == OUTPUT_JFR) {
+        return Error("JFR recording cannot be dumped without stopping profiler");
+    } else if (args._reset && _jfr.active()) {
+        return Error("Profile cannot be reset while JFR recording is active");
+    } else if (args._reset && _engine == &malloc_tracer && MallocTracer::trackingLeaks()) {
+        return Error("Profile cannot be reset while tracking leaks");
+    }
+
+    updateJavaThreadNames();
+    updateNativeThreadNames();
+
+    if (args._output == OUTPUT_HEATMAP || args._slice >= 0) {
+        // Time windows refer to traces of the current generation; dump them in place
+        dump(out, args);
+        if (args._reset) {
+            resetSamples();
+            _snapshot_storage->clear();
+            _snapshot_storage = NULL;
+        }
+    } else if (args._reset) {
+        resetSamples();
+        dump(out, args);
+        _snapshot_storage->clear();
+        _snapshot_storage = NULL;
+    } else {
+        dump(out, args);
+    }
+
+    if (args._reset) {
+        _total_samples = 0;
+        memset(_failures, 0, sizeof(_failures));
+    }
+
+    return Error::OK;
+}
+
 void Profiler::dump(std::ostream& out, Arguments& args) {
     switch (args._output) {
         case OUTPUT_COLLAPSED:
             dumpCollapsed(out, args);
             break;
+        case OUTPUT_BINARY:
+            dumpBinary(out, args);
+            break;
+        case OUTPUT_PPROF:
+            dumpPprof(out, args);
+            break;
         case OUTPUT_FLAMEGRAPH:
             dumpFlameGraph(out, args, false);
             break;
@@ -1115,6 +1312,9 @@ void Profiler::dump(std::ostream& out, Arguments& args) {
         case OUTPUT_TEXT:
             dumpText(out, args);
             break;
+        case OUTPUT_HEATMAP:
+            dumpHeatmap(out, args);
+            break;
         default:
             break;
     }
@@ -1127,28 +1327,312 @@ void Profiler::dump(std::ostream& out, Arguments& args) {
  */
 void Profiler::dumpCollapsed(std::ostream& out, Arguments& args) {
     MutexLocker ml(_state_lock);
-    if (_state != IDLE || _engine == NULL) return;
+    if (_state == TERMINATED || _engine == NULL) return;
 
     FrameName fn(args, args._style, _thread_names_lock, _thread_names);
 
-    std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    Writer writer(out);
+    if (args._gzip) {
+        Error error = writer.gzip();
+        if (error) {
+            Log::warn("%s, writing uncompressed output", error.message());
+        }
+    }
 
-    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-        CallTrace* trace = (*it)->trace;
+    std::map<u64, CallTraceSample> samples;
+    collectSamples(args, samples);
+
+    for (std::map<u64, CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        CallTrace* trace = it->second.trace;
         if (excludeTrace(&fn, trace)) continue;
 
         for (int j = trace->num_frames - 1; j >= 0; j--) {
             const char* frame_name = fn.name(trace->frames[j]);
-            out << frame_name << (j == 0 ? ' ' : ';');
+            writer.write(frame_name, strlen(frame_name));
+            writer.write(j == 0 ? ' ' : ';');
+        }
+        writer.write(args._counter == COUNTER_SAMPLES ? it->second.samples : it->second.counter);
+        writer.write('\n');
+    }
+
+    writer.close();
+}
+
+static u32 binaryFrameType(const ASGCT_CallFrame& frame) {
+    switch (frame.bci) {
+        case BCI_NATIVE_FRAME:
+            return BINARY_FRAME_NATIVE;
+        case BCI_ALLOC:
+        case BCI_ALLOC_OUTSIDE_TLAB:
+        case BCI_LOCK:
+        case BCI_PARK:
+        case BCI_DATA_CLASS:
+            return BINARY_FRAME_CLASS;
+        case BCI_THREAD_ID:
+            return BINARY_FRAME_THREAD;
+        case BCI_ERROR:
+        case BCI_DATA_SOURCE:
+            return BINARY_FRAME_SYNTHETIC;
+        default:
+            return frame.method_id == NULL ? BINARY_FRAME_SYNTHETIC : BINARY_FRAME_JAVA;
+    }
+}
+
+static u32 stringIndex(std::vector<std::string>& strings, std::map<std::string, u32>& index, const char* s) {
+    std::map<std::string, u32>::iterator it = index.lower_bound(s);
+    if (it != index.end() && it->first == s) {
+        return it->second;
+    }
+    u32 id = strings.size();
+    strings.push_back(s);
+    index.insert(it, std::map<std::string, u32>::value_type(s, id));
+    return id;
+}
+
+/*
+ * Dump call stacks as a trie in the binary format described in binaryProfile.h
+ */
+void Profiler::dumpBinary(std::ostream& out, Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state == TERMINATED || _engine == NULL) return;
+
+    FrameName fn(args, args._style, _thread_names_lock, _thread_names);
+
+    std::vector<std::string> strings;
+    std::map<std::string, u32> string_index;
+    u32 title = stringIndex(strings, string_index, activeEngine()->title());
+
+    std::vector<BinaryFrame> frames;
+    IdMap frame_ids;
+
+    std::vector<BinaryStack> stacks(1);
+    IdMap stack_ids;
+    u64 total_samples = 0;
+    u64 total_counter = 0;
+
+    std::map<u64, CallTraceSample> samples;
+    collectSamples(args, samples);
+
+    for (std::map<u64, CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        CallTrace* trace = it->second.trace;
+        if (excludeTrace(&fn, trace)) continue;
+
+        u32 stack = 0;
+        for (int j = trace->num_frames - 1; j >= 0; j--) {
+            u64 key = FrameName::frameKey(trace->frames[j], args._style);
+            u32 frame = frame_ids.get(key);
+            if (frame == 0) {
+                // Frame ids are shifted by 1, since IdMap does not store zero values
+                BinaryFrame f;
+                f.name = stringIndex(strings, string_index, fn.name(trace->frames[j]));
+                f.type = binaryFrameType(trace->frames[j]);
+                frames.push_back(f);
+                frame_ids.put(key, frame = frames.size());
+            }
+
+            u64 stack_key = (u64)stack << 32 | (frame - 1);
+            u32 child = stack_ids.get(stack_key);
+            if (child == 0) {
+                BinaryStack s = {stack, frame - 1, 0, 0};
+                child = stacks.size();
+                stacks.push_back(s);
+                stack_ids.put(stack_key, child);
+            }
+            stack = child;
+        }
+
+        stacks[stack].samples += it->second.samples;
+        stacks[stack].counter += it->second.counter;
+        total_samples += it->second.samples;
+        total_counter += it->second.counter;
+    }
+
+    std::vector<u32> string_offsets(strings.size() + 1);
+    for (size_t i = 0; i < strings.size(); i++) {
+        string_offsets[i + 1] = string_offsets[i] + strings[i].length() + 1;
+    }
+
+    BinaryProfileHeader header;
+    memcpy(header.magic, BINARY_PROFILE_MAGIC, sizeof(header.magic));
+    header.version = BINARY_PROFILE_VERSION;
+    header.header_size = sizeof(header);
+    header.string_count = strings.size();
+    header.frame_count = frames.size();
+    header.stack_count = stacks.size();
+    header.title = title;
+    header.string_offsets = sizeof(header);
+    header.string_data = (header.string_offsets + string_offsets.size() * sizeof(u32) + 7) & ~7ULL;
+    header.frames = (header.string_data + string_offsets.back() + 7) & ~7ULL;
+    header.stacks = header.frames + frames.size() * sizeof(BinaryFrame);
+    header.total_samples = total_samples;
+    header.total_counter = total_counter;
+
+    static const char padding[8] = {0};
+
+    Writer writer(out);
+    writer.write((const char*)&header, sizeof(header));
+    writer.write((const char*)&string_offsets[0], string_offsets.size() * sizeof(u32));
+    writer.write(padding, header.string_data - header.string_offsets - string_offsets.size() * sizeof(u32));
+    for (size_t i = 0; i < strings.size(); i++) {
+        writer.write(strings[i].c_str(), strings[i].length() + 1);
+    }
+    writer.write(padding, header.frames - header.string_data - string_offsets.back());
+    if (!frames.empty()) {
+        writer.write((const char*)&frames[0], frames.size() * sizeof(BinaryFrame));
+    }
+    writer.write((const char*)&stacks[0], stacks.size() * sizeof(BinaryStack));
+    writer.close();
+}
+
+// Field numbers of perftools.profiles.Profile and its nested messages
+enum PprofField {
+    PROFILE_SAMPLE_TYPE    = 1,
+    PROFILE_SAMPLE         = 2,
+    PROFILE_LOCATION       = 4,
+    PROFILE_FUNCTION       = 5,
+    PROFILE_STRING_TABLE   = 6,
+    PROFILE_TIME_NANOS     = 9,
+    PROFILE_DURATION_NANOS = 10,
+    VALUE_TYPE_TYPE        = 1,
+    VALUE_TYPE_UNIT        = 2,
+    SAMPLE_LOCATION_ID     = 1,
+    SAMPLE_VALUE           = 2,
+    LOCATION_ID            = 1,
+    LOCATION_LINE          = 4,
+    LINE_FUNCTION_ID       = 1,
+    LINE_LINE              = 2,
+    FUNCTION_ID            = 1,
+    FUNCTION_NAME          = 2,
+    FUNCTION_SYSTEM_NAME   = 3
+};
+
+// Strings of a pprof profile are referenced by index in the string table.
+// New strings are written out immediately, since repeated fields keep their order anyway.
+class PprofStrings {
+  private:
+    Writer& _writer;
+    Proto _record;
+    std::map<std::string, u32> _index;
+
+  public:
+    PprofStrings(Writer& writer) : _writer(writer), _record(), _index() {
+        add("");
+    }
+
+    u32 add(const char* s) {
+        std::map<std::string, u32>::iterator it = _index.lower_bound(s);
+        if (it != _index.end() && it->first == s) {
+            return it->second;
+        }
+
+        u32 id = _index.size();
+        _index.insert(it, std::map<std::string, u32>::value_type(s, id));
+
+        _record.reset();
+        _record.field(PROFILE_STRING_TABLE, s, strlen(s));
+        _writer.write(_record.buffer(), _record.size());
+        return id;
+    }
+};
+
+/*
+ * Dump profile in pprof format: gzipped perftools.profiles.Profile protobuf
+ */
+void Profiler::dumpPprof(std::ostream& out, Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state == TERMINATED || _engine == NULL) return;
+
+    // pprof has a separate field for line numbers, so they are not appended to function names
+    FrameName fn(args, args._style & ~STYLE_LINES, _thread_names_lock, _thread_names);
+
+    Writer writer(out);
+    Error error = writer.gzip();
+    if (error) {
+        // pprof understands uncompressed profiles as well
+        Log::warn("%s, writing uncompressed output", error.message());
+    }
+
+    PprofStrings strings(writer);
+    Proto record(4096);
+    Proto message(1024);
+    Proto values(64);
+
+    Engine* active_engine = activeEngine();
+    const char* units = active_engine->units();
+    if (strcmp(units, "ns") == 0) {
+        units = "nanoseconds";
+    }
+
+    message.field(VALUE_TYPE_TYPE, strings.add("samples")).field(VALUE_TYPE_UNIT, strings.add("count"));
+    record.field(PROFILE_SAMPLE_TYPE, message);
+    message.reset();
+    message.field(VALUE_TYPE_TYPE, strings.add(active_engine->title())).field(VALUE_TYPE_UNIT, strings.add(units));
+    record.field(PROFILE_SAMPLE_TYPE, message);
+    record.field(PROFILE_TIME_NANOS, (u64)_start_time * 1000000000);
+    record.field(PROFILE_DURATION_NANOS, (u64)uptime() * 1000000000);
+    writer.write(record.buffer(), record.size());
+
+    // Locations are unique (method_id, frame type) pairs, functions are unique names
+    IdMap locations;
+    u32 location_count = 0;
+    std::map<u32, u32> functions;
+
+    std::map<u64, CallTraceSample> samples;
+    collectSamples(args, samples);
+
+    for (std::map<u64, CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        CallTrace* trace = it->second.trace;
+        if (excludeTrace(&fn, trace)) continue;
+
+        // The first location is the leaf, which matches the order of frames in CallTrace
+        values.reset();
+        for (int j = 0; j < trace->num_frames; j++) {
+            u64 key = FrameName::frameKey(trace->frames[j], args._style);
+            u32 location = locations.get(key);
+            if (location == 0) {
+                u32 name = strings.add(fn.name(trace->frames[j]));
+                u32& function = functions[name];
+                record.reset();
+
+                if (function == 0) {
+                    function = functions.size();
+                    message.reset();
+                    message.field(FUNCTION_ID, function).field(FUNCTION_NAME, name).field(FUNCTION_SYSTEM_NAME, name);
+                    record.field(PROFILE_FUNCTION, message);
+                }
+
+                locations.put(key, location = ++location_count);
+                Proto line(16);
+                line.field(LINE_FUNCTION_ID, function);
+                if ((args._style & STYLE_LINES) && trace->frames[j].bci >= 0 && trace->frames[j].method_id != NULL) {
+                    line.field(LINE_LINE, fn.lineNumber(trace->frames[j].method_id, trace->frames[j].bci));
+                }
+                message.reset();
+                message.field(LOCATION_ID, location).field(LOCATION_LINE, line);
+                record.field(PROFILE_LOCATION, message);
+                writer.write(record.buffer(), record.size());
+            }
+            values.writeVarint(location);
         }
-        out << (args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter) << "\n";
+
+        message.reset();
+        message.field(SAMPLE_LOCATION_ID, values.buffer(), values.size());
+        values.reset();
+        values.writeVarint(it->second.samples);
+        values.writeVarint(it->second.counter);
+        message.field(SAMPLE_VALUE, values.buffer(), values.size());
+
+        record.reset();
+        record.field(PROFILE_SAMPLE, message);
+        writer.write(record.buffer(), record.size());
     }
+
+    writer.close();
 }
 
 void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
     MutexLocker ml(_state_lock);
-    if (_state != IDLE || _engine == NULL) return;
+    if (_state == TERMINATED || _engine == NULL) return;
 
     char title[64];
     if (args._title == NULL) {
@@ -1163,36 +1647,43 @@ void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
     FlameGraph flamegraph(args._title == NULL ? title : args._title, args._counter, args._minwidth, args._reverse);
     FrameName fn(args, args._style, _thread_names_lock, _thread_names);
 
-    std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    std::map<u64, CallTraceSample> samples;
+    collectSamples(args, samples);
 
-    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-        CallTrace* trace = (*it)->trace;
+    for (std::map<u64, CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        CallTrace* trace = it->second.trace;
         if (excludeTrace(&fn, trace)) continue;
 
-        u64 samples = (args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter);
+        u64 samples = (args._counter == COUNTER_SAMPLES ? it->second.samples : it->second.counter);
         int num_frames = trace->num_frames;
 
-        Trie* f = flamegraph.root();
+        u32 f = flamegraph.root();
         if (args._reverse) {
             if (_add_thread_frame) {
                 // Thread frames always come first
                 num_frames--;
-                const char* frame_name = fn.name(trace->frames[num_frames]);
-                f = f->addChild(frame_name, samples);
+                u32 name = flamegraph.nameId(fn.name(trace->frames[num_frames]));
+                f = flamegraph.addChild(f, name, samples);
             }
 
             for (int j = 0; j < num_frames; j++) {
-                const char* frame_name = fn.name(trace->frames[j]);
-                f = f->addChild(frame_name, samples);
+                u32 name = flamegraph.nameId(fn.name(trace->frames[j]));
+                f = flamegraph.addChild(f, name, samples);
             }
         } else {
             for (int j = num_frames - 1; j >= 0; j--) {
-                const char* frame_name = fn.name(trace->frames[j]);
-                f = f->addChild(frame_name, samples);
+                u32 name = flamegraph.nameId(fn.name(trace->frames[j]));
+                f = flamegraph.addChild(f, name, samples);
             }
         }
-        f->addLeaf(samples);
+        flamegraph.addLeaf(f, samples);
+    }
+
+    if (args._diff != NULL && !tree) {
+        Error error = flamegraph.loadBaseline(args._diff, _add_thread_frame);
+        if (error) {
+            Log::warn("%s: %s", error.message(), args._diff);
+        }
     }
 
     flamegraph.dump(out, tree);
@@ -1200,7 +1691,7 @@ void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
 
 void Profiler::dumpText(std::ostream& out, Arguments& args) {
     MutexLocker ml(_state_lock);
-    if (_state != IDLE || _engine == NULL) return;
+    if (_state == TERMINATED || _engine == NULL) return;
 
     FrameName fn(args, args._style | STYLE_DOTTED, _thread_names_lock, _thread_names);
     char buf[1024] = {0};
@@ -1209,7 +1700,7 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
     u64 total_counter = 0;
     {
         std::map<u64, CallTraceSample> map;
-        _call_trace_storage.collectSamples(map);
+        collectSamples(args, map);
         samples.reserve(map.size());
 
         for (std::map<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
@@ -1285,6 +1776,62 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
     }
 }
 
+/*
+ * Dump stacks in collapsed format with a separate counter for each time window,
+ * from the oldest to the current one:
+ *
+ * <frame>;<frame>;...;<topmost frame> <count1> <count2> ... <countN>
+ *
+ * The first line lists start times of the windows in milliseconds since the epoch.
+ */
+void Profiler::dumpHeatmap(std::ostream& out, Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state == TERMINATED || _engine == NULL) return;
+
+    if (!_time_series.enabled()) {
+        out << "Time windows are not recorded; start profiling with window=DURATION" << std::endl;
+        return;
+    }
+
+    FrameName fn(args, args._style, _thread_names_lock, _thread_names);
+
+    std::map<u32, CallTrace*> traces;
+    dumpedStorage()->collectTraces(traces);
+
+    std::vector<u64> start_millis;
+    std::vector<std::map<u64, CallTraceSample> > samples;
+    _time_series.collectAllSamples(traces, start_millis, samples);
+
+    int windows = (int)samples.size();
+    std::map<CallTrace*, std::vector<u64> > heatmap;
+
+    out << "#";
+    for (int i = 0; i < windows; i++) {
+        out << ' ' << start_millis[i];
+
+        for (std::map<u64, CallTraceSample>::const_iterator it = samples[i].begin(); it != samples[i].end(); ++it) {
+            std::vector<u64>& row = heatmap[it->second.trace];
+            row.resize(windows);
+            row[i] = args._counter == COUNTER_SAMPLES ? it->second.samples : it->second.counter;
+        }
+    }
+    out << "\n";
+
+    for (std::map<CallTrace*, std::vector<u64> >::const_iterator it = heatmap.begin(); it != heatmap.end(); ++it) {
+        CallTrace* trace = it->first;
+        if (excludeTrace(&fn, trace)) continue;
+
+        for (int j = trace->num_frames - 1; j >= 0; j--) {
+            const char* frame_name = fn.name(trace->frames[j]);
+            out << frame_name << (j == 0 ? ' ' : ';');
+        }
+        for (int i = 0; i < windows; i++) {
+            out << (i == 0 ? "" : " ") << it->second[i];
+        }
+        out << "\n";
+    }
+}
+
 Error Profiler::runInternal(Arguments& args, std::ostream& out) {
     switch (args._action) {
         case ACTION_START:
@@ -1328,6 +1875,8 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             out << "  " << EVENT_LOCK << std::endl;
             out << "  " << EVENT_WALL << std::endl;
             out << "  " << EVENT_ITIMER << std::endl;
+            out << "  " << EVENT_NATIVEMEM << std::endl;
+            out << "  " << EVENT_NATIVELOCK << std::endl;
 
             out << "Java method calls:" << std::endl;
             out << "  ClassName.methodName" << std::endl;
@@ -1354,6 +1903,8 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             stop();
             dump(out, args);
             break;
+        case ACTION_SNAPSHOT:
+            return snapshot(out, args);
         default:
             break;
     }
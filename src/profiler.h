@@ -24,14 +24,17 @@
 #include "arguments.h"
 #include "callTraceStorage.h"
 #include "codeCache.h"
+#include "crashFile.h"
 #include "dictionary.h"
 #include "engine.h"
 #include "event.h"
 #include "flightRecorder.h"
 #include "log.h"
+#include "methodFilter.h"
 #include "mutex.h"
 #include "spinLock.h"
 #include "threadFilter.h"
+#include "timeSeries.h"
 #include "trap.h"
 #include "vmEntry.h"
 
@@ -81,7 +84,13 @@ class Profiler {
     Dictionary _class_map;
     Dictionary _symbol_map;
     ThreadFilter _thread_filter;
-    CallTraceStorage _call_trace_storage;
+    MethodFilter _method_filter;
+    // Two generations of call traces: snapshot with reset swaps them
+    CallTraceStorage _storage_generations[2];
+    CallTraceStorage* _call_trace_storage;
+    CallTraceStorage* _snapshot_storage;
+    TimeSeries _time_series;
+    CrashFile _crash_file;
     FlightRecorder _jfr;
     Engine* _engine;
     int _event_mask;
@@ -122,6 +131,8 @@ class Profiler {
     void switchNativeMethodTraps(bool enable);
 
     void (*_orig_trapHandler)(int signo, siginfo_t* siginfo, void* ucontext);
+    void (*_orig_segvHandler)(int signo, siginfo_t* siginfo, void* ucontext);
+    void (*_orig_busHandler)(int signo, siginfo_t* siginfo, void* ucontext);
     Error installTraps(const char* begin, const char* end);
     void uninstallTraps();
 
@@ -148,6 +159,9 @@ class Profiler {
     void updateJavaThreadNames();
     void updateNativeThreadNames();
     bool excludeTrace(FrameName* fn, CallTrace* trace);
+    CallTraceStorage* dumpedStorage();
+    void collectSamples(Arguments& args, std::map<u64, CallTraceSample>& map);
+    void resetSamples();
     void mangle(const char* name, char* buf, size_t size);
     Engine* selectEngine(const char* event_name);
     Engine* activeEngine();
@@ -161,7 +175,12 @@ class Profiler {
         _begin_trap(2),
         _end_trap(3),
         _thread_filter(false),
-        _call_trace_storage(),
+        _method_filter(),
+        _storage_generations(),
+        _call_trace_storage(&_storage_generations[0]),
+        _snapshot_storage(NULL),
+        _time_series(),
+        _crash_file(),
         _jfr(),
         _start_time(0),
         _max_stack_depth(0),
@@ -184,6 +203,7 @@ class Profiler {
 
     Dictionary* classMap() { return &_class_map; }
     ThreadFilter* threadFilter() { return &_thread_filter; }
+    MethodFilter* methodFilter() { return &_method_filter; }
 
     Error run(Arguments& args);
     Error runInternal(Arguments& args, std::ostream& out);
@@ -193,10 +213,14 @@ class Profiler {
     Error stop();
     void switchThreadEvents(jvmtiEventMode mode);
     void dump(std::ostream& out, Arguments& args);
+    Error snapshot(std::ostream& out, Arguments& args);
     void dumpCollapsed(std::ostream& out, Arguments& args);
+    void dumpBinary(std::ostream& out, Arguments& args);
+    void dumpPprof(std::ostream& out, Arguments& args);
     void dumpFlameGraph(std::ostream& out, Arguments& args, bool tree);
     void dumpText(std::ostream& out, Arguments& args);
-    void recordSample(void* ucontext, u64 counter, jint event_type, Event* event);
+    void dumpHeatmap(std::ostream& out, Arguments& args);
+    u32 recordSample(void* ucontext, u64 counter, jint event_type, Event* event);
     void writeLog(LogLevel level, const char* message);
     void writeLog(LogLevel level, const char* message, size_t len);
 
@@ -209,6 +233,9 @@ class Profiler {
     void trapHandler(int signo, siginfo_t* siginfo, void* ucontext);
     void setupTrapHandler();
 
+    static void segvHandler(int signo, siginfo_t* siginfo, void* ucontext);
+    void setupSegvHandler();
+
     // CompiledMethodLoad is also needed to enable DebugNonSafepoints info by default
     static void JNICALL CompiledMethodLoad(jvmtiEnv* jvmti, jmethodID method,
                                            jint code_size, const void* code_addr,
@@ -236,6 +263,7 @@ class Profiler {
     }
 
     friend class Recording;
+    friend class ImportHooks;
 };
 
 #endif // _PROFILER_H
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PROTO_H
+#define _PROTO_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "arch.h"
+
+
+// Simplified Protobuf writer, capable of encoding varints, strings and embedded messages.
+// Counterpart of one.proto.Proto from the converter.
+class Proto {
+  private:
+    char* _buf;
+    size_t _capacity;
+    size_t _pos;
+
+    void ensureCapacity(size_t length) {
+        if (_pos + length > _capacity) {
+            _capacity = _pos + length > _capacity * 2 ? _pos + length : _capacity * 2;
+            _buf = (char*)realloc(_buf, _capacity);
+        }
+    }
+
+    void tag(int index, int type) {
+        writeVarint(index << 3 | type);
+    }
+
+    // Not copyable
+    Proto(const Proto&);
+    Proto& operator=(const Proto&);
+
+  public:
+    explicit Proto(size_t capacity = 256) : _capacity(capacity), _pos(0) {
+        _buf = (char*)malloc(capacity);
+    }
+
+    ~Proto() {
+        free(_buf);
+    }
+
+    const char* buffer() const {
+        return _buf;
+    }
+
+    size_t size() const {
+        return _pos;
+    }
+
+    void reset() {
+        _pos = 0;
+    }
+
+    Proto& field(int index, u64 n) {
+        tag(index, 0);
+        writeVarint(n);
+        return *this;
+    }
+
+    Proto& field(int index, const char* s, size_t length) {
+        tag(index, 2);
+        writeBytes(s, length);
+        return *this;
+    }
+
+    Proto& field(int index, const Proto& proto) {
+        tag(index, 2);
+        writeBytes(proto._buf, proto._pos);
+        return *this;
+    }
+
+    void writeVarint(u64 n) {
+        ensureCapacity(10);
+        while (n > 0x7f) {
+            _buf[_pos++] = (char)(0x80 | (n & 0x7f));
+            n >>= 7;
+        }
+        _buf[_pos++] = (char)n;
+    }
+
+    void writeBytes(const char* bytes, size_t length) {
+        writeVarint(length);
+        ensureCapacity(length);
+        memcpy(_buf + _pos, bytes, length);
+        _pos += length;
+    }
+};
+
+#endif // _PROTO_H
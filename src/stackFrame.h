@@ -55,7 +55,7 @@ class StackFrame {
     uintptr_t& sp();
     uintptr_t& fp();
 
-    uintptr_t retval();
+    uintptr_t& retval();
     uintptr_t arg0();
     uintptr_t arg1();
     uintptr_t arg2();
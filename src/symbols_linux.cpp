@@ -31,6 +31,7 @@
 #include <iostream>
 #include <string>
 #include "symbols.h"
+#include "dwarf.h"
 #include "arch.h"
 #include "log.h"
 
@@ -77,6 +78,7 @@ class MemoryMapDesc {
       }
 
       const char* file()    { return _file; }
+      bool isReadable()     { return _perm[0] == 'r'; }
       bool isExecutable()   { return _perm[0] == 'r' && _perm[2] == 'x'; }
       const char* addr()    { return (const char*)strtoul(_addr, NULL, 16); }
       const char* end()     { return (const char*)strtoul(_end, NULL, 16); }
@@ -89,6 +91,7 @@ class MemoryMapDesc {
 const unsigned char ELFCLASS_SUPPORTED = ELFCLASS64;
 typedef Elf64_Ehdr ElfHeader;
 typedef Elf64_Shdr ElfSection;
+typedef Elf64_Phdr ElfProgramHeader;
 typedef Elf64_Nhdr ElfNote;
 typedef Elf64_Sym  ElfSymbol;
 typedef Elf64_Rel  ElfRelocation;
@@ -97,6 +100,7 @@ typedef Elf64_Rel  ElfRelocation;
 const unsigned char ELFCLASS_SUPPORTED = ELFCLASS32;
 typedef Elf32_Ehdr ElfHeader;
 typedef Elf32_Shdr ElfSection;
+typedef Elf32_Phdr ElfProgramHeader;
 typedef Elf32_Nhdr ElfNote;
 typedef Elf32_Sym  ElfSymbol;
 typedef Elf32_Rel  ElfRelocation;
@@ -136,16 +140,20 @@ class ElfParser {
     }
 
     ElfSection* findSection(uint32_t type, const char* name);
+    ElfProgramHeader* findProgramHeader(uint32_t type);
 
     void loadSymbols(bool use_debug);
     bool loadSymbolsUsingBuildId();
     bool loadSymbolsUsingDebugLink();
     void loadSymbolTable(ElfSection* symtab);
     void addRelocationSymbols(ElfSection* reltab, const char* plt);
+    void addImports(ElfSection* reltab);
+    void parseDwarfInfo();
 
   public:
     static bool parseFile(NativeCodeCache* cc, const char* base, const char* file_name, bool use_debug);
     static void parseMem(NativeCodeCache* cc, const char* base);
+    static void parseProgramHeaders(NativeCodeCache* cc, const char* base);
 };
 
 
@@ -164,6 +172,19 @@ ElfSection* ElfParser::findSection(uint32_t type, const char* name) {
     return NULL;
 }
 
+ElfProgramHeader* ElfParser::findProgramHeader(uint32_t type) {
+    const char* pheaders = (const char*)_header + _header->e_phoff;
+
+    for (int i = 0; i < _header->e_phnum; i++) {
+        ElfProgramHeader* pheader = (ElfProgramHeader*)(pheaders + i * _header->e_phentsize);
+        if (pheader->p_type == type) {
+            return pheader;
+        }
+    }
+
+    return NULL;
+}
+
 bool ElfParser::parseFile(NativeCodeCache* cc, const char* base, const char* file_name, bool use_debug) {
     int fd = open(file_name, O_RDONLY);
     if (fd == -1) {
@@ -189,6 +210,27 @@ void ElfParser::parseMem(NativeCodeCache* cc, const char* base) {
     elf.loadSymbols(false);
 }
 
+// Program headers are parsed from the loaded image rather than from the file,
+// since .eh_frame_hdr encodes pointers relative to its runtime address
+void ElfParser::parseProgramHeaders(NativeCodeCache* cc, const char* base) {
+    ElfParser elf(cc, base, base);
+    if (elf.valid_header()) {
+        elf.parseDwarfInfo();
+    }
+}
+
+void ElfParser::parseDwarfInfo() {
+    if (!DWARF_SUPPORTED) return;
+
+    ElfProgramHeader* eh_frame_hdr = findProgramHeader(PT_GNU_EH_FRAME);
+    if (eh_frame_hdr != NULL) {
+        // Addresses in a non-PIE executable are absolute
+        const char* base = _header->e_type == ET_EXEC ? NULL : _base;
+        DwarfParser dwarf(_cc->name(), (const char*)_cc->minAddress(), base + eh_frame_hdr->p_vaddr);
+        _cc->setDwarfTable(dwarf.table(), dwarf.count());
+    }
+}
+
 void ElfParser::loadSymbols(bool use_debug) {
     if (!valid_header()) {
         return;
@@ -225,6 +267,18 @@ loaded:
         if (plt != NULL && reltab != NULL) {
             addRelocationSymbols(reltab, _base + plt->sh_offset + PLT_HEADER_SIZE);
         }
+
+        // Remember GOT entries of the functions that profiling engines may hook
+        if (reltab != NULL) {
+            addImports(reltab);
+        }
+        ElfSection* reldyn = findSection(SHT_RELA, ".rela.dyn");
+        if (reldyn == NULL) {
+            reldyn = findSection(SHT_REL, ".rel.dyn");
+        }
+        if (reldyn != NULL) {
+            addImports(reldyn);
+        }
     }
 }
 
@@ -338,6 +392,51 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
     }
 }
 
+void ElfParser::addImports(ElfSection* reltab) {
+    static const struct {
+        const char* name;
+        ImportId id;
+    } imports[] = {
+        {"malloc",  IMPORT_MALLOC},
+        {"calloc",  IMPORT_CALLOC},
+        {"realloc", IMPORT_REALLOC},
+        {"free",    IMPORT_FREE},
+        {"mmap",    IMPORT_MMAP},
+        {"mmap64",  IMPORT_MMAP},
+        {"munmap",  IMPORT_MUNMAP},
+        {"pthread_mutex_lock",    IMPORT_PTHREAD_MUTEX_LOCK},
+        {"pthread_rwlock_rdlock", IMPORT_PTHREAD_RWLOCK_RDLOCK},
+        {"pthread_rwlock_wrlock", IMPORT_PTHREAD_RWLOCK_WRLOCK}
+    };
+
+    ElfSection* symtab = section(reltab->sh_link);
+    const char* symbols = at(symtab);
+
+    ElfSection* strtab = section(symtab->sh_link);
+    const char* strings = at(strtab);
+
+    // Relocation offsets in a non-PIE executable are absolute
+    const char* base = _header->e_type == ET_EXEC ? NULL : _base;
+
+    const char* relocations = at(reltab);
+    const char* relocations_end = relocations + reltab->sh_size;
+    for (; relocations < relocations_end; relocations += reltab->sh_entsize) {
+        ElfRelocation* r = (ElfRelocation*)relocations;
+        ElfSymbol* sym = (ElfSymbol*)(symbols + ELF_R_SYM(r->r_info) * symtab->sh_entsize);
+        if (sym->st_name == 0 || sym->st_shndx != SHN_UNDEF) {
+            continue;
+        }
+
+        const char* sym_name = strings + sym->st_name;
+        for (size_t i = 0; i < sizeof(imports) / sizeof(imports[0]); i++) {
+            if (strcmp(sym_name, imports[i].name) == 0) {
+                _cc->addImport(imports[i].id, (void**)(base + r->r_offset));
+                break;
+            }
+        }
+    }
+}
+
 
 Mutex Symbols::_parse_lock;
 std::set<const void*> Symbols::_parsed_libraries;
@@ -380,8 +479,15 @@ void Symbols::parseLibraries(NativeCodeCache** array, volatile int& count, int s
     std::ifstream maps("/proc/self/maps");
     std::string str;
 
+    // Start of the last mapping with zero offset, where the ELF header of the next library is expected
+    const char* last_readable_base = NULL;
+
     while (count < size && std::getline(maps, str)) {
         MemoryMapDesc map(str.c_str());
+        if (map.offs() == 0) {
+            last_readable_base = map.isReadable() ? map.addr() : NULL;
+        }
+
         if (map.isExecutable() && map.file() != NULL && map.file()[0] != 0) {
             const char* image_base = map.addr();
             if (!_parsed_libraries.insert(image_base).second) {
@@ -389,13 +495,18 @@ void Symbols::parseLibraries(NativeCodeCache** array, volatile int& count, int s
             }
 
             NativeCodeCache* cc = new NativeCodeCache(map.file(), image_base, map.end());
+            const char* base = image_base - map.offs();
 
             if (map.inode() != 0) {
-                ElfParser::parseFile(cc, image_base - map.offs(), map.file(), true);
+                ElfParser::parseFile(cc, base, map.file(), true);
             } else if (strcmp(map.file(), "[vdso]") == 0) {
                 ElfParser::parseMem(cc, image_base);
             }
 
+            if (base == last_readable_base) {
+                ElfParser::parseProgramHeaders(cc, base);
+            }
+
             cc->sort();
             array[count] = cc;
             atomicInc(count);
@@ -0,0 +1,262 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include "timeSeries.h"
+
+
+static const u32 WINDOW_CAPACITY = 16384;
+static const long MIN_WINDOW_INTERVAL = 10000000;  // 10 ms
+
+
+struct WindowSample {
+    u32 call_trace_id;
+    u32 samples;
+    u64 counter;
+};
+
+// Open addressing hash table of a fixed capacity; unlike CallTraceStorage,
+// it does not grow, so samples of the traces that do not fit are dropped
+class TimeWindow {
+  private:
+    WindowSample _samples[WINDOW_CAPACITY];
+
+  public:
+    static TimeWindow* allocate() {
+        // Fresh anonymous memory is zeroed, and pages are committed only when touched
+        return (TimeWindow*)OS::safeAlloc(sizeof(TimeWindow));
+    }
+
+    void destroy() {
+        OS::safeFree(this, sizeof(TimeWindow));
+    }
+
+    void add(u32 call_trace_id, u64 counter) {
+        u32 slot = (call_trace_id * 0x9e3779b9) & (WINDOW_CAPACITY - 1);
+        u32 step = 0;
+
+        while (_samples[slot].call_trace_id != call_trace_id) {
+            if (_samples[slot].call_trace_id == 0) {
+                if (!__sync_bool_compare_and_swap(&_samples[slot].call_trace_id, 0, call_trace_id)) {
+                    continue;
+                }
+                break;
+            }
+            if (++step >= WINDOW_CAPACITY) {
+                return;
+            }
+            slot = (slot + step) & (WINDOW_CAPACITY - 1);
+        }
+
+        WindowSample& s = _samples[slot];
+        __sync_fetch_and_add(&s.samples, 1);
+        atomicInc(s.counter, counter);
+    }
+
+    void collect(std::map<u32, CallTrace*>& traces, std::map<u64, CallTraceSample>& map) {
+        for (u32 slot = 0; slot < WINDOW_CAPACITY; slot++) {
+            const WindowSample& s = _samples[slot];
+            if (s.call_trace_id == 0) {
+                continue;
+            }
+
+            std::map<u32, CallTrace*>::const_iterator it = traces.find(s.call_trace_id);
+            if (it != traces.end()) {
+                // The same trace may have different ids after CallTraceStorage has grown
+                CallTraceSample& sample = map[(u64)(uintptr_t)it->second];
+                sample.trace = it->second;
+                sample.samples += s.samples;
+                sample.counter += s.counter;
+            }
+        }
+    }
+};
+
+
+Error TimeSeries::start(long interval, int count, bool reset) {
+    if (interval == 0) {
+        // Time series are disabled for this profiling session
+        if (reset) {
+            _lock.lock();
+            release();
+            _lock.unlock();
+        }
+        return Error::OK;
+    } else if (interval < MIN_WINDOW_INTERVAL) {
+        return Error("Time window must be at least 10 ms");
+    } else if (count < 2 || count > MAX_TIME_WINDOWS) {
+        return Error("Number of time windows must be between 2 and 1024");
+    }
+
+    _lock.lock();
+
+    if (reset || interval != _interval || count != _count) {
+        release();
+
+        _interval = interval;
+        _count = count;
+        _current = 0;
+        _pending_ticks = 0;
+        for (int i = 0; i < count; i++) {
+            _windows[i] = NULL;
+        }
+
+        if ((_windows[0] = TimeWindow::allocate()) == NULL) {
+            _count = 0;
+            _lock.unlock();
+            return Error("Not enough memory for time windows");
+        }
+        _start_millis[0] = OS::millis();
+    }
+
+    _timer = OS::startTimer(interval, timerCallback, this);
+
+    _lock.unlock();
+    return _timer != NULL ? Error::OK : Error("Unable to start time window timer");
+}
+
+void TimeSeries::releaseRetired() {
+    if (_retired != NULL) {
+        _retired->destroy();
+        _retired = NULL;
+    }
+}
+
+void TimeSeries::release() {
+    releaseRetired();
+    int count = _count;
+    _count = 0;
+    for (int i = 0; i < count; i++) {
+        if (_windows[i] != NULL) {
+            _windows[i]->destroy();
+            _windows[i] = NULL;
+        }
+    }
+    _interval = 0;
+}
+
+// Start over with a single empty window; the caller ensures there are no concurrent writers
+void TimeSeries::clear() {
+    _lock.lock();
+    releaseRetired();
+    if (_count > 0) {
+        for (int i = 0; i < _count; i++) {
+            if (_windows[i] != NULL) {
+                _windows[i]->destroy();
+                _windows[i] = NULL;
+            }
+        }
+        _current = 0;
+        _pending_ticks = 0;
+        _windows[0] = TimeWindow::allocate();
+        _start_millis[0] = OS::millis();
+    }
+    _lock.unlock();
+}
+
+void TimeSeries::stop() {
+    _lock.lock();
+    if (_timer != NULL) {
+        OS::stopTimer(_timer);
+        _timer = NULL;
+    }
+    _lock.unlock();
+}
+
+void TimeSeries::rotate() {
+    atomicInc(_pending_ticks);
+    if (_lock.tryLock()) {
+        advance();
+        _lock.unlock();
+    }
+}
+
+// Moves to a new window for every timer tick since the last rotation. The caller holds the lock
+void TimeSeries::advance() {
+    int ticks = __sync_lock_test_and_set(&_pending_ticks, 0);
+    if (_timer == NULL || ticks == 0) {
+        return;
+    }
+
+    // More rotations would only replace the same windows again
+    if (ticks > _count) {
+        ticks = _count;
+    }
+
+    // Windows of the missed ticks are empty: their samples went to the current window
+    u64 now = OS::millis();
+    for (int i = ticks - 1; i >= 0; i--) {
+        // The oldest window is replaced with a fresh one before it becomes current.
+        // With only two windows, the oldest one was current a single period ago, and a signal handler
+        // that picked it up just before the previous rotation may still be writing to it.
+        // So the replaced window is retired and unmapped one rotation later. Within one catch-up,
+        // this is still safe as long as there are no more rotations than windows.
+        u64 next = _current + 1;
+        int slot = (int)(next % _count);
+        TimeWindow* window = TimeWindow::allocate();
+        if (window == NULL) {
+            break;
+        }
+        releaseRetired();
+        _retired = _windows[slot];
+        _windows[slot] = window;
+        _start_millis[slot] = now - i * (_interval / 1000000);
+        __sync_synchronize();
+        _current = next;
+    }
+}
+
+void TimeSeries::record(u32 call_trace_id, u64 counter) {
+    if (_timer != NULL) {
+        TimeWindow* window = _windows[_current % _count];
+        if (window != NULL) {
+            window->add(call_trace_id, counter);
+        }
+    }
+}
+
+// Holds the lock, so that the timer cannot replace the window being collected
+void TimeSeries::collectSamples(int age, std::map<u32, CallTrace*>& traces, std::map<u64, CallTraceSample>& map) {
+    _lock.lock();
+    if (age >= 0 && _count > 0 && age < windows()) {
+        TimeWindow* window = _windows[(_current - age) % _count];
+        if (window != NULL) {
+            window->collect(traces, map);
+        }
+    }
+    advance();
+    _lock.unlock();
+}
+
+// Holds the lock for all windows: otherwise a rotation in the middle would shift the ages,
+// and the same window could be dumped twice with a wrong start time
+void TimeSeries::collectAllSamples(std::map<u32, CallTrace*>& traces, std::vector<u64>& start_millis,
+                                   std::vector<std::map<u64, CallTraceSample> >& samples) {
+    _lock.lock();
+    int count = _count > 0 ? windows() : 0;
+    start_millis.resize(count);
+    samples.resize(count);
+    for (int age = count - 1; age >= 0; age--) {
+        int slot = (int)((_current - age) % _count);
+        start_millis[count - 1 - age] = _start_millis[slot];
+        if (_windows[slot] != NULL) {
+            _windows[slot]->collect(traces, samples[count - 1 - age]);
+        }
+    }
+    // Catch up with the ticks missed while the lock was held
+    advance();
+    _lock.unlock();
+}
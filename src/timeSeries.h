@@ -0,0 +1,85 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TIMESERIES_H
+#define _TIMESERIES_H
+
+#include <map>
+#include <vector>
+#include "arch.h"
+#include "arguments.h"
+#include "callTraceStorage.h"
+#include "os.h"
+#include "spinLock.h"
+
+
+const int MAX_TIME_WINDOWS = 1024;
+
+
+class TimeWindow;
+
+// Ring of fixed-length time windows, each counting samples per call trace id.
+// Recording is lock-free and signal-safe; a timer thread advances the ring.
+// Timer ticks that come while a dump holds the lock are not lost: the ring catches up later.
+class TimeSeries {
+  private:
+    TimeWindow* _windows[MAX_TIME_WINDOWS];
+    TimeWindow* _retired;
+    u64 _start_millis[MAX_TIME_WINDOWS];
+    volatile u64 _current;
+    volatile int _pending_ticks;
+    long _interval;
+    int _count;
+    SpinLock _lock;
+    Timer* _timer;
+
+    void release();
+    void releaseRetired();
+    void rotate();
+    void advance();
+
+    static void timerCallback(void* arg) {
+        ((TimeSeries*)arg)->rotate();
+    }
+
+  public:
+    TimeSeries() : _retired(NULL), _current(0), _pending_ticks(0), _interval(0), _count(0), _lock(), _timer(NULL) {
+    }
+
+    bool enabled() {
+        return _count > 0;
+    }
+
+    // Number of windows available for dumping, including the current one
+    int windows() {
+        return _current < (u64)_count ? (int)_current + 1 : _count;
+    }
+
+    Error start(long interval, int count, bool reset);
+    void stop();
+    void clear();
+
+    void record(u32 call_trace_id, u64 counter);
+
+    // Samples of the window that is `age` windows older than the current one
+    void collectSamples(int age, std::map<u32, CallTrace*>& traces, std::map<u64, CallTraceSample>& map);
+
+    // Start times and samples of all windows, oldest first, consistent with each other
+    void collectAllSamples(std::map<u32, CallTrace*>& traces, std::vector<u64>& start_millis,
+                           std::vector<std::map<u64, CallTraceSample> >& samples);
+};
+
+#endif // _TIMESERIES_H
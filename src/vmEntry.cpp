@@ -94,7 +94,8 @@ bool VM::init(JavaVM* vm, bool attach) {
     capabilities.can_get_line_numbers = 1;
     capabilities.can_generate_compiled_method_load_events = 1;
     capabilities.can_generate_monitor_events = 1;
-    capabilities.can_tag_objects = 1;
+    capabilities.can_get_current_contended_monitor = 1;
+    capabilities.can_get_monitor_info = 1;
     _jvmti->AddCapabilities(&capabilities);
 
     jvmtiEventCallbacks callbacks = {0};
@@ -147,6 +148,7 @@ void VM::ready() {
     }
 
     Profiler::_instance.setupTrapHandler();
+    Profiler::_instance.setupSegvHandler();
 
     _libjava = getLibraryHandle("libjava.so");
 
@@ -188,6 +190,10 @@ void VM::loadMethodIDs(jvmtiEnv* jvmti, JNIEnv* jni, jclass klass) {
     jint method_count;
     jmethodID* methods;
     if (jvmti->GetClassMethods(klass, &method_count, &methods) == 0) {
+        MethodFilter* filter = Profiler::_instance.methodFilter();
+        if (filter->enabled()) {
+            filter->addMethods(jvmti, klass, method_count, methods);
+        }
         jvmti->Deallocate((unsigned char*)methods);
     }
 }
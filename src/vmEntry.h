@@ -36,6 +36,10 @@ enum ASGCT_CallFrameType {
     BCI_THREAD_ID           = -15,  // method_id designates a thread
     BCI_ERROR               = -16,  // method_id is an error string
     BCI_INSTRUMENT          = -17,  // synthetic method_id that should not appear in the call stack
+    BCI_DATA_SOURCE         = -18,  // memory region and cache level of the sampled load (char*)
+    BCI_MALLOC              = -19,  // native memory allocation; used only as an event type
+    BCI_NATIVE_LOCK         = -20,  // contended pthread lock; used only as an event type
+    BCI_DATA_CLASS          = -21,  // class of the object that contains the sampled load address
 };
 
 // See hotspot/src/share/vm/prims/forte.cpp
@@ -52,7 +56,8 @@ enum ASGCT_Failure {
     ticks_deopt                 = -9,
     ticks_safepoint             = -10,
     ticks_skipped               = -11,
-    ASGCT_FAILURE_TYPES         = 12
+    ticks_filtered              = -12,  // not an AsyncGetCallTrace error: rejected by MethodFilter
+    ASGCT_FAILURE_TYPES         = 13
 };
 
 typedef struct {
@@ -117,6 +122,16 @@ class VM {
         return _vm->GetEnv((void**)&jni, JNI_VERSION_1_6) == 0 ? jni : NULL;
     }
 
+    static JNIEnv* attachThread(const char* name) {
+        JNIEnv* jni;
+        JavaVMAttachArgs attach_args = {JNI_VERSION_1_6, (char*)name, NULL};
+        return _vm->AttachCurrentThreadAsDaemon((void**)&jni, &attach_args) == 0 ? jni : NULL;
+    }
+
+    static void detachThread() {
+        _vm->DetachCurrentThread();
+    }
+
     static VMManagement* management() {
         return _getManagement != NULL ? _getManagement(0x20030000) : NULL;
     }
@@ -20,6 +20,11 @@
 #include <unistd.h>
 #include "vmStructs.h"
 #include "vmEntry.h"
+#include "safeAccess.h"
+
+
+// How far back from a sampled heap address to look for the header of the containing object
+const int MAX_OBJECT_SCAN_WORDS = 1024;
 
 
 NativeCodeCache* VMStructs::_libjvm = NULL;
@@ -28,8 +33,12 @@ bool VMStructs::_has_class_names = false;
 bool VMStructs::_has_class_loader_data = false;
 bool VMStructs::_has_thread_bridge = false;
 bool VMStructs::_has_perm_gen = false;
+bool VMStructs::_has_object_klass = false;
 
 int VMStructs::_klass_name_offset = -1;
+int VMStructs::_klass_layout_helper_offset = -1;
+int VMStructs::_oop_klass_offset = -1;
+int VMStructs::_oop_compressed_klass_offset = -1;
 int VMStructs::_symbol_length_offset = -1;
 int VMStructs::_symbol_length_and_refcount_offset = -1;
 int VMStructs::_symbol_body_offset = -1;
@@ -43,7 +52,13 @@ int VMStructs::_anchor_sp_offset = -1;
 int VMStructs::_anchor_pc_offset = -1;
 int VMStructs::_frame_size_offset = -1;
 int VMStructs::_is_gc_active_offset = -1;
+int VMStructs::_heap_reserved_offset = -1;
+int VMStructs::_region_start_offset = -1;
+int VMStructs::_region_size_offset = -1;
 char* VMStructs::_collected_heap_addr = NULL;
+bool* VMStructs::_compressed_class_pointers = NULL;
+uintptr_t* VMStructs::_narrow_klass_base_addr = NULL;
+int* VMStructs::_narrow_klass_shift_addr = NULL;
 
 jfieldID VMStructs::_eetop;
 jfieldID VMStructs::_tid;
@@ -102,6 +117,24 @@ void VMStructs::initOffsets() {
         if (strcmp(type, "Klass") == 0) {
             if (strcmp(field, "_name") == 0) {
                 _klass_name_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_layout_helper") == 0) {
+                _klass_layout_helper_offset = *(int*)(entry + offset_offset);
+            }
+        } else if (strcmp(type, "oopDesc") == 0) {
+            if (strcmp(field, "_metadata._klass") == 0) {
+                _oop_klass_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_metadata._compressed_klass") == 0) {
+                _oop_compressed_klass_offset = *(int*)(entry + offset_offset);
+            }
+        } else if (strcmp(type, "Universe") == 0 || strcmp(type, "CompressedKlassPointers") == 0) {
+            // JDK 8-14: Universe::_narrow_klass, JDK 15: CompressedKlassPointers::_narrow_klass,
+            // JDK 16+: CompressedKlassPointers::_base and _shift
+            if (strcmp(field, "_narrow_klass._base") == 0 || strcmp(field, "_base") == 0) {
+                _narrow_klass_base_addr = *(uintptr_t**)(entry + address_offset);
+            } else if (strcmp(field, "_narrow_klass._shift") == 0 || strcmp(field, "_shift") == 0) {
+                _narrow_klass_shift_addr = *(int**)(entry + address_offset);
+            } else if (strcmp(field, "_collectedHeap") == 0) {
+                _collected_heap_addr = **(char***)(entry + address_offset);
             }
         } else if (strcmp(type, "Symbol") == 0) {
             if (strcmp(field, "_length") == 0) {
@@ -144,13 +177,17 @@ void VMStructs::initOffsets() {
             if (strcmp(field, "_frame_size") == 0) {
                 _frame_size_offset = *(int*)(entry + offset_offset);
             }
-        } else if (strcmp(type, "Universe") == 0) {
-            if (strcmp(field, "_collectedHeap") == 0) {
-                _collected_heap_addr = **(char***)(entry + address_offset);
-            }
         } else if (strcmp(type, "CollectedHeap") == 0) {
             if (strcmp(field, "_is_gc_active") == 0) {
                 _is_gc_active_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_reserved") == 0) {
+                _heap_reserved_offset = *(int*)(entry + offset_offset);
+            }
+        } else if (strcmp(type, "MemRegion") == 0) {
+            if (strcmp(field, "_start") == 0) {
+                _region_start_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_word_size") == 0) {
+                _region_size_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "PermGen") == 0) {
             _has_perm_gen = true;
@@ -184,6 +221,15 @@ void VMStructs::initJvmFunctions() {
         _has_class_loader_data = _lock_func != NULL && _unlock_func != NULL;
     }
 
+    // The layout of an object header depends on UseCompressedClassPointers, which exists only on 64-bit JVMs
+    _compressed_class_pointers = (bool*)_libjvm->findSymbol("UseCompressedClassPointers");
+    if (_compressed_class_pointers != NULL && *_compressed_class_pointers) {
+        _has_object_klass = _oop_compressed_klass_offset >= 0 && _narrow_klass_base_addr != NULL && _narrow_klass_shift_addr != NULL;
+    } else {
+        _has_object_klass = _oop_klass_offset >= 0 && (_compressed_class_pointers != NULL || sizeof(uintptr_t) == 4);
+    }
+    _has_object_klass = _has_object_klass && _has_class_names && !_has_perm_gen && _klass_layout_helper_offset >= 0;
+
     if (VM::hotspot_version() > 0 && VM::hotspot_version() < 11) {
         _method_flushing = (char*)_libjvm->findSymbol("MethodFlushing");
         _sweep_started = (int*)_libjvm->findSymbol("_ZN14NMethodSweeper14_sweep_startedE");
@@ -240,6 +286,75 @@ VMThread* VMThread::current() {
     return (VMThread*)pthread_getspecific((pthread_key_t)_tls_index);
 }
 
+// Checks a presumed Symbol without risk of crashing. A class name is never empty,
+// so a word of the name reads as 0 only if its memory is not mapped.
+bool VMSymbol::isReadable() {
+    const char* length_addr = at(_symbol_length_offset >= 0 ? _symbol_length_offset : _symbol_length_and_refcount_offset);
+    if (SafeAccess::load((const uintptr_t*)length_addr) == 0 || length() == 0) {
+        return false;
+    }
+    uintptr_t first = (uintptr_t)body();
+    uintptr_t last = (first + length() - 1) & ~(sizeof(uintptr_t) - 1);
+    return SafeAccess::load((const uintptr_t*)first) != 0 && SafeAccess::load((const uintptr_t*)last) != 0;
+}
+
+// Finds the class of the Java object that contains the given heap address.
+// The heap cannot be walked from a signal handler, so the nearest preceding word
+// that looks like an object header is taken: its Klass must have a readable name,
+// and the object size computed from the Klass layout must cover the address.
+// All reads go through SafeAccess, since a candidate may be anything.
+// Returns NULL if nothing is found within MAX_OBJECT_SCAN_WORDS, e.g. deep inside a large array.
+VMKlass* CollectedHeap::findObjectKlass(uintptr_t address) {
+    if (!_has_object_klass || isGCActive() || !contains(address)) {
+        return NULL;
+    }
+
+    bool compressed = _compressed_class_pointers != NULL && *_compressed_class_pointers;
+    uintptr_t base = compressed ? *_narrow_klass_base_addr : 0;
+    int shift = compressed ? *_narrow_klass_shift_addr : 0;
+    int klass_offset = compressed ? _oop_compressed_klass_offset : _oop_klass_offset;
+    // arrayOopDesc::length follows the klass field
+    int length_offset = klass_offset + (compressed ? sizeof(u32) : sizeof(uintptr_t));
+
+    uintptr_t obj = address & ~(sizeof(uintptr_t) - 1);
+    for (int i = 0; i < MAX_OBJECT_SCAN_WORDS && contains(obj); i++, obj -= sizeof(uintptr_t)) {
+        // Forwarding pointers (marked with 0b11) exist only during GC
+        uintptr_t mark = SafeAccess::load((const uintptr_t*)obj);
+        if ((mark & 3) == 3) {
+            continue;
+        }
+
+        uintptr_t klass = SafeAccess::load((const uintptr_t*)(obj + klass_offset));
+        if (compressed) {
+            klass = (u32)klass == 0 ? 0 : base + ((uintptr_t)(u32)klass << shift);
+        }
+        if (klass == 0 || (klass & (sizeof(uintptr_t) - 1)) != 0) {
+            continue;
+        }
+
+        // Instance size in bytes, or array header size and log2 of the element size
+        int lh = (int)SafeAccess::load((const uintptr_t*)(klass + _klass_layout_helper_offset));
+        uintptr_t size;
+        if (lh > 0) {
+            size = lh & ~7;
+        } else if (lh < 0 && (lh & 0xff) <= 3) {
+            u32 length = (u32)SafeAccess::load((const uintptr_t*)(obj + length_offset));
+            size = ((lh >> 16) & 0xff) + ((uintptr_t)length << (lh & 0xff));
+        } else {
+            continue;
+        }
+
+        if (address - obj < size) {
+            VMSymbol* name = (VMSymbol*)SafeAccess::load((const uintptr_t*)(klass + _klass_name_offset));
+            if (name != NULL && name->isReadable()) {
+                return (VMKlass*)klass;
+            }
+        }
+    }
+
+    return NULL;
+}
+
 DisableSweeper::DisableSweeper() {
     // Workaround for JDK-8212160: Temporarily disable MethodFlushing
     // while generating initial set of CompiledMethodLoad events
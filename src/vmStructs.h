@@ -30,8 +30,12 @@ class VMStructs {
     static bool _has_class_loader_data;
     static bool _has_thread_bridge;
     static bool _has_perm_gen;
+    static bool _has_object_klass;
 
     static int _klass_name_offset;
+    static int _klass_layout_helper_offset;
+    static int _oop_klass_offset;
+    static int _oop_compressed_klass_offset;
     static int _symbol_length_offset;
     static int _symbol_length_and_refcount_offset;
     static int _symbol_body_offset;
@@ -45,7 +49,13 @@ class VMStructs {
     static int _anchor_pc_offset;
     static int _frame_size_offset;
     static int _is_gc_active_offset;
+    static int _heap_reserved_offset;
+    static int _region_start_offset;
+    static int _region_size_offset;
     static char* _collected_heap_addr;
+    static bool* _compressed_class_pointers;
+    static uintptr_t* _narrow_klass_base_addr;
+    static int* _narrow_klass_shift_addr;
 
     static jfieldID _eetop;
     static jfieldID _tid;
@@ -92,6 +102,10 @@ class VMStructs {
         return _has_thread_bridge;
     }
 
+    static bool hasObjectKlass() {
+        return _has_object_klass;
+    }
+
     typedef jvmtiError (*GetStackTraceFunc)(void* self, void* thread,
                                             jint start_depth, jint max_frame_count,
                                             jvmtiFrameInfo* frame_buffer, jint* count_ptr);
@@ -135,6 +149,8 @@ class VMSymbol : VMStructs {
     const char* body() {
         return at(_symbol_body_offset);
     }
+
+    bool isReadable();
 };
 
 class ClassLoaderData : VMStructs {
@@ -248,6 +264,19 @@ class CollectedHeap : VMStructs {
         return _collected_heap_addr != NULL && _is_gc_active_offset >= 0 &&
                _collected_heap_addr[_is_gc_active_offset] != 0;
     }
+
+    // Whether the address belongs to the reserved Java heap range
+    static bool contains(uintptr_t address) {
+        if (_collected_heap_addr == NULL || _heap_reserved_offset < 0 || _region_start_offset < 0 || _region_size_offset < 0) {
+            return false;
+        }
+        const char* reserved = _collected_heap_addr + _heap_reserved_offset;
+        uintptr_t start = *(uintptr_t*)(reserved + _region_start_offset);
+        size_t word_size = *(size_t*)(reserved + _region_size_offset);
+        return address - start < word_size * sizeof(uintptr_t);
+    }
+
+    static VMKlass* findObjectKlass(uintptr_t address);
 };
 
 class DisableSweeper : VMStructs {
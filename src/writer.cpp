@@ -0,0 +1,136 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include "writer.h"
+
+
+#ifdef __APPLE__
+static const char ZLIB_NAME[] = "libz.dylib";
+#else
+static const char ZLIB_NAME[] = "libz.so.1";
+#endif
+
+// zlib is not a build dependency: the library is loaded at runtime, if available.
+// The layout below mirrors z_stream; zlib verifies it by the version and struct size
+// passed to deflateInit2_, so an incompatible library fails to initialize rather than crashes.
+struct ZStream {
+    const unsigned char* next_in;
+    unsigned int avail_in;
+    unsigned long total_in;
+    unsigned char* next_out;
+    unsigned int avail_out;
+    unsigned long total_out;
+    const char* msg;
+    void* state;
+    void* zalloc;
+    void* zfree;
+    void* opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+};
+
+enum {
+    Z_NO_FLUSH = 0,
+    Z_FINISH = 4,
+    Z_OK = 0,
+    Z_DEFLATED = 8,
+    Z_DEFAULT_STRATEGY = 0,
+    GZIP_WINDOW_BITS = 15 + 16,
+    GZIP_LEVEL = 6,
+    GZIP_MEM_LEVEL = 8
+};
+
+typedef int (*deflateInit2_t)(ZStream*, int, int, int, int, int, const char*, int);
+typedef int (*deflate_t)(ZStream*, int);
+typedef int (*deflateEnd_t)(ZStream*);
+
+static deflateInit2_t _deflateInit2 = NULL;
+static deflate_t _deflate = NULL;
+static deflateEnd_t _deflateEnd = NULL;
+
+static bool loadZlib() {
+    if (_deflateEnd == NULL) {
+        void* lib = dlopen(ZLIB_NAME, RTLD_LAZY);
+        if (lib == NULL) {
+            return false;
+        }
+        _deflateInit2 = (deflateInit2_t)dlsym(lib, "deflateInit2_");
+        _deflate = (deflate_t)dlsym(lib, "deflate");
+        _deflateEnd = (deflateEnd_t)dlsym(lib, "deflateEnd");
+    }
+    return _deflateInit2 != NULL && _deflate != NULL && _deflateEnd != NULL;
+}
+
+
+Writer::Writer(std::ostream& out) : _out(out), _pos(0), _zs(NULL), _zbuf(NULL) {
+    _buf = (char*)malloc(WRITER_BUFFER_SIZE);
+}
+
+Writer::~Writer() {
+    close();
+    free(_buf);
+}
+
+Error Writer::gzip() {
+    if (!loadZlib()) {
+        return Error("Could not load zlib");
+    }
+
+    ZStream* zs = (ZStream*)calloc(1, sizeof(ZStream));
+    if (_deflateInit2(zs, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY,
+                      "1.2.11", sizeof(ZStream)) != Z_OK) {
+        free(zs);
+        return Error("Incompatible zlib version");
+    }
+
+    _zs = zs;
+    _zbuf = (char*)malloc(WRITER_BUFFER_SIZE);
+    return Error::OK;
+}
+
+void Writer::flushBuffer(bool finish) {
+    if (_zs == NULL) {
+        if (_pos > 0) {
+            _out.write(_buf, _pos);
+        }
+    } else {
+        _zs->next_in = (const unsigned char*)_buf;
+        _zs->avail_in = _pos;
+        do {
+            _zs->next_out = (unsigned char*)_zbuf;
+            _zs->avail_out = WRITER_BUFFER_SIZE;
+            _deflate(_zs, finish ? Z_FINISH : Z_NO_FLUSH);
+            _out.write(_zbuf, WRITER_BUFFER_SIZE - _zs->avail_out);
+        } while (_zs->avail_out == 0);
+    }
+    _pos = 0;
+}
+
+void Writer::close() {
+    flushBuffer(true);
+
+    if (_zs != NULL) {
+        _deflateEnd(_zs);
+        free(_zs);
+        free(_zbuf);
+        _zs = NULL;
+        _zbuf = NULL;
+    }
+    _out.flush();
+}
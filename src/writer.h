@@ -0,0 +1,86 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WRITER_H
+#define _WRITER_H
+
+#include <iostream>
+#include <string.h>
+#include "arch.h"
+#include "arguments.h"
+
+
+const size_t WRITER_BUFFER_SIZE = 1024 * 1024;
+
+
+struct ZStream;
+
+// Collects output in a large buffer and passes it to the stream in big chunks,
+// optionally compressing it on the fly with gzip
+class Writer {
+  private:
+    std::ostream& _out;
+    char* _buf;
+    size_t _pos;
+    ZStream* _zs;
+    char* _zbuf;
+
+    void flushBuffer(bool finish = false);
+
+  public:
+    Writer(std::ostream& out);
+    ~Writer();
+
+    // Must be called before anything is written
+    Error gzip();
+
+    void write(const char* s, size_t len) {
+        if (len > WRITER_BUFFER_SIZE - _pos) {
+            flushBuffer();
+            if (len > WRITER_BUFFER_SIZE) {
+                // Still does not fit: write through in buffer-sized pieces
+                for (; len > WRITER_BUFFER_SIZE; s += WRITER_BUFFER_SIZE, len -= WRITER_BUFFER_SIZE) {
+                    memcpy(_buf, s, WRITER_BUFFER_SIZE);
+                    _pos = WRITER_BUFFER_SIZE;
+                    flushBuffer();
+                }
+            }
+        }
+        memcpy(_buf + _pos, s, len);
+        _pos += len;
+    }
+
+    void write(char c) {
+        if (_pos == WRITER_BUFFER_SIZE) {
+            flushBuffer();
+        }
+        _buf[_pos++] = c;
+    }
+
+    void write(u64 value) {
+        char num[24];
+        char* p = num + sizeof(num);
+        do {
+            *--p = '0' + char(value % 10);
+        } while ((value /= 10) > 0);
+        write(p, num + sizeof(num) - p);
+    }
+
+    // Flushes the buffer and completes the gzip stream, if any
+    void close();
+};
+
+#endif // _WRITER_H
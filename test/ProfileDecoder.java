@@ -0,0 +1,358 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import java.io.ByteArrayOutputStream;
+import java.io.FileInputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.RandomAccessFile;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.channels.FileChannel;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.zip.GZIPInputStream;
+
+/**
+ * Reads a profile in the binary or pprof output format, checks its consistency
+ * and prints it back as collapsed stacks, so that tests can grep it like a text output.
+ *
+ * Usage: java ProfileDecoder binary|pprof FILE
+ */
+public class ProfileDecoder {
+
+    public static void main(String[] args) throws Exception {
+        if (args.length < 2) {
+            System.out.println("Usage: java ProfileDecoder binary|pprof FILE");
+            System.exit(1);
+        }
+
+        if (args[0].equals("binary")) {
+            decodeBinary(args[1]);
+        } else if (args[0].equals("pprof")) {
+            decodePprof(args[1]);
+        } else {
+            throw new IllegalArgumentException("Unknown format: " + args[0]);
+        }
+    }
+
+    private static void check(boolean condition, String message) {
+        if (!condition) {
+            throw new IllegalStateException(message);
+        }
+    }
+
+    // See src/binaryProfile.h for the layout
+    private static void decodeBinary(String fileName) throws IOException {
+        ByteBuffer buf;
+        try (RandomAccessFile raf = new RandomAccessFile(fileName, "r")) {
+            buf = raf.getChannel().map(FileChannel.MapMode.READ_ONLY, 0, raf.length());
+        }
+        buf.order(ByteOrder.LITTLE_ENDIAN);
+
+        byte[] magic = new byte[8];
+        buf.get(magic);
+        check(new String(magic, 0, 5, "ISO-8859-1").equals("APROF"), "Bad magic");
+        check(buf.getInt(8) == 1, "Unsupported version");
+        check(buf.getInt(12) == 80, "Unexpected header size");
+
+        int stringCount = buf.getInt(16);
+        int frameCount = buf.getInt(20);
+        int stackCount = buf.getInt(24);
+        int title = buf.getInt(28);
+        int stringOffsets = (int) buf.getLong(32);
+        int stringData = (int) buf.getLong(40);
+        int frames = (int) buf.getLong(48);
+        int stacks = (int) buf.getLong(56);
+        long totalSamples = buf.getLong(64);
+        long totalCounter = buf.getLong(72);
+
+        check(stringOffsets % 8 == 0 && stringData % 8 == 0 && frames % 8 == 0 && stacks % 8 == 0,
+                "Sections are not 8-byte aligned");
+        check(stringData >= stringOffsets + (stringCount + 1) * 4, "String offsets overlap string data");
+        check(stacks == frames + frameCount * 8, "Stacks do not follow frames");
+        check(stacks + stackCount * 24 == buf.limit(), "File size does not match the header");
+        check(title < stringCount, "Title is out of range");
+        check(stackCount > 0, "No root stack");
+
+        String[] strings = new String[stringCount];
+        check(buf.getInt(stringOffsets) == 0, "First string does not start at 0");
+        for (int i = 0; i < stringCount; i++) {
+            int start = buf.getInt(stringOffsets + i * 4);
+            int end = buf.getInt(stringOffsets + i * 4 + 4);
+            check(start < end && stringData + end <= frames, "String offset out of range");
+            check(buf.get(stringData + end - 1) == 0, "String is not NUL-terminated");
+            byte[] bytes = new byte[end - start - 1];
+            for (int j = 0; j < bytes.length; j++) {
+                bytes[j] = buf.get(stringData + start + j);
+            }
+            strings[i] = new String(bytes, "UTF-8");
+        }
+
+        String[] frameNames = new String[frameCount];
+        for (int i = 0; i < frameCount; i++) {
+            int name = buf.getInt(frames + i * 8);
+            int type = buf.getInt(frames + i * 8 + 4);
+            check(name < stringCount, "Frame name is out of range");
+            check(type >= 0 && type <= 4, "Unknown frame type");
+            frameNames[i] = strings[name];
+        }
+
+        String[] paths = new String[stackCount];
+        long samples = 0;
+        long counter = 0;
+        for (int i = 0; i < stackCount; i++) {
+            int parent = buf.getInt(stacks + i * 24);
+            int frame = buf.getInt(stacks + i * 24 + 4);
+            long stackSamples = buf.getLong(stacks + i * 24 + 8);
+            long stackCounter = buf.getLong(stacks + i * 24 + 16);
+
+            if (i == 0) {
+                paths[i] = "";
+            } else {
+                check(parent < i, "Parent stack does not precede its child");
+                check(frame < frameCount, "Stack frame is out of range");
+                paths[i] = parent == 0 ? frameNames[frame] : paths[parent] + ';' + frameNames[frame];
+            }
+
+            if (stackSamples > 0) {
+                check(i > 0, "Samples in the root stack");
+                System.out.println(paths[i] + ' ' + stackSamples);
+            }
+            samples += stackSamples;
+            counter += stackCounter;
+        }
+
+        check(samples == totalSamples, "Total samples do not match");
+        check(counter == totalCounter, "Total counter does not match");
+    }
+
+    private static void decodePprof(String fileName) throws IOException {
+        byte[] data = readAll(new FileInputStream(fileName));
+        if (data.length >= 2 && (data[0] & 0xff) == 0x1f && (data[1] & 0xff) == 0x8b) {
+            data = readAll(new GZIPInputStream(new FileInputStream(fileName)));
+        }
+
+        List<String> strings = new ArrayList<>();
+        Map<Long, Long> functionNames = new HashMap<>();
+        Map<Long, Long> locationFunctions = new HashMap<>();
+        List<long[]> sampleLocations = new ArrayList<>();
+        List<long[]> sampleValues = new ArrayList<>();
+        int sampleTypes = 0;
+
+        ProtoReader profile = new ProtoReader(data, 0, data.length);
+        while (profile.hasMore()) {
+            int tag = profile.tag();
+            switch (tag >>> 3) {
+                case 1:
+                    profile.message();
+                    sampleTypes++;
+                    break;
+                case 2: {
+                    ProtoReader sample = profile.message();
+                    long[] locations = new long[0];
+                    long[] values = new long[0];
+                    while (sample.hasMore()) {
+                        int sampleTag = sample.tag();
+                        if (sampleTag >>> 3 == 1) {
+                            locations = concat(locations, sample.varints(sampleTag));
+                        } else if (sampleTag >>> 3 == 2) {
+                            values = concat(values, sample.varints(sampleTag));
+                        } else {
+                            sample.skip(sampleTag);
+                        }
+                    }
+                    sampleLocations.add(locations);
+                    sampleValues.add(values);
+                    break;
+                }
+                case 4: {
+                    ProtoReader location = profile.message();
+                    long id = 0;
+                    long function = 0;
+                    while (location.hasMore()) {
+                        int locationTag = location.tag();
+                        if (locationTag >>> 3 == 1) {
+                            id = location.varint();
+                        } else if (locationTag >>> 3 == 4) {
+                            ProtoReader line = location.message();
+                            while (line.hasMore()) {
+                                int lineTag = line.tag();
+                                if (lineTag >>> 3 == 1) {
+                                    function = line.varint();
+                                } else {
+                                    line.skip(lineTag);
+                                }
+                            }
+                        } else {
+                            location.skip(locationTag);
+                        }
+                    }
+                    check(id != 0 && !locationFunctions.containsKey(id), "Bad location id");
+                    locationFunctions.put(id, function);
+                    break;
+                }
+                case 5: {
+                    ProtoReader function = profile.message();
+                    long id = 0;
+                    long name = 0;
+                    while (function.hasMore()) {
+                        int functionTag = function.tag();
+                        if (functionTag >>> 3 == 1) {
+                            id = function.varint();
+                        } else if (functionTag >>> 3 == 2) {
+                            name = function.varint();
+                        } else {
+                            function.skip(functionTag);
+                        }
+                    }
+                    check(id != 0 && !functionNames.containsKey(id), "Bad function id");
+                    functionNames.put(id, name);
+                    break;
+                }
+                case 6:
+                    strings.add(profile.string());
+                    break;
+                default:
+                    profile.skip(tag);
+            }
+        }
+
+        check(!strings.isEmpty() && strings.get(0).isEmpty(), "String table must start with an empty string");
+        check(sampleTypes == 2, "Expected samples and counter value types");
+
+        for (int i = 0; i < sampleLocations.size(); i++) {
+            long[] locations = sampleLocations.get(i);
+            long[] values = sampleValues.get(i);
+            check(values.length == sampleTypes, "Sample values do not match sample types");
+
+            // Locations are listed from the leaf to the root
+            StringBuilder sb = new StringBuilder();
+            for (int j = locations.length - 1; j >= 0; j--) {
+                Long function = locationFunctions.get(locations[j]);
+                check(function != null, "Unknown location " + locations[j]);
+                Long name = functionNames.get(function);
+                check(name != null, "Unknown function " + function);
+                check(name < strings.size(), "Function name is out of range");
+                if (sb.length() > 0) sb.append(';');
+                sb.append(strings.get(name.intValue()));
+            }
+            System.out.println(sb.append(' ').append(values[0]));
+        }
+    }
+
+    private static long[] concat(long[] a, long[] b) {
+        long[] result = new long[a.length + b.length];
+        System.arraycopy(a, 0, result, 0, a.length);
+        System.arraycopy(b, 0, result, a.length, b.length);
+        return result;
+    }
+
+    private static byte[] readAll(InputStream in) throws IOException {
+        try {
+            ByteArrayOutputStream out = new ByteArrayOutputStream();
+            byte[] buf = new byte[65536];
+            for (int n; (n = in.read(buf)) > 0; ) {
+                out.write(buf, 0, n);
+            }
+            return out.toByteArray();
+        } finally {
+            in.close();
+        }
+    }
+
+    // Minimal protobuf decoder: varints, length-delimited fields and packed repeated varints
+    static class ProtoReader {
+        private final byte[] buf;
+        private int pos;
+        private final int limit;
+
+        ProtoReader(byte[] buf, int offset, int limit) {
+            this.buf = buf;
+            this.pos = offset;
+            this.limit = limit;
+        }
+
+        boolean hasMore() {
+            return pos < limit;
+        }
+
+        int tag() {
+            return (int) varint();
+        }
+
+        long varint() {
+            long result = 0;
+            for (int shift = 0; ; shift += 7) {
+                check(pos < limit, "Truncated varint");
+                byte b = buf[pos++];
+                result |= (long) (b & 0x7f) << shift;
+                if (b >= 0) {
+                    return result;
+                }
+            }
+        }
+
+        ProtoReader message() {
+            int length = (int) varint();
+            check(length >= 0 && pos + length <= limit, "Truncated message");
+            ProtoReader reader = new ProtoReader(buf, pos, pos + length);
+            pos += length;
+            return reader;
+        }
+
+        String string() throws IOException {
+            int length = (int) varint();
+            check(length >= 0 && pos + length <= limit, "Truncated string");
+            String s = new String(buf, pos, length, "UTF-8");
+            pos += length;
+            return s;
+        }
+
+        long[] varints(int tag) {
+            if ((tag & 7) == 0) {
+                return new long[]{varint()};
+            }
+            ProtoReader packed = message();
+            long[] values = new long[0];
+            while (packed.hasMore()) {
+                values = concat(values, new long[]{packed.varint()});
+            }
+            return values;
+        }
+
+        void skip(int tag) {
+            switch (tag & 7) {
+                case 0:
+                    varint();
+                    break;
+                case 1:
+                    pos += 8;
+                    break;
+                case 2:
+                    message();
+                    break;
+                case 5:
+                    pos += 4;
+                    break;
+                default:
+                    throw new IllegalStateException("Unsupported wire type " + (tag & 7));
+            }
+        }
+    }
+}
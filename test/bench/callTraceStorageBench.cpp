@@ -0,0 +1,149 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the latency of CallTraceStorage::put, which is what the signal handler pays per sample,
+// with every MemoryPolicy. One thread runs on each CPU; results are grouped by NUMA node.
+//
+// So far it has only been run on single-node machines, where the numa policy cannot show
+// any benefit. The effect of huge pages and NUMA placement on multi-socket hardware,
+// which these policies are meant for, is not measured yet.
+//
+// Usage: callTraceStorageBench [samples per thread] [distinct traces]
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "callTraceStorage.h"
+#include "os.h"
+
+
+const int TRACE_DEPTH = 64;
+const int MAX_NODES = 64;
+
+struct Policy {
+    const char* name;
+    int bits;
+};
+
+static const Policy POLICIES[] = {
+    {"default", 0},
+    {"thp", MEMORY_HUGE_PAGES},
+    {"explicit", MEMORY_HUGETLB},
+    {"numa", MEMORY_NUMA},
+    {"thp+numa", MEMORY_HUGE_PAGES | MEMORY_NUMA}
+};
+
+// Static rather than heap allocated, so that cache line aligned members stay aligned
+static CallTraceStorage storages[sizeof(POLICIES) / sizeof(POLICIES[0])];
+static CallTraceStorage* storage;
+static ASGCT_CallFrame* traces;
+static long samples_per_thread;
+static long distinct_traces;
+
+struct ThreadResult {
+    int cpu;
+    int node;
+    u64 nanos;
+};
+
+static void* benchThread(void* arg) {
+    ThreadResult* result = (ThreadResult*)arg;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(result->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    result->node = OS::numaNode();
+
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    unsigned int seed = result->cpu + 1;
+
+    u64 nanos = 0;
+    for (long i = 0; i < samples_per_thread; i++) {
+        // Skewed choice: a few traces are hot, the majority is rare
+        long r = rand_r(&seed) % distinct_traces;
+        long index = r * r / distinct_traces * r / distinct_traces;
+        for (int j = 0; j < TRACE_DEPTH; j++) {
+            frames[j] = traces[index * TRACE_DEPTH + j];
+        }
+
+        u64 start = OS::nanotime();
+        storage->put(TRACE_DEPTH, frames, 1);
+        nanos += OS::nanotime() - start;
+    }
+
+    result->nanos = nanos;
+    return NULL;
+}
+
+static void runBenchmark(const Policy& policy, CallTraceStorage* policy_storage, int cpus) {
+    storage = policy_storage;
+    storage->setMemoryPolicy(policy.bits);
+
+    ThreadResult* results = new ThreadResult[cpus];
+    pthread_t* threads = new pthread_t[cpus];
+    for (int i = 0; i < cpus; i++) {
+        results[i].cpu = i;
+        pthread_create(&threads[i], NULL, benchThread, &results[i]);
+    }
+
+    u64 node_nanos[MAX_NODES] = {0};
+    int node_threads[MAX_NODES] = {0};
+    for (int i = 0; i < cpus; i++) {
+        pthread_join(threads[i], NULL);
+        int node = results[i].node % MAX_NODES;
+        node_nanos[node] += results[i].nanos;
+        node_threads[node]++;
+    }
+
+    for (int node = 0; node < MAX_NODES; node++) {
+        if (node_threads[node] > 0) {
+            printf("%-10s node %-3d threads %-4d %8.1f ns/sample\n", policy.name, node, node_threads[node],
+                   (double)node_nanos[node] / node_threads[node] / samples_per_thread);
+        }
+    }
+
+    delete[] threads;
+    delete[] results;
+    // CallTraceStorage deliberately does not release its memory
+    storage->clear();
+}
+
+int main(int argc, char** argv) {
+    samples_per_thread = argc > 1 ? atol(argv[1]) : 1000000;
+    distinct_traces = argc > 2 ? atol(argv[2]) : 100000;
+
+    srand(1);
+    traces = new ASGCT_CallFrame[distinct_traces * TRACE_DEPTH];
+    for (long i = 0; i < distinct_traces * TRACE_DEPTH; i++) {
+        traces[i].bci = rand() % 100;
+        traces[i].method_id = (jmethodID)(uintptr_t)((rand() % 10000 + 1) * 8);
+    }
+
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%d CPUs, %d NUMA nodes, %ld samples per thread, %ld distinct traces\n",
+           cpus, OS::numaNodes(), samples_per_thread, distinct_traces);
+
+    for (size_t i = 0; i < sizeof(POLICIES) / sizeof(POLICIES[0]); i++) {
+        runBenchmark(POLICIES[i], &storages[i], cpus);
+    }
+    return 0;
+}
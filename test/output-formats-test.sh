@@ -0,0 +1,55 @@
+#!/bin/bash
+
+set -e  # exit on any failure
+set -x  # print all executed lines
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+(
+  cd $(dirname $0)
+
+  if [ "Target.class" -ot "Target.java" ]; then
+     ${JAVA_HOME}/bin/javac Target.java
+  fi
+  if [ "ProfileDecoder.class" -ot "ProfileDecoder.java" ]; then
+     ${JAVA_HOME}/bin/javac ProfileDecoder.java
+  fi
+
+  ${JAVA_HOME}/bin/java Target &
+
+  FILENAME=/tmp/java.trace
+  JAVAPID=$!
+
+  sleep 1     # allow the Java runtime to initialize
+
+  # Binary and pprof outputs are decoded back into collapsed stacks
+  function assert_string() {
+    if ! grep -q "$1" $FILENAME; then
+      exit 1
+    fi
+  }
+
+  ../profiler.sh -f /tmp/java.bin -o binary -d 3 $JAVAPID
+  ${JAVA_HOME}/bin/java ProfileDecoder binary /tmp/java.bin > $FILENAME
+
+  assert_string "Target.main;Target.method1 "
+  assert_string "Target.main;Target.method2 "
+  assert_string "Target.main;Target.method3;java/io/File"
+
+  ../profiler.sh -f /tmp/java.pb -o pprof -d 3 $JAVAPID
+  ${JAVA_HOME}/bin/java ProfileDecoder pprof /tmp/java.pb > $FILENAME
+
+  assert_string "Target.main;Target.method1 "
+  assert_string "Target.main;Target.method2 "
+  assert_string "Target.main;Target.method3;java/io/File"
+
+  # Cross-check with the reference implementation when it is available
+  if command -v go > /dev/null; then
+    go tool pprof -raw /tmp/java.pb > /dev/null
+  fi
+
+  kill $JAVAPID
+)
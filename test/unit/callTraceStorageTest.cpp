@@ -0,0 +1,113 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Dumps CallTraceStorage while writer threads keep inserting new traces,
+// as the snapshot action does with a live profiler.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "callTraceStorage.h"
+
+
+const int TRACE_DEPTH = 16;
+const int WRITERS = 4;
+// Enough distinct traces to make the hash table grow a few times
+const long TRACES_PER_WRITER = 100000;
+
+static CallTraceStorage storage;
+static volatile int running_writers = WRITERS;
+
+static void fail(const char* message) {
+    fprintf(stderr, "FAILED: %s\n", message);
+    exit(1);
+}
+
+static void* writerThread(void* arg) {
+    long writer = (long)arg;
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+
+    for (long i = 0; i < TRACES_PER_WRITER; i++) {
+        for (int j = 0; j < TRACE_DEPTH; j++) {
+            frames[j].bci = j;
+            frames[j].method_id = (jmethodID)(uintptr_t)((writer * TRACES_PER_WRITER + i + 1) * 8);
+        }
+        if (storage.put(TRACE_DEPTH, frames, 1) == 0) {
+            fail("put returned 0");
+        }
+    }
+
+    __sync_fetch_and_sub(&running_writers, 1);
+    return NULL;
+}
+
+static void checkTrace(CallTrace* trace) {
+    if (trace == NULL) {
+        fail("collected a slot without a trace");
+    }
+    if (trace->num_frames != TRACE_DEPTH) {
+        fail("collected a trace with wrong depth");
+    }
+}
+
+// Returns the number of samples seen
+static u64 dumpOnce() {
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
+        checkTrace(it->second);
+    }
+
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    for (size_t i = 0; i < samples.size(); i++) {
+        checkTrace(samples[i]->trace);
+    }
+
+    std::map<u64, CallTraceSample> merged;
+    storage.collectSamples(merged);
+    u64 total = 0;
+    for (std::map<u64, CallTraceSample>::const_iterator it = merged.begin(); it != merged.end(); ++it) {
+        checkTrace(it->second.trace);
+        total += it->second.samples;
+    }
+    return total;
+}
+
+int main() {
+    pthread_t threads[WRITERS];
+    for (long i = 0; i < WRITERS; i++) {
+        pthread_create(&threads[i], NULL, writerThread, (void*)i);
+    }
+
+    int dumps = 0;
+    while (running_writers > 0) {
+        dumpOnce();
+        dumps++;
+    }
+
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (dumpOnce() != WRITERS * TRACES_PER_WRITER) {
+        fail("samples lost");
+    }
+
+    printf("callTraceStorageTest: %d concurrent dumps OK\n", dumps);
+    return 0;
+}
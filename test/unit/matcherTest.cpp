@@ -0,0 +1,118 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks include/exclude pattern matching of Matcher against every kind of pattern,
+// alone and combined into one automaton.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "matcher.h"
+
+
+static int failures = 0;
+
+static void expect(const char* patterns[], int count, const char* s, bool expected) {
+    Matcher matcher;
+    for (int i = 0; i < count; i++) {
+        matcher.add(patterns[i]);
+    }
+    matcher.compile();
+
+    if (matcher.matches(s) != expected) {
+        fprintf(stderr, "FAILED: \"%s\" should %smatch", s, expected ? "" : "not ");
+        for (int i = 0; i < count; i++) {
+            fprintf(stderr, " \"%s\"", patterns[i]);
+        }
+        fprintf(stderr, "\n");
+        failures++;
+    }
+}
+
+#define EXPECT(s, expected, ...) {                                          \
+    const char* patterns[] = {__VA_ARGS__};                                 \
+    expect(patterns, sizeof(patterns) / sizeof(patterns[0]), s, expected);  \
+}
+
+int main() {
+    // No patterns
+    {
+        Matcher matcher;
+        matcher.compile();
+        if (!matcher.empty() || matcher.matches("java/lang/Thread.run")) {
+            fprintf(stderr, "FAILED: empty matcher\n");
+            failures++;
+        }
+    }
+
+    // Exact
+    EXPECT("java/lang/Thread.run", true, "java/lang/Thread.run");
+    EXPECT("java/lang/Thread.run0", false, "java/lang/Thread.run");
+    EXPECT("xjava/lang/Thread.run", false, "java/lang/Thread.run");
+    EXPECT("java/lang/Thread", false, "java/lang/Thread.run");
+    EXPECT("", false, "java/lang/Thread.run");
+
+    // Prefix
+    EXPECT("java/lang/Thread.run", true, "java/*");
+    EXPECT("java/", true, "java/*");
+    EXPECT("javax/swing/JFrame", false, "java/*");
+    EXPECT("sun/java/Foo", false, "java/*");
+
+    // Suffix
+    EXPECT("java/io/FileInputStream.read", true, "*.read");
+    EXPECT(".read", true, "*.read");
+    EXPECT("java/io/FileInputStream.readBytes", false, "*.read");
+    EXPECT("read", false, "*.read");
+
+    // Contains
+    EXPECT("java/util/HashMap.put", true, "*HashMap*");
+    EXPECT("HashMap", true, "*HashMap*");
+    EXPECT("java/util/concurrent/ConcurrentHashMap.get", true, "*HashMap*");
+    EXPECT("java/util/TreeMap.put", false, "*HashMap*");
+    EXPECT("java/util/Hash.Map", false, "*HashMap*");
+
+    // Wildcards alone match everything, including an empty string
+    EXPECT("java/lang/Thread.run", true, "*");
+    EXPECT("", true, "*");
+    EXPECT("java/lang/Thread.run", true, "**");
+    EXPECT("", true, "**");
+
+    // Overlapping patterns in one automaton: a failed branch must fall back
+    // to the longest suffix that is a prefix of another pattern
+    EXPECT("abcd", true, "*abce*", "*bcd*");
+    EXPECT("aabab", true, "*abab*", "*aab");
+    EXPECT("xabcx", true, "*bc*", "abc*", "*abcd");
+    EXPECT("abcx", true, "*bc*", "abc*", "*abcd");
+    EXPECT("abx", false, "*bc*", "abc*", "*abcd");
+    EXPECT("java/util/HashMap.put", true, "java/util/HashMap.get", "*HashMap.put");
+    EXPECT("java/util/HashMap.get", true, "java/util/HashMap.get", "*HashMap.put");
+    EXPECT("java/util/HashMap.remove", false, "java/util/HashMap.get", "*HashMap.put");
+    EXPECT("java/lang/String.hashCode", true, "java/*", "*.hashCode", "java/lang/String.hashCode");
+    EXPECT("sun/misc/Unsafe.park", true, "java/*", "*.park", "*Unsafe*");
+    EXPECT("sun/misc/Unsafe.parkNanos", true, "java/*", "*.park", "*Unsafe*");
+    EXPECT("sun/misc/Signal.raise", false, "java/*", "*.park", "*Unsafe*");
+
+    // A pattern that is a proper part of another one
+    EXPECT("Thread", true, "Thread", "*Thread.run");
+    EXPECT("Thread.run", false, "Thread", "Thread.run0");
+    EXPECT("MyThread.run", true, "Thread", "*Thread.run");
+
+    if (failures > 0) {
+        fprintf(stderr, "matcherTest: %d failures\n", failures);
+        return 1;
+    }
+    printf("matcherTest: OK\n");
+    return 0;
+}